@@ -0,0 +1,115 @@
+/* Adaptive classification of the points of a num_x * num_y * num_z grid.
+ * The grid is subdivided as an octree over point indices: a cell whose points
+ * span a box that no triangle touches is entirely on one side of the surface,
+ * so one point is classified for the whole cell. Only the cells crossing the
+ * surface are refined down to single points, the number of classified points
+ * grows with the surface area instead of the volume. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+// Grid points [lo[axis], hi[axis]) along each axis
+struct GridCell {
+  int lo[3], hi[3];
+
+  int64_t num_points() const {
+    return int64_t(hi[0] - lo[0]) * (hi[1] - lo[1]) * (hi[2] - lo[2]);
+  }
+};
+
+struct GridPoint {
+  int i, j, k;
+};
+
+/* Classifies the points of root level by level. touches(cell) tells whether
+ * the surface may touch the box spanned by the points of cell, it is called
+ * in parallel. classify(points, inside) sets inside[p] to 1 when points[p] is
+ * inside and 0 otherwise, it is called once per level with every point the
+ * level needs (one per cell no triangle touches, all the points of the cells
+ * of at most min_cell_points points) and should parallelize over them. emit
+ * is called with the cells whose points are all inside from the calling
+ * thread only, in the same order on every run. Returns the number of
+ * classified points. */
+template <typename Touches, typename Classify, typename Emit>
+int64_t classify_grid_adaptive(const GridCell &root, int min_cell_points,
+                               const Touches &touches,
+                               const Classify &classify, const Emit &emit) {
+  const int64_t max_leaf_points = std::max<int64_t>(min_cell_points, 1);
+  int64_t num_classified = 0;
+  std::vector<GridCell> cells;
+  if (root.num_points() > 0) {
+    cells.push_back(root);
+  }
+  std::vector<char> refine;
+  std::vector<int> indices;
+  std::vector<GridCell> children;
+  // The points classified for a level and the cell each one stands for
+  std::vector<GridPoint> points;
+  std::vector<GridCell> owners;
+  std::vector<char> inside;
+
+  while (!cells.empty()) {
+    refine.resize(cells.size());
+    indices.resize(cells.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    std::for_each(std::execution::par, indices.begin(), indices.end(),
+                  [&](int c) {
+                    refine[c] = cells[c].num_points() > max_leaf_points &&
+                                touches(cells[c]);
+                  });
+
+    children.clear();
+    points.clear();
+    owners.clear();
+    for (size_t c = 0; c < cells.size(); c++) {
+      const GridCell &cell = cells[c];
+      if (refine[c]) {
+        int mid[3];
+        for (int axis = 0; axis < 3; axis++) {
+          mid[axis] = cell.lo[axis] + (cell.hi[axis] - cell.lo[axis]) / 2;
+        }
+        for (int child = 0; child < 8; child++) {
+          GridCell out;
+          for (int axis = 0; axis < 3; axis++) {
+            const bool upper = (child >> axis) & 1;
+            out.lo[axis] = upper ? mid[axis] : cell.lo[axis];
+            out.hi[axis] = upper ? cell.hi[axis] : mid[axis];
+          }
+          if (out.num_points() > 0) {
+            children.push_back(out);
+          }
+        }
+      } else if (cell.num_points() > max_leaf_points) {
+        // No triangle touches the cell, its first point decides it
+        points.push_back({cell.lo[0], cell.lo[1], cell.lo[2]});
+        owners.push_back(cell);
+      } else {
+        for (int i = cell.lo[0]; i < cell.hi[0]; i++) {
+          for (int j = cell.lo[1]; j < cell.hi[1]; j++) {
+            for (int k = cell.lo[2]; k < cell.hi[2]; k++) {
+              points.push_back({i, j, k});
+              owners.push_back({{i, j, k}, {i + 1, j + 1, k + 1}});
+            }
+          }
+        }
+      }
+    }
+
+    if (!points.empty()) {
+      classify(points, inside);
+      num_classified += points.size();
+      for (size_t p = 0; p < points.size(); p++) {
+        if (inside[p]) {
+          emit(owners[p]);
+        }
+      }
+    }
+    cells.swap(children);
+  }
+  return num_classified;
+}
@@ -1,18 +1,45 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include "bvh.hh"
+#include "compressed_bvh.hh"
 #include "stl_io.hh"
 #include "timers.hh"
 
 using namespace mp::io;
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    puts("Usage: bvh input.stl");
+  if (argc < 2 || argc > 4) {
+    puts("Usage: bvh input.stl [builder] [snapshot.bvh]\n"
+         "builder: midpoint (default), lbvh, lbvh63, lbvh_treelets or sbvh\n"
+         "snapshot: loaded instead of building when it matches the mesh, "
+         "otherwise (re)written after building");
     return 1;
   }
 
+  BVHBuildOptions options;
+  if (argc >= 3) {
+    std::string builder = argv[2];
+    if (builder == "lbvh") {
+      options.method = BVHBuildMethod::LBVH;
+    } else if (builder == "lbvh63") {
+      options.method = BVHBuildMethod::LBVH;
+      options.morton_63_bits = true;
+    } else if (builder == "lbvh_treelets") {
+      options.method = BVHBuildMethod::LBVH;
+      options.morton_63_bits = true;
+      options.treelet_passes = 3;
+    } else if (builder == "sbvh") {
+      options.method = BVHBuildMethod::SBVH;
+    } else if (builder != "midpoint") {
+      puts("ERROR: Unknown builder.");
+      return 1;
+    }
+  }
+
   std::vector<stl::Triangle> tris_stl;
   stl::read_stl(argv[1], tris_stl);
 
@@ -28,13 +55,105 @@ int main(int argc, char **argv) {
   }
 
   Timer t;
-  BVH bvh(input_tris);
-  t.tock("Building BVH");
+  auto load_or_build = [&]() {
+    if (argc == 4) {
+      try {
+        BVH bvh = BVH::load(argv[3], input_tris);
+        t.tock("Loading BVH snapshot");
+        return bvh;
+      } catch (const char *error) {
+        std::cout << "BVH snapshot not used: " << error << std::endl;
+        t.tick();
+      }
+    }
+    BVH bvh(input_tris, options);
+    t.tock("Building BVH");
+    if (argc == 4) {
+      t.tick();
+      bvh.save(argv[3]);
+      t.tock("Saving BVH snapshot");
+    }
+    return bvh;
+  };
+  BVH bvh = load_or_build();
   std::cout << "Number of BVH nodes = " << bvh.count() << std::endl;
+  std::cout << "BVH stats = ";
+  bvh.stats().write_json(std::cout);
+  std::cout << std::endl;
 
   t.tick();
-  bvh.self_overlap();
+  BVHCandidatePairBuffers pairs;
+  bvh.self_overlap(pairs);
   t.tock("Self overlap");
+  std::cout << "Candidate triangle pairs = " << count_pairs(pairs)
+            << std::endl;
+
+  t.tick();
+  BVHIntersectionBuffers intersections;
+  bvh.self_intersect(intersections);
+  t.tock("Self intersection");
+  std::cout << "Self intersecting triangle pairs = "
+            << count_pairs(intersections) << std::endl;
+
+  // Probe points on a grid over the mesh bounds
+  const int probes_per_axis = 50;
+  BBox bounds = bvh.nodes()[0].bbox();
+  Vec3 step = (bounds.max - bounds.min) / float(probes_per_axis - 1);
+  std::vector<Vec3> probes;
+  probes.reserve(probes_per_axis * probes_per_axis * probes_per_axis);
+  for (int i = 0; i < probes_per_axis; i++) {
+    for (int j = 0; j < probes_per_axis; j++) {
+      for (int k = 0; k < probes_per_axis; k++) {
+        probes.push_back(
+            {bounds.min.x + i * step.x, bounds.min.y + j * step.y,
+             bounds.min.z + k * step.z});
+      }
+    }
+  }
+
+  reset_bvh_query_stats();
+  t.tick();
+  std::vector<BVHClosestPoint> closest;
+  bvh.closest_points(probes, closest);
+  t.tock("Closest points");
+#ifdef BVH_QUERY_STATS
+  std::cout << "Closest point query stats = ";
+  bvh_query_stats_total().write_json(std::cout);
+  std::cout << std::endl;
+#endif
+  float max_distance = 0.0f;
+  for (const auto &c : closest) {
+    max_distance = std::max(max_distance, std::sqrt(c.squared_distance));
+  }
+  std::cout << "Max distance of " << probes.size()
+            << " grid probes = " << max_distance << std::endl;
+
+  t.tick();
+  CompressedBVH compressed(input_tris, bvh);
+  t.tock("Compressing BVH");
+  std::cout << "BVH memory = " << bvh.stats().memory_bytes
+            << " bytes, compressed = " << compressed.memory_bytes()
+            << " bytes" << std::endl;
+
+  t.tick();
+  compressed.closest_points(probes, closest);
+  t.tock("Closest points (compressed)");
+
+  /* Refitting to the same vertices must give back the bounds of the mesh,
+   * also when the arrays of the BVH view a loaded snapshot. Last, since
+   * spatial split leaves get their whole triangle bounds back and the timings
+   * above would be for a degraded tree. */
+  t.tick();
+  const BBox root_bounds = bvh.nodes()[0].bbox();
+  const float refit_cost = bvh.refit(input_tris);
+  t.tock("Refit");
+  const BBox refit_bounds = bvh.nodes()[0].bbox();
+  if (!(refit_bounds.min == root_bounds.min) ||
+      !(refit_bounds.max == root_bounds.max)) {
+    puts("ERROR: Refit changed the bounds of the mesh.");
+    return 1;
+  }
+  std::cout << "Relative SAH cost after refit = " << refit_cost << std::endl;
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+/* Output of the inside points of a grid, fed slab by slab from the writer
+ * stage of run_slab_pipeline. A slab is a range of y layers, slabs come in
+ * order and the points of a slab in any order. Points are written as
+ * N * 3 floats (.pts) in chunks of CHUNK_POINTS, or as an occupancy grid
+ * whose layers are written when their slab ends. Memory is bounded by a chunk
+ * of points or by the bits of one slab, never by the grid. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "adaptive_grid.hh"
+#include "occupancy_grid.hh"
+
+class GridPointWriter {
+private:
+  static constexpr size_t CHUNK_POINTS = 1 << 16;
+
+  mp::io::occupancy::Header header_;
+  bool occupancy_;
+  std::ofstream file_;
+  std::unique_ptr<mp::io::occupancy::OccupancyGridWriter> grid_;
+  int first_layer_ = 0, num_layers_ = 0;
+  std::vector<uint8_t> bits_;
+  std::vector<float> coordinates_;
+  int64_t num_points_ = 0;
+
+  void flush() {
+    file_.write(reinterpret_cast<const char *>(coordinates_.data()),
+                coordinates_.size() * sizeof(float));
+    coordinates_.clear();
+    if (!file_) {
+      throw "Could not write file";
+    }
+  }
+
+public:
+  /* .pts output, or an occupancy grid with the given encoding when occupancy
+   * is set. Nothing is written until the first slab ends, the layers of an
+   * occupancy grid must all be covered by slabs. */
+  GridPointWriter(const char *filepath, const float origin[3], float step,
+                  int num_x, int num_y, int num_z, bool occupancy,
+                  mp::io::occupancy::Encoding encoding =
+                      mp::io::occupancy::Encoding::Bits)
+      : occupancy_(occupancy) {
+    std::copy(origin, origin + 3, header_.origin);
+    header_.step = step;
+    header_.num_x = num_x;
+    header_.num_y = num_y;
+    header_.num_z = num_z;
+    header_.encoding = encoding;
+    if (occupancy) {
+      grid_ = std::make_unique<mp::io::occupancy::OccupancyGridWriter>(
+          filepath, header_);
+    } else {
+      file_.open(filepath, std::ios::binary);
+      if (!file_) {
+        throw "Could not open file";
+      }
+      coordinates_.reserve(3 * CHUNK_POINTS);
+    }
+  }
+
+  // Starts the slab of y layers [first_layer, first_layer + num_layers)
+  void begin_slab(int first_layer, int num_layers) {
+    first_layer_ = first_layer;
+    num_layers_ = num_layers;
+    if (occupancy_) {
+      bits_.assign(num_layers * mp::io::occupancy::layer_bytes(header_), 0);
+    }
+  }
+
+  // Point (i, j, k) is inside, j within the slab
+  void add(int i, int j, int k) {
+    num_points_++;
+    if (occupancy_) {
+      const size_t column = size_t(j - first_layer_) * header_.num_x + i;
+      bits_[column * mp::io::occupancy::column_bytes(header_) + (k >> 3)] |=
+          uint8_t(1) << (k & 7);
+      return;
+    }
+    coordinates_.insert(coordinates_.end(),
+                        {i * header_.step + header_.origin[0],
+                         j * header_.step + header_.origin[1],
+                         k * header_.step + header_.origin[2]});
+    if (coordinates_.size() >= 3 * CHUNK_POINTS) {
+      flush();
+    }
+  }
+
+  // Every point of cell is inside, cell within the slab
+  void add(const GridCell &cell) {
+    for (int j = cell.lo[1]; j < cell.hi[1]; j++) {
+      for (int i = cell.lo[0]; i < cell.hi[0]; i++) {
+        for (int k = cell.lo[2]; k < cell.hi[2]; k++) {
+          add(i, j, k);
+        }
+      }
+    }
+  }
+
+  void end_slab() {
+    if (occupancy_) {
+      grid_->write_layers(num_layers_, bits_.data());
+    } else {
+      flush();
+    }
+  }
+
+  // Returns the size of the file
+  uint64_t close() {
+    if (occupancy_) {
+      return grid_->close();
+    }
+    file_.close();
+    if (!file_) {
+      throw "Could not write file";
+    }
+    return uint64_t(num_points_) * 3 * sizeof(float);
+  }
+
+  int64_t num_points() const { return num_points_; }
+};
@@ -0,0 +1,24 @@
+/* Every inside backend: the ones built on this tree and the ones of the apps,
+ * each app header only depends on its own library (inside_embree.hh on
+ * Embree, inside_cgal.hh on CGAL, inside_igl.hh on libigl) so an app can
+ * register just the backends it links. */
+
+#pragma once
+
+#include "inside.hh"
+#include "inside_bvh.hh"
+#include "inside_cgal.hh"
+#include "inside_embree.hh"
+#include "inside_igl.hh"
+
+namespace mp::inside {
+
+// The backends of this tree and of the apps
+inline void register_all_backends(Registry &registry) {
+  register_bvh_backends(registry);
+  register_embree_backends(registry);
+  register_cgal_backends(registry);
+  register_igl_backends(registry);
+}
+
+} // namespace mp::inside
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "inside.hh"
+#include "inside_backends.hh"
+#include "stl_io.hh"
+#include "timers.hh"
+#include "vec3.hh"
+
+using namespace mp;
+
+// Resident set size of the process, 0 when /proc is not available
+static size_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+static std::vector<std::string> split(const std::string &list) {
+  std::vector<std::string> out;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      out.push_back(list.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return out;
+}
+
+struct BackendRun {
+  std::string name;
+  std::unique_ptr<inside::Backend> backend;
+  double build_seconds = 0.0;
+  double classify_seconds = 0.0;
+  size_t memory_bytes = 0;
+  std::vector<char> inside;
+};
+
+int main(int argc, char **argv) {
+  inside::Registry registry;
+  inside::register_all_backends(registry);
+
+  if (argc < 4) {
+    std::string names;
+    for (const auto &name : registry.names()) {
+      names += " " + name;
+    }
+    printf("Usage: inside_bench grid_step backends input.stl [input.stl ...]\n"
+           "Classifies the bounding box grid points of each mesh with every "
+           "backend and reports build time, throughput, agreement with the "
+           "majority of the backends and memory.\n"
+           "backends is a comma separated list or all, available:%s\n"
+           "Memory is the growth of the resident set while building the "
+           "backend.\n",
+           names.c_str());
+    return 1;
+  }
+
+  float grid_step = atof(argv[1]);
+  if (grid_step <= 0.0f) {
+    puts("ERROR: Grid step must be a positive number.");
+    return 1;
+  }
+  std::vector<std::string> names = std::string(argv[2]) == "all"
+                                       ? registry.names()
+                                       : split(argv[2]);
+  for (const auto &name : names) {
+    if (!registry.contains(name)) {
+      printf("ERROR: Unknown backend %s.\n", name.c_str());
+      return 1;
+    }
+  }
+
+  for (int arg = 3; arg < argc; arg++) {
+    std::vector<io::stl::Triangle> tris;
+    io::stl::read_stl(argv[arg], tris);
+    if (tris.empty()) {
+      printf("%s: empty mesh, skipped\n", argv[arg]);
+      continue;
+    }
+    const inside::Grid grid(tris, grid_step);
+    const std::vector<Vec3> points = grid.points();
+    printf("%s: %zu triangles, %dx%dx%d = %zu grid points\n", argv[arg],
+           tris.size(), grid.num_x, grid.num_y, grid.num_z, points.size());
+
+    // Backends are kept alive until the mesh is done, so the memory freed by
+    // one is not reused by the next and hidden from its resident set growth
+    std::vector<BackendRun> runs;
+    for (const auto &name : names) {
+      BackendRun run;
+      run.name = name;
+      const size_t resident_before = resident_bytes();
+      Timer timer;
+      run.backend = registry.make(name, tris);
+      run.build_seconds = timer.elapsed().count() / 1e9;
+      run.memory_bytes =
+          std::max(resident_bytes(), resident_before) - resident_before;
+
+      timer.tick();
+      run.backend->classify(points, run.inside);
+      run.classify_seconds = timer.elapsed().count() / 1e9;
+      runs.push_back(std::move(run));
+    }
+
+    // Majority of the backends per point, ties count as inside
+    std::vector<char> majority(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+      int votes = 0;
+      for (const auto &run : runs) {
+        votes += run.inside[i];
+      }
+      majority[i] = 2 * votes >= int(runs.size());
+    }
+
+    printf("%-12s %10s %10s %12s %10s %10s %10s\n", "backend", "build s",
+           "classify s", "Mpoints/s", "inside", "agreement", "memory MB");
+    for (const auto &run : runs) {
+      size_t num_inside = 0, num_agree = 0;
+      for (size_t i = 0; i < points.size(); i++) {
+        num_inside += run.inside[i];
+        num_agree += run.inside[i] == majority[i];
+      }
+      printf("%-12s %10.3f %10.3f %12.3f %10zu %9.4f%% %10.1f\n",
+             run.name.c_str(), run.build_seconds, run.classify_seconds,
+             points.size() / std::max(run.classify_seconds, 1e-9) / 1e6,
+             num_inside, 100.0 * num_agree / points.size(),
+             run.memory_bytes / 1e6);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,78 @@
+/* Inside backend of mcpip, the CGAL ray vote behind the mp::inside interface */
+
+#pragma once
+
+#define BOOST_BIND_GLOBAL_PLACEHOLDERS // To suppress warnings
+
+#include <vector>
+
+#include <CGAL/AABB_traits.h>
+#include <CGAL/AABB_tree.h>
+#include <CGAL/AABB_triangle_primitive.h>
+#include <CGAL/Simple_cartesian.h>
+
+#include "inside.hh"
+#include "random_ray_directions.hh"
+#include "stl_io.hh"
+#include "vec3.hh"
+
+namespace mp::inside {
+
+/* Ray vote of mcpip: at least half of the rays cross the CGAL AABB tree an
+ * odd number of times. Rays stop once the majority is fixed. */
+class CGALBackend : public Backend {
+private:
+  typedef CGAL::Simple_cartesian<double> K;
+  typedef std::vector<K::Triangle_3>::const_iterator Iterator;
+  typedef CGAL::AABB_triangle_primitive<K, Iterator> Primitive;
+  typedef CGAL::AABB_tree<CGAL::AABB_traits<K, Primitive>> Tree;
+
+  std::vector<K::Triangle_3> tris_;
+  Tree tree_;
+
+public:
+  CGALBackend(const std::vector<mp::io::stl::Triangle> &tris) {
+    tris_.reserve(tris.size());
+    for (const auto &t : tris) {
+      tris_.push_back({K::Point_3(t.v1[0], t.v1[1], t.v1[2]),
+                       K::Point_3(t.v2[0], t.v2[1], t.v2[2]),
+                       K::Point_3(t.v3[0], t.v3[1], t.v3[2])});
+    }
+    tree_.insert(tris_.cbegin(), tris_.cend());
+    // The tree is built lazily by the first query otherwise, which is not
+    // thread safe
+    tree_.build();
+  }
+
+  void classify(const std::vector<Vec3> &points,
+                std::vector<char> &inside) const override {
+    const int N = NUM_RANDOM_RAY_DIRECTIONS;
+    const int needed = (N + 1) / 2;
+    inside.resize(points.size());
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < points.size(); i++) {
+      const K::Point_3 p(points[i].x, points[i].y, points[i].z);
+      int odd_intersections_num = 0;
+      for (int r = 0; r < N; r++) {
+        K::Ray_3 ray(p, K::Vector_3(RANDOM_RAY_DIRECTIONS[r][0],
+                                    RANDOM_RAY_DIRECTIONS[r][1],
+                                    RANDOM_RAY_DIRECTIONS[r][2]));
+        odd_intersections_num +=
+            tree_.number_of_intersected_primitives(ray) & 1;
+        if (odd_intersections_num >= needed ||
+            odd_intersections_num + (N - r - 1) < needed) {
+          break;
+        }
+      }
+      inside[i] = odd_intersections_num >= needed;
+    }
+  }
+};
+
+inline void register_cgal_backends(Registry &registry) {
+  registry.add("cgal", [](const auto &tris) {
+    return std::make_unique<CGALBackend>(tris);
+  });
+}
+
+} // namespace mp::inside
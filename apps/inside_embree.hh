@@ -0,0 +1,77 @@
+/* Inside backend of mcpip_embree, the Embree ray vote behind the mp::inside
+ * interface */
+
+#pragma once
+
+#include <algorithm>
+#include <embree3/rtcore.h>
+#include <igl/parallel_for.h>
+#include <vector>
+
+#include "inside.hh"
+#include "stl_io.hh"
+#include "vec3.hh"
+
+#include "mcpip_embree/embree_device.hh"
+#include "mcpip_embree/embree_num_intersections.hh"
+#include "mcpip_embree/embree_ray_vote.hh"
+#include "mcpip_embree/embree_scene.hh"
+
+namespace mp::inside {
+
+/* Ray vote of mcpip_embree at threshold 0.5, traced as packets of
+ * consecutive points. The vote stops once it is decided at the given
+ * confidence, 1 keeps it exact. */
+class EmbreeBackend : public Backend {
+private:
+  RTCDevice device_;
+  EmbreeMesh mesh_;
+  RTCScene scene_;
+  RayVote vote_;
+
+public:
+  EmbreeBackend(const std::vector<mp::io::stl::Triangle> &tris,
+                double confidence)
+      : device_(initializeDevice()),
+        scene_(initializeScene(device_, tris, mesh_)),
+        vote_(0.5f, 1.0 - confidence) {}
+
+  ~EmbreeBackend() override {
+    rtcReleaseScene(scene_);
+    rtcReleaseDevice(device_);
+  }
+
+  void classify(const std::vector<Vec3> &points,
+                std::vector<char> &inside) const override {
+    inside.resize(points.size());
+    const int num_packets = (points.size() + PACKET_SIZE - 1) / PACKET_SIZE;
+    auto classify_packet = [&](int packet) {
+      const size_t first = size_t(packet) * PACKET_SIZE;
+      const int num_points =
+          std::min<size_t>(PACKET_SIZE, points.size() - first);
+      float x[PACKET_SIZE] = {}, y[PACKET_SIZE] = {}, z[PACKET_SIZE] = {};
+      bool packet_inside[PACKET_SIZE];
+      for (int lane = 0; lane < num_points; lane++) {
+        x[lane] = points[first + lane].x;
+        y[lane] = points[first + lane].y;
+        z[lane] = points[first + lane].z;
+      }
+      is_inside8(scene_, x, y, z, num_points, vote_, packet_inside);
+      for (int lane = 0; lane < num_points; lane++) {
+        inside[first + lane] = packet_inside[lane];
+      }
+    };
+    igl::parallel_for(num_packets, classify_packet, 128);
+  }
+};
+
+inline void register_embree_backends(Registry &registry) {
+  registry.add("embree", [](const auto &tris) {
+    return std::make_unique<EmbreeBackend>(tris, 1.0);
+  });
+  registry.add("embree_fast", [](const auto &tris) {
+    return std::make_unique<EmbreeBackend>(tris, 0.999);
+  });
+}
+
+} // namespace mp::inside
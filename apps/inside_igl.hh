@@ -0,0 +1,57 @@
+/* Inside backend of fast_winding_numbers, the libigl fast winding numbers
+ * behind the mp::inside interface */
+
+#pragma once
+
+#include <Eigen/Core>
+#include <igl/fast_winding_number.h>
+#include <vector>
+
+#include "inside.hh"
+#include "stl_io.hh"
+#include "vec3.hh"
+
+namespace mp::inside {
+
+/* libigl fast winding numbers (Barill et al. 2018) of the triangle soup,
+ * inside where the winding number is at least 0.5 */
+class FastWindingNumberBackend : public Backend {
+private:
+  igl::FastWindingNumberBVH fwn_bvh_;
+
+public:
+  FastWindingNumberBackend(const std::vector<mp::io::stl::Triangle> &tris) {
+    Eigen::MatrixXf V(tris.size() * 3, 3);
+    Eigen::MatrixXi F(tris.size(), 3);
+    for (size_t t = 0; t < tris.size(); t++) {
+      for (int i = 0; i < 3; i++) {
+        V.row(3 * t + i) << tris[t].verts[i][0], tris[t].verts[i][1],
+            tris[t].verts[i][2];
+        F(t, i) = 3 * t + i;
+      }
+    }
+    igl::fast_winding_number(V, F, 2, fwn_bvh_);
+  }
+
+  void classify(const std::vector<Vec3> &points,
+                std::vector<char> &inside) const override {
+    Eigen::MatrixXf Q(points.size(), 3);
+    for (size_t i = 0; i < points.size(); i++) {
+      Q.row(i) << points[i].x, points[i].y, points[i].z;
+    }
+    Eigen::VectorXf W;
+    igl::fast_winding_number(fwn_bvh_, 2, Q, W);
+    inside.resize(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+      inside[i] = W(i) >= 0.5f;
+    }
+  }
+};
+
+inline void register_igl_backends(Registry &registry) {
+  registry.add("fwn", [](const auto &tris) {
+    return std::make_unique<FastWindingNumberBackend>(tris);
+  });
+}
+
+} // namespace mp::inside
@@ -0,0 +1,77 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "kdtree.hh"
+#include "timers.hh"
+#include "vec3.hh"
+
+int main(int argc, char **argv) {
+  if (argc != 3 && argc != 4) {
+    puts("Usage: knn points.pts k [radius]\n"
+         "points.pts is a binary file of N * 3 floats, as written by "
+         "mcpip_embree and winding_numbers. Finds the k nearest neighbours "
+         "of every point, and the points within radius if given.");
+    return 1;
+  }
+  const int k = atoi(argv[2]);
+  if (k <= 0) {
+    puts("ERROR: k must be a positive number.");
+    return 1;
+  }
+
+  std::ifstream file(argv[1], std::ios::binary | std::ios::ate);
+  if (!file) {
+    puts("ERROR: Could not open the points file.");
+    return 1;
+  }
+  std::vector<Vec3> points(size_t(file.tellg()) / (3 * sizeof(float)));
+  file.seekg(0);
+  for (Vec3 &p : points) {
+    float xyz[3];
+    file.read(reinterpret_cast<char *>(xyz), sizeof(xyz));
+    p = Vec3(xyz[0], xyz[1], xyz[2]);
+  }
+  std::cout << "Points = " << points.size() << std::endl;
+
+  Timer t;
+  KDTree tree(points);
+  t.tock("Building kd-tree");
+
+  t.tick();
+  std::vector<int> indices;
+  std::vector<float> squared_distances;
+  tree.knn_batch(points, k, indices, squared_distances);
+  t.tock("kNN");
+  // The first neighbour of every point is itself
+  double mean_distance = 0.0;
+  size_t num_distances = 0;
+  for (size_t i = 0; i < squared_distances.size(); i++) {
+    if (i % k != 0 && squared_distances[i] != INFINITY) {
+      mean_distance += std::sqrt(squared_distances[i]);
+      num_distances++;
+    }
+  }
+  if (num_distances > 0) {
+    // Timer leaves the stream in fixed notation
+    std::cout << std::defaultfloat << std::setprecision(6)
+              << "Mean neighbour distance = " << mean_distance / num_distances
+              << std::endl;
+  }
+
+  if (argc == 4) {
+    t.tick();
+    std::vector<int> offsets, neighbours;
+    tree.radius_batch(points, atof(argv[3]), offsets, neighbours);
+    t.tock("Radius search");
+    std::cout << std::defaultfloat << std::setprecision(6)
+              << "Mean points within radius = "
+              << double(neighbours.size()) / std::max<size_t>(1, points.size())
+              << std::endl;
+  }
+
+  return 0;
+}
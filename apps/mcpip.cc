@@ -1,142 +1,175 @@
-#define BOOST_BIND_GLOBAL_PLACEHOLDERS // To suppress warnings
-
-#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 
-#include "random_ray_directions.hh"
+#include "adaptive_grid.hh"
+#include "bvh.hh"
+#include "inside.hh"
+#include "inside_bvh.hh"
+#include "inside_cgal.hh"
+#include "slab_pipeline.hh"
 #include "stl_io.hh"
 #include "timers.hh"
 #include "vec3.hh"
 
-#include <CGAL/AABB_traits.h>
-#include <CGAL/AABB_tree.h>
-#include <CGAL/AABB_triangle_primitive.h>
-#include <CGAL/Simple_cartesian.h>
-
-typedef CGAL::Simple_cartesian<double> TreeK;
-
-typedef TreeK::Point_3 CGALPoint3;
-typedef TreeK::Triangle_3 CGALTriangle3;
-typedef TreeK::Segment_3 CGALSegment3;
-typedef TreeK::Vector_3 CGALVector3;
-typedef TreeK::Ray_3 CGALRay3;
-
-typedef std::vector<CGALTriangle3>::iterator Iterator;
-typedef CGAL::AABB_triangle_primitive<TreeK, Iterator> Primitive;
-typedef CGAL::AABB_traits<TreeK, Primitive> AABB_triangle_traits;
-typedef CGAL::AABB_tree<AABB_triangle_traits> Tree;
-
-using namespace mp::io::stl;
-
-static std::vector<CGALTriangle3> load_stl(const char *filepath) {
-  std::vector<Triangle> tris;
-  read_stl(filepath, tris);
-
-  std::vector<CGALTriangle3> out;
-  for (auto const &t : tris) {
-    CGALPoint3 p1(t.v1[0], t.v1[1], t.v1[2]);
-    CGALPoint3 p2(t.v2[0], t.v2[1], t.v2[2]);
-    CGALPoint3 p3(t.v3[0], t.v3[1], t.v3[2]);
-
-    out.push_back({p1, p2, p3});
-  }
+using namespace mp;
 
-  return out;
-}
+// Number of y layers of the slabs the grid is classified in
+const int SLAB_LAYERS = 8;
 
-static bool is_inside(const Tree &tree, const CGALPoint3 &&query_point) {
-  int odd_intersections_num = 0;
-  for (int i = 0; i < NUM_RANDOM_RAY_DIRECTIONS; i++) {
-    CGALRay3 ray(query_point, CGALVector3{RANDOM_RAY_DIRECTIONS[i][0],
-                                          RANDOM_RAY_DIRECTIONS[i][1],
-                                          RANDOM_RAY_DIRECTIONS[i][2]});
-    size_t n = tree.number_of_intersected_primitives(ray);
-    odd_intersections_num += (n & 1);
-  }
-  return (odd_intersections_num) >= (.5 * NUM_RANDOM_RAY_DIRECTIONS);
-}
+// Slabs classified or waiting for the writer at a time
+const int NUM_SLAB_BUFFERS = 4;
 
-static bool is_inside_no_holes(const Tree &tree,
-                               const CGALPoint3 &query_point) {
-  for (int i = 0; i < NUM_RANDOM_RAY_DIRECTIONS; i++) {
-    CGALRay3 ray(query_point, CGALVector3{RANDOM_RAY_DIRECTIONS[i][0],
-                                          RANDOM_RAY_DIRECTIONS[i][1],
-                                          RANDOM_RAY_DIRECTIONS[i][2]});
-    if (!tree.do_intersect(ray)) {
-      return false;
-    }
-  }
-  return true;
-}
+struct SlabPoints {
+  std::vector<Vec3> points;
+  std::vector<char> inside;
+};
 
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    puts("Monte Carlo Point in Polygon 3D\n"
-         "Usage: mcpip grid_step input_filepath.stl output_filepath.pts\n"
-         "Generates points inside the volume of an oriented triangle soup by "
-         "filtering bounding box grid points.\n"
-         "Outputs a binary file containing N * 3 doubles.");
+  inside::Registry registry;
+  inside::register_cgal_backends(registry);
+  inside::register_bvh_backends(registry);
+
+  if (argc < 4 || argc > 6) {
+    std::string names;
+    for (const auto &name : registry.names()) {
+      names += " " + name;
+    }
+    printf("Monte Carlo Point in Polygon 3D\n"
+           "Usage: mcpip input_filepath.stl output_filepath.pts grid_step "
+           "[backend] [octree]\n"
+           "Generates points inside the volume of an oriented triangle soup "
+           "by filtering bounding box grid points.\n"
+           "Outputs a binary file containing N * 3 floats.\n"
+           "backend is the mp::inside backend classifying the points, "
+           "available:%s (default cgal, the CGAL ray vote)\n"
+           "octree classifies one point per octree cell that no triangle "
+           "touches, only the cells crossing the surface are refined down to "
+           "single grid points.\n"
+           "Memory: points are classified and written in slabs of %d y "
+           "layers.\n",
+           names.c_str(), SLAB_LAYERS);
     return 1;
   }
 
-  float grid_step = atof(argv[1]);
+  char *input_filepath = argv[1];
+  char *output_filepath = argv[2];
+  float grid_step = atof(argv[3]);
   if (grid_step <= 0.0f) {
     puts("ERROR: Grid step must be a positive number.");
     return 1;
   }
-  char *input_filepath = argv[2];
-  char *output_filepath = argv[3];
+  std::string backend_name = "cgal";
+  bool octree = false;
+  for (int arg = 4; arg < argc; arg++) {
+    std::string option = argv[arg];
+    if (option == "octree") {
+      octree = true;
+    } else if (registry.contains(option)) {
+      backend_name = option;
+    } else {
+      printf("ERROR: Unknown backend %s.\n", option.c_str());
+      return 1;
+    }
+  }
 
   std::cout << "CGAL Version: " << CGAL_VERSION_STR << std::endl;
 
-  auto tri_soup = load_stl(input_filepath);
-  Tree tree(tri_soup.begin(), tri_soup.end());
-
-  // Calculate bounding box
-  Vec3 bb_min(INFINITY, INFINITY, INFINITY);
-  Vec3 bb_max(-INFINITY, -INFINITY, -INFINITY);
-  for (auto const &tri : tri_soup) {
-    for (int i = 0; i < 3; i++) {
-      auto v = tri.vertex(i);
-      auto vec = Vec3(v[0], v[1], v[2]);
-      bb_min.min(vec);
-      bb_max.max(vec);
-    }
+  std::vector<io::stl::Triangle> tris;
+  io::stl::read_stl(input_filepath, tris);
+  if (tris.empty()) {
+    puts("ERROR: Empty mesh.");
+    return 1;
   }
 
-  // Generate and filter grid points and write them to a file
-  std::ofstream file(output_filepath, std::ios::binary);
+  Timer timer;
+  std::unique_ptr<inside::Backend> backend = registry.make(backend_name, tris);
+  timer.tock("Building " + backend_name + " backend");
 
-  Vec3 bb_dims = bb_max - bb_min;
-  int num_x = static_cast<int>(bb_dims.x / grid_step);
-  int num_y = static_cast<int>(bb_dims.y / grid_step);
-  int num_z = static_cast<int>(bb_dims.z / grid_step);
+  const inside::Grid grid(tris, grid_step);
+  printf("Number of grid points before filtering = %lld\n",
+         (long long)grid.size());
 
-  int num_points = num_x * num_y * num_z;
-  printf("Number of grid points before filtering = %d\n", num_points);
+  std::ofstream file(output_filepath, std::ios::binary);
+  if (!file) {
+    puts("ERROR: Cannot open output file.");
+    return 1;
+  }
 
-  Timer timer;
-#pragma omp parallel for collapse(3)
-  for (int i = 0; i < num_x; i++) {
-    for (int j = 0; j < num_y; j++) {
-      for (int k = 0; k < num_z; k++) {
-        double x = i * grid_step + bb_min.x;
-        double y = j * grid_step + bb_min.y;
-        double z = k * grid_step + bb_min.z;
-        if (is_inside(tree, {x, y, z})) {
-#pragma omp critical
-          {
-            file.write(reinterpret_cast<const char *>(&x), sizeof(double));
-            file.write(reinterpret_cast<const char *>(&y), sizeof(double));
-            file.write(reinterpret_cast<const char *>(&z), sizeof(double));
-          }
-        }
-      }
-    }
+  std::vector<BVHTriangle> bvh_tris;
+  std::unique_ptr<BVH> bvh;
+  if (octree) {
+    timer.tick();
+    bvh_tris = inside::to_bvh_triangles(tris);
+    bvh = std::make_unique<BVH>(bvh_tris);
+    timer.tock("Building BVH");
   }
+  auto touches = [&](const GridCell &cell) {
+    BBox box;
+    // The margin covers the rounding of the grid point coordinates
+    const Vec3 margin(1e-3f * grid_step);
+    box.min = grid.point(cell.lo[0], cell.lo[1], cell.lo[2]) - margin;
+    box.max =
+        grid.point(cell.hi[0] - 1, cell.hi[1] - 1, cell.hi[2] - 1) + margin;
+    return bvh->touches_box(box);
+  };
+  // Only called by the thread classifying the slabs
+  std::vector<Vec3> queries;
+  auto classify_points = [&](const std::vector<GridPoint> &points,
+                             std::vector<char> &inside) {
+    queries.clear();
+    for (const GridPoint &p : points) {
+      queries.push_back(grid.point(p.i, p.j, p.k));
+    }
+    backend->classify(queries, inside);
+  };
+
+  timer.tick();
+  int64_t num_inside = 0;
+  int64_t num_classified = 0;
+  const int num_slabs = (grid.num_y + SLAB_LAYERS - 1) / SLAB_LAYERS;
+  auto classify_slab = [&](int64_t slab, SlabPoints &slab_points) {
+    const int first_layer = slab * SLAB_LAYERS;
+    const int num_layers = std::min(SLAB_LAYERS, grid.num_y - first_layer);
+    if (!octree) {
+      grid.layer_points(first_layer, num_layers, slab_points.points);
+      backend->classify(slab_points.points, slab_points.inside);
+      num_classified += slab_points.points.size();
+      return;
+    }
+    // The points of the inside cells of the slab
+    slab_points.points.clear();
+    num_classified += classify_grid_adaptive(
+        {{0, first_layer, 0},
+         {grid.num_x, first_layer + num_layers, grid.num_z}},
+        8, touches, classify_points, [&](const GridCell &cell) {
+          for (int i = cell.lo[0]; i < cell.hi[0]; i++) {
+            for (int j = cell.lo[1]; j < cell.hi[1]; j++) {
+              for (int k = cell.lo[2]; k < cell.hi[2]; k++) {
+                slab_points.points.push_back(grid.point(i, j, k));
+              }
+            }
+          }
+        });
+    slab_points.inside.assign(slab_points.points.size(), 1);
+  };
+  auto write_slab = [&](int64_t, const SlabPoints &slab_points) {
+    num_inside +=
+        inside::write_points(file, slab_points.points, slab_points.inside);
+  };
+  double seconds_waiting = run_slab_pipeline<SlabPoints>(
+      num_slabs, NUM_SLAB_BUFFERS, classify_slab, write_slab);
   timer.tock("Filtering points");
+  // Time the classification stalled on the writer, 0 when writing keeps up
+  printf("Waiting for the writer = %.3f s\n", seconds_waiting);
+  printf("Classified points = %lld of %lld\n", (long long)num_classified,
+         (long long)grid.size());
+  printf("Inside points = %lld\n", (long long)num_inside);
 
   return 0;
 }
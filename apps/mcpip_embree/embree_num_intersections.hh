@@ -1,28 +1,124 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <embree3/rtcore.h>
 #include <limits>
+#include <vector>
+
+#include "embree_scene.hh"
+
+// Number of rays num_intersections8 traces together
+const int PACKET_SIZE = 8;
+
+void filter(const RTCFilterFunctionNArguments *args);
+
+/*
+ * Intersect context collecting all the hits of up to PACKET_SIZE rays in a
+ * single traversal: filter records each hit and rejects it, so Embree keeps
+ * looking further along the ray. Rays are told apart by their id. The scene
+ * must be created with RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION.
+ */
+struct HitCollector {
+  // First member, filter gets a pointer to it back
+  RTCIntersectContext context;
+
+  struct Hit {
+    float t;
+    bool front_facing;
+    // Welded vertices of the triangle hit
+    unsigned corners[3];
+  };
+  std::vector<Hit> hits[PACKET_SIZE];
+  // Extent of the mesh hit, set by filter
+  float extent = 0.0f;
+
+  HitCollector() {
+    rtcInitIntersectContext(&context);
+    context.filter = filter;
+  }
+
+  // One per thread, so the hit buffers are reused across rays
+  static HitCollector &local() {
+    static thread_local HitCollector collector;
+    for (auto &ray_hits : collector.hits) {
+      ray_hits.clear();
+    }
+    return collector;
+  }
+};
 
 void filter(const RTCFilterFunctionNArguments *args) {
-  // RTCHit *hit = (RTCHit *)args->hit;
+  HitCollector *collector = (HitCollector *)args->context;
+  const EmbreeMesh *mesh = (const EmbreeMesh *)args->geometryUserPtr;
+  collector->extent = mesh->extent;
+  const unsigned N = args->N;
+  for (unsigned i = 0; i < N; i++) {
+    if (args->valid[i] == 0) {
+      continue;
+    }
+    const float facing =
+        RTCRayN_dir_x(args->ray, N, i) * RTCHitN_Ng_x(args->hit, N, i) +
+        RTCRayN_dir_y(args->ray, N, i) * RTCHitN_Ng_y(args->hit, N, i) +
+        RTCRayN_dir_z(args->ray, N, i) * RTCHitN_Ng_z(args->hit, N, i);
+    const unsigned *corners =
+        &mesh->indices[3 * size_t(RTCHitN_primID(args->hit, N, i))];
+    collector->hits[RTCRayN_id(args->ray, N, i)].push_back(
+        {RTCRayN_tfar(args->ray, N, i), facing < 0.0f,
+         {corners[0], corners[1], corners[2]}});
+    args->valid[i] = 0;
+  }
 }
 
-int num_intersections(const RTCScene &scene, float ox, float oy, float oz,
-                      float dx, float dy, float dz) {
-  /*
-   * The intersect context can be used to set intersection
-   * filters or flags, and it also contains the instance ID stack
-   * used in multi-level instancing.
-   */
-  struct RTCIntersectContext context;
-  rtcInitIntersectContext(&context);
-
-  /*
-   * The ray hit structure holds both the ray and the hit.
-   * The user must initialize it properly -- see API documentation
-   * for rtcIntersect1() for details.
-   */
-  struct RTCRayHit rayhit;
+// Whether the triangles of two hits share a welded vertex
+bool share_vertex(const HitCollector::Hit &a, const HitCollector::Hit &b) {
+  for (unsigned corner : a.corners) {
+    if (corner == b.corners[0] || corner == b.corners[1] ||
+        corner == b.corners[2]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Sorts the hits of a ray and merges the hits at the same distance facing the
+ * same way on triangles sharing a vertex: the ray went through an edge or a
+ * vertex, reported by each of the triangles around it. Hits at the same
+ * distance facing opposite ways are a ray grazing the surface, one of each is
+ * kept so the parity is unchanged. Distances of the same point computed from
+ * different triangles differ by a few ulps of the coordinates, so "the same
+ * distance" is relative to the larger of the distance and the mesh extent.
+ * Crossings of triangles without a shared vertex are never merged.
+ */
+void merge_shared_hits(std::vector<HitCollector::Hit> &hits, float extent) {
+  std::sort(hits.begin(), hits.end(),
+            [](const HitCollector::Hit &a, const HitCollector::Hit &b) {
+              return a.t < b.t;
+            });
+  size_t num_merged = 0;
+  size_t group_start = 0;
+  for (size_t i = 0; i < hits.size(); i++) {
+    const float tolerance = 1e-5f * std::max(std::abs(hits[i].t), extent);
+    if (num_merged > 0 && hits[i].t - hits[group_start].t <= tolerance) {
+      bool duplicate = false;
+      for (size_t j = group_start; j < num_merged; j++) {
+        duplicate |= hits[j].front_facing == hits[i].front_facing &&
+                     share_vertex(hits[j], hits[i]);
+      }
+      if (duplicate) {
+        continue;
+      }
+    } else {
+      group_start = num_merged;
+    }
+    hits[num_merged++] = hits[i];
+  }
+  hits.resize(num_merged);
+}
+
+void init_ray(RTCRayHit &rayhit, float ox, float oy, float oz, float dx,
+              float dy, float dz) {
   rayhit.ray.org_x = ox;
   rayhit.ray.org_y = oy;
   rayhit.ray.org_z = oz;
@@ -31,27 +127,81 @@ int num_intersections(const RTCScene &scene, float ox, float oy, float oz,
   rayhit.ray.dir_z = dz;
   rayhit.ray.tnear = 0;
   rayhit.ray.tfar = std::numeric_limits<float>::infinity();
+  rayhit.ray.time = 0;
   rayhit.ray.mask = -1;
+  rayhit.ray.id = 0;
   rayhit.ray.flags = 0;
   rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
   rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+}
 
-  int n = 0;
+int num_intersections(const RTCScene &scene, float ox, float oy, float oz,
+                      float dx, float dy, float dz) {
+  HitCollector &collector = HitCollector::local();
+  struct RTCRayHit rayhit;
+  init_ray(rayhit, ox, oy, oz, dx, dy, dz);
+  rtcIntersect1(scene, &collector.context, &rayhit);
+  merge_shared_hits(collector.hits[0], collector.extent);
+  return collector.hits[0].size();
+}
 
-  while (true) {
-    rtcIntersect1(scene, &context, &rayhit);
+/*
+ * num_intersections of PACKET_SIZE rays sharing a direction, traced together
+ * as a packet so Embree traverses them with SIMD. Rays starting from nearby
+ * points are coherent. Only the lanes with valid[lane] set are traced, the
+ * counts of the other lanes are left untouched.
+ */
+void num_intersections8(const RTCScene &scene, const float ox[PACKET_SIZE],
+                        const float oy[PACKET_SIZE], const float oz[PACKET_SIZE],
+                        float dx, float dy, float dz,
+                        const bool valid[PACKET_SIZE], int counts[PACKET_SIZE]) {
+  HitCollector &collector = HitCollector::local();
+  collector.context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
 
-    if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
-      break;
-    }
+  alignas(32) int active[PACKET_SIZE];
+  struct RTCRayHit8 rayhit;
+  for (int lane = 0; lane < PACKET_SIZE; lane++) {
+    active[lane] = valid[lane] ? -1 : 0;
+    rayhit.ray.org_x[lane] = ox[lane];
+    rayhit.ray.org_y[lane] = oy[lane];
+    rayhit.ray.org_z[lane] = oz[lane];
+    rayhit.ray.dir_x[lane] = dx;
+    rayhit.ray.dir_y[lane] = dy;
+    rayhit.ray.dir_z[lane] = dz;
+    rayhit.ray.tnear[lane] = 0;
+    rayhit.ray.tfar[lane] = std::numeric_limits<float>::infinity();
+    rayhit.ray.time[lane] = 0;
+    rayhit.ray.mask[lane] = -1;
+    rayhit.ray.id[lane] = lane;
+    rayhit.ray.flags[lane] = 0;
+    rayhit.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+    rayhit.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+  }
 
-    rayhit.ray.tnear = 1.001f * rayhit.ray.tfar;
-    rayhit.ray.tfar = std::numeric_limits<float>::infinity();
-    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-    rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
+  rtcIntersect8(active, scene, &collector.context, &rayhit);
+  collector.context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
 
-    n++;
+  for (int lane = 0; lane < PACKET_SIZE; lane++) {
+    if (valid[lane]) {
+      merge_shared_hits(collector.hits[lane], collector.extent);
+      counts[lane] = collector.hits[lane].size();
+    }
   }
+}
 
-  return n;
+/*
+ * Appends the distances of all the hits along the ray, in increasing order,
+ * see merge_shared_hits.
+ */
+void intersection_distances(const RTCScene &scene, float ox, float oy,
+                            float oz, float dx, float dy, float dz,
+                            std::vector<float> &distances) {
+  HitCollector &collector = HitCollector::local();
+  struct RTCRayHit rayhit;
+  init_ray(rayhit, ox, oy, oz, dx, dy, dz);
+  rtcIntersect1(scene, &collector.context, &rayhit);
+  merge_shared_hits(collector.hits[0], collector.extent);
+  for (const auto &hit : collector.hits[0]) {
+    distances.push_back(hit.t);
+  }
 }
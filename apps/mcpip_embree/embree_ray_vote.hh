@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <embree3/rtcore.h>
+#include <vector>
+
+#include "../random_ray_directions.hh"
+#include "embree_num_intersections.hh"
+
+/* Stopping rule of the ray vote. A point is inside when at least
+ * threshold * NUM_RANDOM_RAY_DIRECTIONS rays cross the surface an odd number
+ * of times. After n rays with k odd ones the vote stops as inside when
+ * k >= inside_at[n] and as outside when k <= outside_at[n]: either the
+ * remaining rays can no longer change the outcome, or a one sided binomial
+ * test rejects an odd ray probability on the other side of threshold. The
+ * test is repeated after every ray, so each look gets significance /
+ * NUM_RANDOM_RAY_DIRECTIONS (Bonferroni) and the chance that the vote stops
+ * on the wrong side of threshold stays below significance. 0 only stops when
+ * the outcome is fixed. */
+struct RayVote {
+  std::vector<int> inside_at, outside_at;
+
+  RayVote(float threshold, double significance) {
+    const int N = NUM_RANDOM_RAY_DIRECTIONS;
+    const int needed = std::ceil(threshold * N);
+    const double look_significance = significance / N;
+    inside_at.resize(N + 1);
+    outside_at.resize(N + 1);
+    for (int n = 0; n <= N; n++) {
+      inside_at[n] = needed;
+      outside_at[n] = needed - (N - n) - 1;
+      if (significance <= 0.0) {
+        continue;
+      }
+      // Binomial(n, threshold) probabilities of k odd rays
+      std::vector<double> pmf(n + 1);
+      for (int k = 0; k <= n; k++) {
+        pmf[k] = std::exp(std::lgamma(n + 1.0) - std::lgamma(k + 1.0) -
+                          std::lgamma(n - k + 1.0)) *
+                 std::pow(threshold, k) * std::pow(1.0 - threshold, n - k);
+      }
+      double upper_tail = 0.0;
+      for (int k = n; k >= 0 && upper_tail + pmf[k] <= look_significance; k--) {
+        upper_tail += pmf[k];
+        inside_at[n] = std::min(inside_at[n], k);
+      }
+      double lower_tail = 0.0;
+      for (int k = 0; k <= n && lower_tail + pmf[k] <= look_significance; k++) {
+        lower_tail += pmf[k];
+        outside_at[n] = std::max(outside_at[n], k);
+      }
+    }
+  }
+};
+
+bool is_inside(const RTCScene &scene, const float &x, const float &y,
+               const float &z, const RayVote &vote, int &num_rays) {
+  int odd_intersections_num = 0;
+  for (int i = 0; i < NUM_RANDOM_RAY_DIRECTIONS; i++) {
+    int n = num_intersections(scene, x, y, z, RANDOM_RAY_DIRECTIONS[i][0],
+                              RANDOM_RAY_DIRECTIONS[i][1],
+                              RANDOM_RAY_DIRECTIONS[i][2]);
+    odd_intersections_num += (n & 1); // if odd add 1, if even add 0
+    if (odd_intersections_num >= vote.inside_at[i + 1]) {
+      num_rays = i + 1;
+      return true;
+    }
+    if (odd_intersections_num <= vote.outside_at[i + 1]) {
+      num_rays = i + 1;
+      return false;
+    }
+  }
+  // Unreachable, the outcome is fixed once every ray is cast
+  num_rays = NUM_RANDOM_RAY_DIRECTIONS;
+  return odd_intersections_num >= vote.inside_at[NUM_RANDOM_RAY_DIRECTIONS];
+}
+
+/* is_inside of PACKET_SIZE points (num_points of them are used), each ray
+ * direction is traced for all of them as one packet. Points drop out of the
+ * packets once their vote is decided. Returns the number of rays traced. */
+int is_inside8(const RTCScene &scene, const float x[PACKET_SIZE],
+               const float y[PACKET_SIZE], const float z[PACKET_SIZE],
+               int num_points, const RayVote &vote, bool inside[PACKET_SIZE]) {
+  bool undecided[PACKET_SIZE];
+  int odd_intersections_num[PACKET_SIZE] = {};
+  int counts[PACKET_SIZE];
+  int num_undecided = num_points;
+  for (int lane = 0; lane < PACKET_SIZE; lane++) {
+    undecided[lane] = lane < num_points;
+  }
+  int num_rays = 0;
+  for (int i = 0; i < NUM_RANDOM_RAY_DIRECTIONS && num_undecided > 0; i++) {
+    num_intersections8(scene, x, y, z, RANDOM_RAY_DIRECTIONS[i][0],
+                       RANDOM_RAY_DIRECTIONS[i][1], RANDOM_RAY_DIRECTIONS[i][2],
+                       undecided, counts);
+    num_rays += num_undecided;
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+      if (!undecided[lane]) {
+        continue;
+      }
+      odd_intersections_num[lane] += counts[lane] & 1;
+      if (odd_intersections_num[lane] >= vote.inside_at[i + 1]) {
+        inside[lane] = true;
+      } else if (odd_intersections_num[lane] <= vote.outside_at[i + 1]) {
+        inside[lane] = false;
+      } else {
+        continue;
+      }
+      undecided[lane] = false;
+      num_undecided--;
+    }
+  }
+  return num_rays;
+}
@@ -1,10 +1,69 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <embree3/rtcore.h>
+#include <execution>
+#include <numeric>
 #include <vector>
 
 #include "stl_io.hh"
 
+struct EmbreeSceneOptions {
+  RTCBuildQuality build_quality = RTC_BUILD_QUALITY_MEDIUM;
+  // Smaller BVH nodes at some cost in traversal speed
+  bool compact = false;
+};
+
+/*
+ * Welded triangle mesh, Embree reads its buffers in place (shared buffers) so
+ * it must outlive the scene. Embree loads vertices 16 bytes at a time, the
+ * vertex array is padded with one float so the last one can be loaded.
+ */
+struct EmbreeMesh {
+  std::vector<float> vertices;
+  std::vector<unsigned> indices;
+  // Largest vertex coordinate magnitude, the scale of hit distance errors
+  float extent = 0.0f;
+
+  size_t num_vertices() const { return vertices.size() / 3; }
+  size_t memory_bytes() const {
+    return vertices.size() * sizeof(float) + indices.size() * sizeof(unsigned);
+  }
+};
+
+/*
+ * Merges the corners of the triangles at the same position: corners are sorted
+ * by position and each run of equal positions becomes one vertex.
+ */
+void weldTriangles(const std::vector<mp::io::stl::Triangle> &tris,
+                   EmbreeMesh &mesh) {
+  const size_t num_corners = tris.size() * 3;
+  auto corner = [&](unsigned c) { return tris[c / 3].verts[c % 3]; };
+  std::vector<unsigned> order(num_corners);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(std::execution::par, order.begin(), order.end(),
+            [&](unsigned a, unsigned b) {
+              return std::lexicographical_compare(corner(a), corner(a) + 3,
+                                                  corner(b), corner(b) + 3);
+            });
+
+  mesh.vertices.clear();
+  mesh.indices.resize(num_corners);
+  mesh.extent = 0.0f;
+  for (size_t i = 0; i < num_corners; i++) {
+    const float *p = corner(order[i]);
+    if (i == 0 || !std::equal(p, p + 3, corner(order[i - 1]))) {
+      mesh.vertices.insert(mesh.vertices.end(), p, p + 3);
+      for (int axis = 0; axis < 3; axis++) {
+        mesh.extent = std::max(mesh.extent, std::abs(p[axis]));
+      }
+    }
+    mesh.indices[order[i]] = mesh.num_vertices() - 1;
+  }
+  mesh.vertices.push_back(0.0f);
+}
+
 /*
  * Create a scene, which is a collection of geometry objects. Scenes are
  * what the intersect / occluded functions work on. You can think of a
@@ -13,43 +72,38 @@
  * Scenes, like devices, are reference-counted.
  */
 RTCScene initializeScene(RTCDevice device,
-                         const std::vector<mp::io::stl::Triangle> &tris) {
+                         const std::vector<mp::io::stl::Triangle> &tris,
+                         EmbreeMesh &mesh,
+                         const EmbreeSceneOptions &options = {}) {
   RTCScene scene = rtcNewScene(device);
 
   /*
-   * Create a triangle mesh geometry, and initialize a single triangle.
-   * You can look up geometry types in the API documentation to
-   * find out which type expects which buffers.
-   *
-   * We create buffers directly on the device, but you can also use
-   * shared buffers. For shared buffers, special care must be taken
-   * to ensure proper alignment and padding. This is described in
-   * more detail in the API documentation.
+   * The hit counting intersect contexts carry a filter function, see
+   * HitCollector. Robust traversal and intersection does not lose the hits
+   * on shared edges.
    */
+  int flags = RTC_SCENE_FLAG_CONTEXT_FILTER_FUNCTION | RTC_SCENE_FLAG_ROBUST;
+  if (options.compact) {
+    flags |= RTC_SCENE_FLAG_COMPACT;
+  }
+  rtcSetSceneFlags(scene, RTCSceneFlags(flags));
+  rtcSetSceneBuildQuality(scene, options.build_quality);
 
+  /*
+   * Create a triangle mesh geometry on our welded buffers. Embree would
+   * otherwise copy three unshared vertices per triangle.
+   */
+  weldTriangles(tris, mesh);
   RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
-  float *vertices = (float *)rtcSetNewGeometryBuffer(
-      geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float),
-      tris.size() * 3);
-
-  unsigned *indices = (unsigned *)rtcSetNewGeometryBuffer(
-      geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned),
-      tris.size());
-
-  if (vertices && indices) {
-    int vi = 0;
-    int ii = 0;
-    for (const auto &t : tris) {
-      for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-          vertices[vi] = t.verts[i][j];
-          vi += 1;
-        }
-        indices[ii] = ii;
-        ii += 1;
-      }
-    }
-  }
+  rtcSetGeometryBuildQuality(geom, options.build_quality);
+  rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+                             mesh.vertices.data(), 0, 3 * sizeof(float),
+                             mesh.num_vertices());
+  rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+                             mesh.indices.data(), 0, 3 * sizeof(unsigned),
+                             tris.size());
+  // Hits look up the welded corners of their triangle, see merge_shared_hits
+  rtcSetGeometryUserData(geom, &mesh);
 
   /*
    * You must commit geometry objects when you are done setting them up,
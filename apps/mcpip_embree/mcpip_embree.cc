@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdio>
 #include <embree3/rtcore.h>
@@ -6,53 +7,153 @@
 #include <fstream>
 #include <igl/parallel_for.h>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "bvh.hh"
+#include "morton.hh"
+#include "occupancy_grid.hh"
 #include "stl_io.hh"
 #include "timers.hh"
 #include "vec3.hh"
 
+#include "../adaptive_grid.hh"
+#include "../grid_writer.hh"
 #include "../random_ray_directions.hh"
+#include "../slab_pipeline.hh"
 #include "embree_device.hh"
 #include "embree_do_intersect.hh"
 #include "embree_num_intersections.hh"
+#include "embree_ray_vote.hh"
 #include "embree_scene.hh"
 
 using namespace mp::io::stl;
 
-static bool is_inside(const RTCScene &scene, const float &x, const float &y,
-                      const float &z, const float &threshold) {
-  int odd_intersections_num = 0;
-  for (int i = 0; i < NUM_RANDOM_RAY_DIRECTIONS; i++) {
-    int n = num_intersections(scene, x, y, z, RANDOM_RAY_DIRECTIONS[i][0],
-                              RANDOM_RAY_DIRECTIONS[i][1], RANDOM_RAY_DIRECTIONS[i][2]);
-    odd_intersections_num += (n & 1); // if odd add 1, if even add 0
+/* Classifies the grid points (x, y, z0 + k * step), k < num_z, of a column by
+ * the parity of the hits of one ray cast up the column. inside[k] is set for
+ * the points with an odd number of hits below them. Returns false when the
+ * column is not trustworthy: a closed surface is crossed an even number of
+ * times, as many going up as going down, and hits closer than tolerance are
+ * likely one edge or vertex reported twice. */
+static bool classify_column(const RTCScene &scene, float x, float y, float z0,
+                            float step, int num_z, float z_min, float z_max,
+                            std::vector<float> &up, std::vector<float> &down,
+                            std::vector<char> &inside) {
+  // Start both rays outside the bounding box
+  const float margin = step + 1e-3f * (z_max - z_min);
+  const float bottom = z_min - margin, top = z_max + margin;
+  up.clear();
+  down.clear();
+  intersection_distances(scene, x, y, bottom, 0.0f, 0.0f, 1.0f, up);
+  intersection_distances(scene, x, y, top, 0.0f, 0.0f, -1.0f, down);
+  if (up.size() % 2 != 0 || up.size() != down.size()) {
+    return false;
   }
-  return (odd_intersections_num) >= (threshold * NUM_RANDOM_RAY_DIRECTIONS);
+  const float tolerance = 1e-6f * (top - bottom);
+  for (size_t h = 1; h < up.size(); h++) {
+    if (up[h] - up[h - 1] <= tolerance) {
+      return false;
+    }
+  }
+
+  // Sweep the points and the hits up the column together
+  inside.assign(num_z, 0);
+  size_t h = 0;
+  for (int k = 0; k < num_z; k++) {
+    const float t = (z0 + k * step) - bottom;
+    while (h < up.size() && up[h] < t) {
+      h++;
+    }
+    inside[k] = h & 1;
+  }
+  return true;
 }
 
 struct int3 {
   int x, y, z;
 };
 
-static inline int3 jagged_index(int flat_index, int num_x, int num_y,
-                                int num_z) {
-  int z = flat_index / (num_x * num_y);
-  int x_p_y_t_num_x = flat_index - z * (num_x * num_y);
-  int y = x_p_y_t_num_x / num_x;
-  int x = x_p_y_t_num_x - (y * num_x);
-  return {x, y, z};
-}
+// Side of the cubic tiles of grid points scheduled together, also the number
+// of y layers of the slabs the grid is processed in
+const int TILE_SIZE = 8;
+
+// Slabs classified or waiting for the writer at a time
+const int NUM_SLAB_BUFFERS = 4;
+
+// Inside points of a slab, per task in the order they are written
+using SlabPoints = std::vector<std::vector<int3>>;
+
+/* Visiting order of the grid points: tile by tile, the tiles and the points
+ * inside each tile in Morton order. A task classifies a whole tile, so the
+ * rays of a thread start close together and traverse the same parts of the
+ * BVH, and every 8 consecutive points of a tile form a 2x2x2 brick that is
+ * traced as one packet. */
+struct MortonTiles {
+  // Tile coordinates, in Morton order
+  std::vector<int3> tiles;
+  // Point offsets inside a tile, in Morton order
+  int3 offsets[TILE_SIZE * TILE_SIZE * TILE_SIZE];
+
+  MortonTiles(int num_x, int num_y, int num_z) {
+    const int tiles_x = (num_x + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles_y = (num_y + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles_z = (num_z + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<std::pair<uint64_t, int3>> codes;
+    for (int k = 0; k < tiles_z; k++) {
+      for (int j = 0; j < tiles_y; j++) {
+        for (int i = 0; i < tiles_x; i++) {
+          codes.push_back({(expand_bits_63(i) << 2) |
+                               (expand_bits_63(j) << 1) | expand_bits_63(k),
+                           {i, j, k}});
+        }
+      }
+    }
+    std::sort(codes.begin(), codes.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (const auto &code : codes) {
+      tiles.push_back(code.second);
+    }
+
+    for (int code = 0; code < TILE_SIZE * TILE_SIZE * TILE_SIZE; code++) {
+      int3 offset = {0, 0, 0};
+      for (int bit = 0; (1 << bit) < TILE_SIZE; bit++) {
+        offset.x |= ((code >> (3 * bit + 2)) & 1) << bit;
+        offset.y |= ((code >> (3 * bit + 1)) & 1) << bit;
+        offset.z |= ((code >> (3 * bit)) & 1) << bit;
+      }
+      offsets[code] = offset;
+    }
+  }
+};
 
 int main(int argc, char **argv) {
-  if (argc != 5) {
+  if (argc < 5) {
     puts("Monte Carlo Point in Polygon 3D\n"
          "Usage: mcpip_embree input_filepath.stl output_filepath.pts grid_step "
-         "threshold\n"
+         "threshold [confidence] [scanline | octree | rowmajor] "
+         "[low_quality | high_quality] [compact] [occupancy | occupancy_rle]\n"
          "Generates points inside the volume of an oriented triangle soup by "
          "filtering bounding box grid points.\n"
-         "Outputs a binary file containing N * 3 floats.");
+         "Outputs a binary file containing N * 3 floats.\n"
+         "With a confidence (e.g. 0.999) the ray vote of a point stops as soon "
+         "as its outcome is statistically decided, otherwise once it can no "
+         "longer change.\n"
+         "scanline classifies whole z columns of grid points with one ray up "
+         "and one down, it expects a closed mesh. Columns grazing edges fall "
+         "back to the ray vote.\n"
+         "octree classifies one point per octree cell that no triangle "
+         "touches, only the cells crossing the surface are refined down to "
+         "single grid points.\n"
+         "rowmajor schedules the ray vote along x rows instead of Morton "
+         "ordered tiles, for comparison.\n"
+         "low_quality, high_quality and compact set the Embree BVH build "
+         "quality and the compact scene flag.\n"
+         "occupancy writes one bit per grid point with the grid origin, step "
+         "and dimensions instead, occupancy_rle run length encodes its z "
+         "columns, occupancy_to_pts converts both back to points.\n"
+         "Memory: points are classified and written in slabs of 8 y "
+         "layers.");
     return 1;
   }
 
@@ -68,12 +169,57 @@ int main(int argc, char **argv) {
     puts("ERROR: Threshold must be between 0.0 and 1.0 inclusive.");
     return 1;
   }
+  double confidence = 1.0;
+  bool scanline = false;
+  bool octree = false;
+  bool rowmajor = false;
+  EmbreeSceneOptions scene_options;
+  bool occupancy = false;
+  mp::io::occupancy::Encoding encoding = mp::io::occupancy::Encoding::Bits;
+  for (int arg = 5; arg < argc; arg++) {
+    std::string option = argv[arg];
+    if (option == "scanline") {
+      scanline = true;
+    } else if (option == "octree") {
+      octree = true;
+    } else if (option == "rowmajor") {
+      rowmajor = true;
+    } else if (option == "low_quality") {
+      scene_options.build_quality = RTC_BUILD_QUALITY_LOW;
+    } else if (option == "high_quality") {
+      scene_options.build_quality = RTC_BUILD_QUALITY_HIGH;
+    } else if (option == "compact") {
+      scene_options.compact = true;
+    } else if (option == "occupancy") {
+      occupancy = true;
+    } else if (option == "occupancy_rle") {
+      occupancy = true;
+      encoding = mp::io::occupancy::Encoding::RunLength;
+    } else {
+      confidence = atof(argv[arg]);
+      if ((confidence > 1.0) || (confidence <= 0.0)) {
+        puts("ERROR: Confidence must be between 0.0 exclusive and 1.0 "
+             "inclusive.");
+        return 1;
+      }
+    }
+  }
+  if (scanline + octree + rowmajor > 1) {
+    puts("ERROR: scanline, octree and rowmajor are exclusive.");
+    return 1;
+  }
+  const RayVote vote(threshold, 1.0 - confidence);
 
   std::vector<Triangle> tris;
   read_stl(input_filepath, tris);
 
+  Timer scene_timer;
   RTCDevice device = initializeDevice();
-  RTCScene scene = initializeScene(device, tris);
+  EmbreeMesh mesh;
+  RTCScene scene = initializeScene(device, tris, mesh, scene_options);
+  scene_timer.tock("Scene setup");
+  printf("Welded %zu corners into %zu vertices, %.1f MB of shared buffers\n",
+         tris.size() * 3, mesh.num_vertices(), mesh.memory_bytes() / 1e6);
 
   // Calculate bounding box
   Vec3 bb_min(INFINITY, INFINITY, INFINITY);
@@ -92,30 +238,241 @@ int main(int argc, char **argv) {
   int num_x = std::ceil(bb_dims.x / grid_step);
   int num_y = std::ceil(bb_dims.y / grid_step);
   int num_z = std::ceil(bb_dims.z / grid_step);
-  int num_points = num_x * num_y * num_z;
-  printf("Number of grid points before filtering = %d\n", num_points);
-
-  std::mutex mutex;
-  std::ofstream file(output_filepath, std::ios::binary);
-  auto func_igl = [&](int flat_index) {
-    auto [i, j, k] = jagged_index(flat_index, num_x, num_y, num_z);
-    float x = i * grid_step + bb_min.x;
-    float y = j * grid_step + bb_min.y;
-    float z = k * grid_step + bb_min.z;
-    bool b = is_inside(scene, x, y, z, threshold);
-    {
-      std::scoped_lock lock(mutex);
-      if (b) {
-        file.write((char *)(&x), sizeof(float));
-        file.write((char *)(&y), sizeof(float));
-        file.write((char *)(&z), sizeof(float));
+  int64_t num_points = int64_t(num_x) * num_y * num_z;
+  printf("Number of grid points before filtering = %lld\n",
+         (long long)num_points);
+
+  std::atomic<int64_t> total_rays = 0;
+  const float origin[3] = {bb_min.x, bb_min.y, bb_min.z};
+  GridPointWriter writer(output_filepath, origin, grid_step, num_x, num_y,
+                         num_z, occupancy, encoding);
+  // Classifies count grid points as one packet, unused lanes repeat the last
+  // point
+  auto trace_packet = [&](const int3 indices[PACKET_SIZE], int count,
+                          bool inside[PACKET_SIZE]) {
+    float x[PACKET_SIZE], y[PACKET_SIZE], z[PACKET_SIZE];
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+      const int3 &index = indices[std::min(lane, count - 1)];
+      x[lane] = index.x * grid_step + bb_min.x;
+      y[lane] = index.y * grid_step + bb_min.y;
+      z[lane] = index.z * grid_step + bb_min.z;
+    }
+    int num_rays = is_inside8(scene, x, y, z, count, vote, inside);
+    total_rays.fetch_add(num_rays, std::memory_order_relaxed);
+  };
+  // Appends the indices of the inside points among count grid points
+  auto classify_packet = [&](const int3 indices[PACKET_SIZE], int count,
+                             std::vector<int3> &points) {
+    bool inside[PACKET_SIZE];
+    trace_packet(indices, count, inside);
+    for (int lane = 0; lane < count; lane++) {
+      if (inside[lane]) {
+        points.push_back(indices[lane]);
+      }
+    }
+  };
+  /* The grid is processed in slabs of TILE_SIZE y layers, only
+   * NUM_SLAB_BUFFERS slabs of inside points are held while the writer thread
+   * writes them in order, as points or as the layers of the occupancy grid.
+   * Memory is then bounded by the slab size. */
+  const int num_slabs = (num_y + TILE_SIZE - 1) / TILE_SIZE;
+
+  // Rows along x of the slab, consecutive points are traced as packets
+  auto classify_rows = [&](int64_t slab, SlabPoints &slab_points) {
+    const int num_rows = num_z * TILE_SIZE;
+    slab_points.assign(num_rows, {});
+    auto func_igl = [&](int row) {
+      const int k = row % num_z;
+      const int j = slab * TILE_SIZE + row / num_z;
+      if (j >= num_y) {
+        return;
+      }
+      for (int first = 0; first < num_x; first += PACKET_SIZE) {
+        const int count = std::min(PACKET_SIZE, num_x - first);
+        int3 indices[PACKET_SIZE];
+        for (int lane = 0; lane < count; lane++) {
+          indices[lane] = {first + lane, j, k};
+        }
+        classify_packet(indices, count, slab_points[row]);
+      }
+    };
+    igl::parallel_for(num_rows, func_igl, 16);
+  };
+
+  // The tiles of one slab, tile.y is always 0
+  const MortonTiles schedule(num_x, std::min(num_y, TILE_SIZE), num_z);
+  auto classify_tiles = [&](int64_t slab, SlabPoints &slab_points) {
+    slab_points.assign(schedule.tiles.size(), {});
+    auto func_igl_tile = [&](int tile_index) {
+      const int3 &tile = schedule.tiles[tile_index];
+      int3 indices[PACKET_SIZE];
+      int count = 0;
+      std::vector<int3> &points = slab_points[tile_index];
+      for (const int3 &offset : schedule.offsets) {
+        const int3 index = {tile.x * TILE_SIZE + offset.x,
+                            int(slab) * TILE_SIZE + offset.y,
+                            tile.z * TILE_SIZE + offset.z};
+        if (index.x >= num_x || index.y >= num_y || index.z >= num_z) {
+          continue;
+        }
+        indices[count++] = index;
+        if (count == PACKET_SIZE) {
+          classify_packet(indices, count, points);
+          count = 0;
+        }
+      }
+      if (count > 0) {
+        classify_packet(indices, count, points);
+      }
+    };
+    igl::parallel_for(int(schedule.tiles.size()), func_igl_tile, 1);
+  };
+
+  std::atomic<int64_t> num_fallback_columns = 0;
+  auto classify_columns = [&](int64_t slab, SlabPoints &slab_points) {
+    const int num_columns = num_x * TILE_SIZE;
+    slab_points.assign(num_columns, {});
+    auto func_igl_column = [&](int column_index) {
+      int i = column_index % num_x;
+      int j = slab * TILE_SIZE + column_index / num_x;
+      if (j >= num_y) {
+        return;
+      }
+      float x = i * grid_step + bb_min.x;
+      float y = j * grid_step + bb_min.y;
+      std::vector<float> up, down;
+      std::vector<char> inside;
+      total_rays.fetch_add(2, std::memory_order_relaxed);
+      if (!classify_column(scene, x, y, bb_min.z, grid_step, num_z, bb_min.z,
+                           bb_max.z, up, down, inside)) {
+        num_fallback_columns.fetch_add(1, std::memory_order_relaxed);
+        inside.assign(num_z, 0);
+        for (int k = 0; k < num_z; k++) {
+          int num_rays;
+          inside[k] = is_inside(scene, x, y, k * grid_step + bb_min.z, vote,
+                                num_rays);
+          total_rays.fetch_add(num_rays, std::memory_order_relaxed);
+        }
+      }
+      for (int k = 0; k < num_z; k++) {
+        if (inside[k]) {
+          slab_points[column_index].push_back({i, j, k});
+        }
+      }
+    };
+    igl::parallel_for(num_columns, func_igl_column, 16);
+  };
+
+  auto write_slab = [&](int64_t slab, const SlabPoints &slab_points) {
+    const int first_layer = slab * TILE_SIZE;
+    writer.begin_slab(first_layer, std::min(TILE_SIZE, num_y - first_layer));
+    for (const auto &points : slab_points) {
+      for (const int3 &index : points) {
+        writer.add(index.x, index.y, index.z);
+      }
+    }
+    writer.end_slab();
+  };
+
+  // Octree cells spanning points on both sides of the surface are refined
+  auto cell_touches_surface = [&](const BVH &bvh, const GridCell &cell) {
+    BBox box;
+    box.min = Vec3(cell.lo[0], cell.lo[1], cell.lo[2]) * grid_step + bb_min;
+    box.max = Vec3(cell.hi[0] - 1, cell.hi[1] - 1, cell.hi[2] - 1) * grid_step +
+              bb_min;
+    // Covers the rounding of the grid point coordinates
+    const float margin = 1e-3f * grid_step;
+    box.min = box.min - Vec3(margin);
+    box.max += Vec3(margin);
+    return bvh.touches_box(box);
+  };
+  // The points of an octree level as packets of consecutive points, the
+  // points of a leaf cell are next to each other
+  auto classify_points = [&](const std::vector<GridPoint> &points,
+                             std::vector<char> &inside) {
+    inside.resize(points.size());
+    const int num_packets = (points.size() + PACKET_SIZE - 1) / PACKET_SIZE;
+    auto func_igl_packet = [&](int packet) {
+      const size_t first = size_t(packet) * PACKET_SIZE;
+      const int count = std::min<size_t>(PACKET_SIZE, points.size() - first);
+      int3 indices[PACKET_SIZE];
+      for (int lane = 0; lane < count; lane++) {
+        const GridPoint &point = points[first + lane];
+        indices[lane] = {point.i, point.j, point.k};
+      }
+      bool packet_inside[PACKET_SIZE];
+      trace_packet(indices, count, packet_inside);
+      for (int lane = 0; lane < count; lane++) {
+        inside[first + lane] = packet_inside[lane];
       }
+    };
+    igl::parallel_for(num_packets, func_igl_packet, 16);
+  };
+
+  // The inside cells of the octree of the slab
+  std::unique_ptr<BVH> bvh;
+  int64_t num_classified = 0;
+  auto classify_octree = [&](int64_t slab, std::vector<GridCell> &cells) {
+    const int first_layer = slab * TILE_SIZE;
+    cells.clear();
+    num_classified += classify_grid_adaptive(
+        {{0, first_layer, 0},
+         {num_x, std::min(first_layer + TILE_SIZE, num_y), num_z}},
+        8,
+        [&](const GridCell &cell) { return cell_touches_surface(*bvh, cell); },
+        classify_points, [&](const GridCell &cell) { cells.push_back(cell); });
+  };
+  auto write_cells = [&](int64_t slab, const std::vector<GridCell> &cells) {
+    const int first_layer = slab * TILE_SIZE;
+    writer.begin_slab(first_layer, std::min(TILE_SIZE, num_y - first_layer));
+    for (const GridCell &cell : cells) {
+      writer.add(cell);
     }
+    writer.end_slab();
   };
 
   Timer timer;
-  igl::parallel_for(num_points, func_igl, 1000);
+  double seconds_waiting = 0.0;
+  if (scanline) {
+    seconds_waiting = run_slab_pipeline<SlabPoints>(
+        num_slabs, NUM_SLAB_BUFFERS, classify_columns, write_slab);
+  } else if (octree) {
+    std::vector<BVHTriangle> bvh_tris;
+    for (const auto &t : tris) {
+      bvh_tris.push_back({t.verts[0], t.verts[1], t.verts[2]});
+    }
+    bvh = std::make_unique<BVH>(bvh_tris);
+    timer.tock("Building BVH");
+    timer.tick();
+    seconds_waiting = run_slab_pipeline<std::vector<GridCell>>(
+        num_slabs, NUM_SLAB_BUFFERS, classify_octree, write_cells);
+    printf("Classified points = %lld of %lld\n", (long long)num_classified,
+           (long long)num_points);
+  } else if (rowmajor) {
+    seconds_waiting = run_slab_pipeline<SlabPoints>(
+        num_slabs, NUM_SLAB_BUFFERS, classify_rows, write_slab);
+  } else {
+    seconds_waiting = run_slab_pipeline<SlabPoints>(
+        num_slabs, NUM_SLAB_BUFFERS, classify_tiles, write_slab);
+  }
+  const double seconds = timer.elapsed().count() / 1.0e9;
   timer.tock("Filtering points");
+  if (scanline) {
+    printf("Columns falling back to the ray vote = %lld of %lld\n",
+           (long long)num_fallback_columns, (long long)num_x * num_y);
+  }
+  // Time the classification stalled on the writer, 0 when writing keeps up
+  printf("Waiting for the writer = %.3f s\n", seconds_waiting);
+  printf("Average rays per point = %.2f\n",
+         num_points > 0 ? double(total_rays) / num_points : 0.0);
+  // Compares the traversal cost of the schedules, which cast the same rays
+  printf("Rays per second = %.3g\n",
+         seconds > 0.0 ? double(total_rays) / seconds : 0.0);
+
+  uint64_t file_size = writer.close();
+  printf("Inside points = %lld, %s of %.3f MB\n",
+         (long long)writer.num_points(),
+         occupancy ? "occupancy grid" : "points file", file_size / 1e6);
 
   rtcReleaseScene(scene);
   rtcReleaseDevice(device);
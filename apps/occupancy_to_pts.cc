@@ -0,0 +1,31 @@
+#include <cstdio>
+
+#include "occupancy_grid.hh"
+#include "timers.hh"
+
+using namespace mp::io::occupancy;
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    puts("Usage: occupancy_to_pts input.occ output.pts\n"
+         "Expands an occupancy grid written by mcpip_embree into a binary "
+         "file containing N * 3 floats, the inside grid points.");
+    return 1;
+  }
+
+  Timer timer;
+  OccupancyGrid grid = OccupancyGrid::read(argv[1]);
+  timer.tock("Reading occupancy grid");
+  const Header &header = grid.header();
+  printf("Grid of %dx%dx%d points, step %g, %s\n", header.num_x, header.num_y,
+         header.num_z, header.step,
+         header.encoding == Encoding::RunLength ? "run length encoded"
+                                                : "raw bits");
+
+  timer.tick();
+  long long num_points = grid.write_points(argv[2]);
+  timer.tock("Writing points");
+  printf("Inside points = %lld\n", num_points);
+
+  return 0;
+}
@@ -0,0 +1,89 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bvh.hh"
+#include "sdf_volume.hh"
+#include "stl_io.hh"
+#include "timers.hh"
+
+using namespace mp::io;
+
+int main(int argc, char **argv) {
+  if (argc != 4 && argc != 5 && argc != 6) {
+    puts("Usage: sdf input.stl voxel_size band_width [sign] [output.pts]\n"
+         "sign: parity (default) or winding\n"
+         "Builds a sparse narrow band signed distance volume, the optional "
+         "output is a binary file containing N * 4 floats (x, y, z, distance) "
+         "for the voxels inside the band.");
+    return 1;
+  }
+
+  float voxel_size = atof(argv[2]);
+  float band_width = atof(argv[3]);
+  if (voxel_size <= 0.0f || band_width <= 0.0f) {
+    puts("ERROR: Voxel size and band width must be positive numbers.");
+    return 1;
+  }
+  SDFSignMethod sign_method = SDFSignMethod::RayParity;
+  if (argc >= 5) {
+    std::string sign = argv[4];
+    if (sign == "winding") {
+      sign_method = SDFSignMethod::WindingNumber;
+    } else if (sign != "parity") {
+      puts("ERROR: Unknown sign method.");
+      return 1;
+    }
+  }
+
+  std::vector<stl::Triangle> tris_stl;
+  stl::read_stl(argv[1], tris_stl);
+  if (tris_stl.size() == 0) {
+    puts("Empty mesh");
+    return 0;
+  }
+
+  std::vector<BVHTriangle> tris;
+  for (const auto &t : tris_stl) {
+    tris.push_back({t.verts[0], t.verts[1], t.verts[2]});
+  }
+
+  Timer t;
+  BVH bvh(tris, {BVHBuildMethod::LBVH});
+  t.tock("Building BVH");
+
+  t.tick();
+  SDFVolume volume(tris, bvh, voxel_size, band_width, sign_method);
+  t.tock("Building SDF volume");
+
+  BBox bounds = bvh.nodes()[0].bbox();
+  Vec3 dims = bounds.max - bounds.min + Vec3(2.0f * band_width);
+  double dense_bytes = double(dims.x / voxel_size) * (dims.y / voxel_size) *
+                       (dims.z / voxel_size) * sizeof(float);
+  std::cout << "Bricks = " << volume.bricks().size() << std::endl;
+  std::cout << "Memory = " << volume.memory_bytes() / (1024.0 * 1024.0)
+            << " MB, dense grid = " << dense_bytes / (1024.0 * 1024.0)
+            << " MB" << std::endl;
+
+  if (argc == 6) {
+    std::ofstream file(argv[5], std::ios::binary);
+    const int n = SDFBrick::SIZE;
+    for (const SDFBrick &brick : volume.bricks()) {
+      for (int v = 0; v < SDFBrick::NUM_VOXELS; v++) {
+        if (std::abs(brick.values[v]) >= band_width) {
+          continue;
+        }
+        float record[4] = {(n * brick.x + v % n) * voxel_size,
+                           (n * brick.y + v / n % n) * voxel_size,
+                           (n * brick.z + v / (n * n)) * voxel_size,
+                           brick.values[v]};
+        file.write(reinterpret_cast<char *>(record), sizeof(record));
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,77 @@
+/* Bounded pipeline over the slabs of a grid. The calling thread produces
+ * slabs in order and classifies each one into a free buffer (classify is
+ * expected to parallelize over the slab itself), a writer thread consumes the
+ * classified buffers in slab order. Only num_buffers buffers ever exist, so
+ * memory depends on the slab size and not on the grid size, while the
+ * writing of a slab overlaps the classification of the next ones. */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/* Calls classify(slab, buffer) then write(slab, buffer) for slabs
+ * 0..num_slabs-1, writes happen in slab order. Buffers are reused, classify
+ * must reset the one it gets. Returns the seconds classify waited for the
+ * writer, the share of the run bounded by writing. */
+template <typename Buffer, typename Classify, typename Write>
+double run_slab_pipeline(int64_t num_slabs, int num_buffers,
+                         const Classify &classify, const Write &write) {
+  std::vector<Buffer> buffers(std::max(num_buffers, 1));
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<int> free_buffers;
+  for (int b = 0; b < int(buffers.size()); b++) {
+    free_buffers.push_back(b);
+  }
+  // Classified slabs waiting for the writer, in slab order
+  std::deque<std::pair<int64_t, int>> classified;
+
+  std::thread writer([&]() {
+    for (int64_t slab = 0; slab < num_slabs; slab++) {
+      int b;
+      {
+        std::unique_lock lock(mutex);
+        changed.wait(lock, [&]() { return !classified.empty(); });
+        b = classified.front().second;
+        classified.pop_front();
+      }
+      write(slab, buffers[b]);
+      {
+        std::scoped_lock lock(mutex);
+        free_buffers.push_back(b);
+      }
+      changed.notify_all();
+    }
+  });
+
+  double seconds_waiting = 0.0;
+  for (int64_t slab = 0; slab < num_slabs; slab++) {
+    int b;
+    {
+      auto start = std::chrono::steady_clock::now();
+      std::unique_lock lock(mutex);
+      changed.wait(lock, [&]() { return !free_buffers.empty(); });
+      b = free_buffers.back();
+      free_buffers.pop_back();
+      seconds_waiting += std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    }
+    classify(slab, buffers[b]);
+    {
+      std::scoped_lock lock(mutex);
+      classified.push_back({slab, b});
+    }
+    changed.notify_all();
+  }
+  writer.join();
+  return seconds_waiting;
+}
@@ -1,72 +1,73 @@
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <execution>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <numeric>
+#include <string>
 #include <vector>
 
+#include "adaptive_grid.hh"
+#include "bvh.hh"
+#include "fast_winding_number.hh"
+#include "grid_writer.hh"
+#include "slab_pipeline.hh"
+#include "solid_angle.hh"
 #include "stl_io.hh"
+#include "timers.hh"
 #include "vec3.hh"
 
 #define PI 3.14159265359
 
-using namespace mp::io::stl;
-
-static double tet_solid_angle(const Vec3 &origin, Vec3 a, Vec3 b, Vec3 c) {
-  a = a - origin;
-  b = b - origin;
-  c = c - origin;
-
-  auto al = a.length();
-  auto bl = b.length();
-  auto cl = c.length();
-
-  auto numerator = a.dot(b.cross(c));
-  auto denominator =
-      al * bl * cl + a.dot(b) * cl + a.dot(c) * bl + b.dot(c) * al;
-
-  return atan2(numerator, denominator);
-}
+// Number of y layers of the slabs the grid is classified in
+const int SLAB_LAYERS = 8;
 
-static double calc_winding_number(const Vec3 &query_point,
-                                  const std::vector<Triangle> &tris) {
-  double w = 0.0;
-  for (const auto &t : tris) {
-    w += tet_solid_angle(query_point, t.v1, t.v2, t.v3);
-  }
-  return w;
-}
-
-static double
-calc_winding_number_parallelized(const Vec3 &query_point,
-                                 const std::vector<Triangle> &tris) {
-  auto map_func = [&](const Triangle &t) {
-    return tet_solid_angle(query_point, t.v1, t.v2, t.v3);
-  };
+// Slabs classified or waiting for the writer at a time
+const int NUM_SLAB_BUFFERS = 4;
 
-  return std::transform_reduce(std::execution::par, tris.cbegin(), tris.cend(),
-                               0.0, std::plus{}, map_func);
-}
+using namespace mp::io::stl;
 
+// The half solid angles sum to 2 * PI times the winding number, inside is a
+// winding number of at least 0.5
 static bool is_inside(const Vec3 &query_point,
-                      const std::vector<Triangle> &tris) {
-  return calc_winding_number(query_point, tris) >= (2.0 * PI);
+                      const SolidAngleTriangles &tris) {
+  return tris.half_solid_angle_sum(query_point) >= PI;
 }
 
 static bool is_inside_parallelized(const Vec3 &query_point,
-                                   const std::vector<Triangle> &tris) {
-  return calc_winding_number_parallelized(query_point, tris) >= (2.0 * PI);
+                                   const SolidAngleTriangles &tris) {
+  // Chunks of batches, enough work per task to amortize the scheduling
+  const size_t CHUNK_SIZE = 256;
+  const size_t num_batches = tris.batches().size();
+  std::vector<size_t> chunks((num_batches + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  std::iota(chunks.begin(), chunks.end(), size_t(0));
+  auto map_func = [&](size_t chunk) {
+    return tris.half_solid_angle_sum(
+        query_point, chunk * CHUNK_SIZE,
+        std::min((chunk + 1) * CHUNK_SIZE, num_batches));
+  };
+  double w = std::transform_reduce(std::execution::par, chunks.cbegin(),
+                                   chunks.cend(), 0.0, std::plus{}, map_func);
+  return w >= PI;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 5) {
+  if (argc < 5 || argc > 8) {
     puts("Usage: winding_numbers input_filepath.stl grid_step "
-         "output_filepath.pts parallelize=Y/N\n"
+         "output_filepath.pts parallelize=Y/N [octree] [fast [beta]]\n"
          "Example: winding_numbers bunny.stl 5.0 bunny_points.pts Y\n"
          "Generates points inside the volume of an oriented triangle soup by "
          "filtering bounding box grid points.\n"
-         "Outputs a binary file containing N * 3 floats.");
+         "Outputs a binary file containing N * 3 floats.\n"
+         "octree classifies one point per octree cell that no triangle "
+         "touches, only the cells crossing the surface are refined down to "
+         "single grid points.\n"
+         "fast approximates the winding numbers of far away BVH nodes by "
+         "their dipole and second order expansions, nodes farther than beta "
+         "(default 2) times their radius are approximated.\n"
+         "Memory: points are classified and written in slabs of 8 y "
+         "layers.");
     return 1;
   }
 
@@ -78,6 +79,22 @@ int main(int argc, char **argv) {
   }
   char *output_filepath = argv[3];
   bool do_parallelize = argv[4][0] == 'Y';
+  bool octree = false;
+  bool fast = false;
+  float beta = 2.0f;
+  for (int arg = 5; arg < argc; arg++) {
+    std::string option = argv[arg];
+    if (option == "octree") {
+      octree = true;
+    } else if (option == "fast") {
+      fast = true;
+    } else if (fast && atof(argv[arg]) > 0.0f) {
+      beta = atof(argv[arg]);
+    } else {
+      puts("ERROR: Unknown option.");
+      return 1;
+    }
+  }
 
   // Load mesh
   std::vector<Triangle> mesh;
@@ -94,7 +111,12 @@ int main(int argc, char **argv) {
     }
   }
 
-  std::ofstream file(output_filepath, std::ios::binary);
+  SolidAngleTriangles solid_angle_tris;
+  if (!fast) {
+    for (const auto &t : mesh) {
+      solid_angle_tris.add(t.v1, t.v2, t.v3);
+    }
+  }
 
   auto is_inside_func = is_inside;
   if (do_parallelize) {
@@ -106,18 +128,127 @@ int main(int argc, char **argv) {
   int num_y = static_cast<int>(bb_dims.y / grid_step);
   int num_z = static_cast<int>(bb_dims.z / grid_step);
 
-  int num_points = num_x * num_y * num_z;
-  printf("Number of grid points before filtering = %d\n", num_points);
+  int64_t num_points = int64_t(num_x) * num_y * num_z;
+  printf("Number of grid points before filtering = %lld\n",
+         (long long)num_points);
 
-  for (int i = 0; i < num_x; i++) {
-    for (int j = 0; j < num_y; j++) {
-      for (int k = 0; k < num_z; k++) {
-        Vec3 query_point(i * grid_step + bb_min.x, j * grid_step + bb_min.y,
-                         k * grid_step + bb_min.z);
-        if (is_inside_func(query_point, mesh)) {
-          file.write(reinterpret_cast<char *>(&query_point), sizeof(Vec3));
+  std::vector<BVHTriangle> bvh_tris;
+  std::unique_ptr<BVH> bvh;
+  std::unique_ptr<FastWindingNumber> fwn;
+  if (octree || fast) {
+    for (const auto &t : mesh) {
+      bvh_tris.push_back({t.verts[0], t.verts[1], t.verts[2]});
+    }
+    bvh = std::make_unique<BVH>(bvh_tris);
+  }
+  if (fast) {
+    Timer timer;
+    fwn = std::make_unique<FastWindingNumber>(bvh_tris, *bvh, beta);
+    timer.tock("Building winding number expansions");
+  }
+
+  auto grid_point = [&](int i, int j, int k) {
+    return Vec3(i * grid_step + bb_min.x, j * grid_step + bb_min.y,
+                k * grid_step + bb_min.z);
+  };
+  auto touches = [&](const GridCell &cell) {
+    BBox box;
+    // The margin covers the rounding of the grid point coordinates
+    const Vec3 margin(1e-3f * grid_step);
+    box.min = grid_point(cell.lo[0], cell.lo[1], cell.lo[2]) - margin;
+    box.max =
+        grid_point(cell.hi[0] - 1, cell.hi[1] - 1, cell.hi[2] - 1) + margin;
+    return bvh->touches_box(box);
+  };
+  // Only called by the thread classifying the slabs
+  std::vector<Vec3> queries;
+  std::vector<float> winding_numbers;
+  auto classify = [&](const std::vector<GridPoint> &points,
+                      std::vector<char> &inside) {
+    queries.resize(points.size());
+    std::transform(std::execution::par, points.begin(), points.end(),
+                   queries.begin(), [&](const GridPoint &p) {
+                     return grid_point(p.i, p.j, p.k);
+                   });
+    inside.resize(points.size());
+    if (fwn) {
+      fwn->winding_numbers(queries, winding_numbers);
+      std::transform(winding_numbers.begin(), winding_numbers.end(),
+                     inside.begin(), [](float w) { return w >= 0.5f; });
+      return;
+    }
+    std::transform(std::execution::par, queries.begin(), queries.end(),
+                   inside.begin(), [&](const Vec3 &query_point) {
+                     return is_inside_func(query_point, solid_angle_tris);
+                   });
+  };
+
+  /* The grid is processed in slabs of SLAB_LAYERS y layers, a slab holds the
+   * cells found inside (single points unless octree) while the writer thread
+   * writes the slabs before it in order */
+  const int num_slabs = (num_y + SLAB_LAYERS - 1) / SLAB_LAYERS;
+  int64_t num_classified = 0;
+  std::vector<GridPoint> points;
+  std::vector<char> inside;
+  auto classify_slab = [&](int64_t slab, std::vector<GridCell> &cells) {
+    const int first_layer = slab * SLAB_LAYERS;
+    const GridCell slab_cell = {
+        {0, first_layer, 0},
+        {num_x, std::min(first_layer + SLAB_LAYERS, num_y), num_z}};
+    cells.clear();
+    auto emit = [&](const GridCell &cell) { cells.push_back(cell); };
+    if (octree) {
+      num_classified +=
+          classify_grid_adaptive(slab_cell, 8, touches, classify, emit);
+      return;
+    }
+    points.clear();
+    for (int j = slab_cell.lo[1]; j < slab_cell.hi[1]; j++) {
+      for (int i = 0; i < num_x; i++) {
+        for (int k = 0; k < num_z; k++) {
+          points.push_back({i, j, k});
         }
       }
     }
-  }
+    if (fast) {
+      classify(points, inside);
+    } else {
+      // Point by point, parallelize=Y parallelizes the sum of each point
+      inside.resize(points.size());
+      for (size_t p = 0; p < points.size(); p++) {
+        inside[p] = is_inside_func(
+            grid_point(points[p].i, points[p].j, points[p].k),
+            solid_angle_tris);
+      }
+    }
+    num_classified += points.size();
+    for (size_t p = 0; p < points.size(); p++) {
+      if (inside[p]) {
+        const GridPoint &q = points[p];
+        emit({{q.i, q.j, q.k}, {q.i + 1, q.j + 1, q.k + 1}});
+      }
+    }
+  };
+
+  const float origin[3] = {bb_min.x, bb_min.y, bb_min.z};
+  GridPointWriter writer(output_filepath, origin, grid_step, num_x, num_y,
+                         num_z, false);
+  auto write_slab = [&](int64_t slab, const std::vector<GridCell> &cells) {
+    const int first_layer = slab * SLAB_LAYERS;
+    writer.begin_slab(first_layer, std::min(SLAB_LAYERS, num_y - first_layer));
+    for (const GridCell &cell : cells) {
+      writer.add(cell);
+    }
+    writer.end_slab();
+  };
+
+  Timer timer;
+  run_slab_pipeline<std::vector<GridCell>>(num_slabs, NUM_SLAB_BUFFERS,
+                                           classify_slab, write_slab);
+  writer.close();
+  timer.tock("Filtering points");
+  printf("Classified points = %lld of %lld\n", (long long)num_classified,
+         (long long)num_points);
+  printf("Inside points = %lld\n", (long long)writer.num_points());
+  return 0;
 }
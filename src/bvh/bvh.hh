@@ -1,18 +1,60 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <omp.h>
+#include <utility>
+#include <vector>
 
+#include "bvh_stats.hh"
 #include "common.hh"
+#include "mapped_file.hh"
+#include "morton.hh"
+#include "point_tri_distance.hh"
+#include "radix_sort.hh"
+#include "ray_tri_intersect.hh"
+#include "tri_box_overlap.hh"
+#include "tri_tri_intersect.hh"
 #include "vec3.hh"
 
 struct BBox {
-  Vec3 max, min;
+  Vec3 max = -INFINITY, min = INFINITY;
+  void grow(const Vec3 &point) {
+    max.max(point);
+    min.min(point);
+  }
+  void grow(const BBox &other) {
+    max.max(other.max);
+    min.min(other.min);
+  }
+  float surface_area() const {
+    Vec3 dims = max - min;
+    if (dims.x < 0 || dims.y < 0 || dims.z < 0) {
+      return 0.0f;
+    }
+    return 2.0f * (dims.x * dims.y + dims.y * dims.z + dims.z * dims.x);
+  }
+  // Touching boxes count as overlapping, flat boxes of axis aligned triangles
+  // would never overlap otherwise
+  bool does_overlap(const BBox &other) const {
+    return (max.x >= other.min.x) && (max.y >= other.min.y) &&
+           (max.z >= other.min.z) && (min.x <= other.max.x) &&
+           (min.y <= other.max.y) && (min.z <= other.max.z);
+  }
 };
 
 struct BVHTriangle {
   Vec3 a, b, c;
   Vec3 &operator[](size_t i) { return reinterpret_cast<Vec3 *>(&(*this))[i]; }
+  const Vec3 &operator[](size_t i) const {
+    return reinterpret_cast<const Vec3 *>(&(*this))[i];
+  }
   Vec3 centroid() const { return (a + b + c) / 3; };
   BBox calc_bounding_box() const {
     BBox out;
@@ -40,42 +82,110 @@ inline bool all_lt(const Vec3 &a, const Vec3 &b) {
   return (a.x < b.x) && (a.y < b.y) && (a.z < b.z);
 }
 
+inline bool all_ge(const Vec3 &a, const Vec3 &b) {
+  return (a.x >= b.x) && (a.y >= b.y) && (a.z >= b.z);
+}
+
+inline bool all_le(const Vec3 &a, const Vec3 &b) {
+  return (a.x <= b.x) && (a.y <= b.y) && (a.z <= b.z);
+}
+
 struct BVHNode {
-  BVHNode *L, *R;
   Vec3 aabb_max, aabb_min;
-  std::vector<BVHTriangle>::iterator start, end;
-  int count() const { return end - start + 1; }
+  int L, R;       // Child node indices, -1 for leaves
+  int start, end; // Range of BVH triangle indices covered by this node
+  int count() const { return end - start; }
+  bool is_leaf() const { return L < 0; }
+  BBox bbox() const {
+    BBox out;
+    out.max = aabb_max;
+    out.min = aabb_min;
+    return out;
+  }
+  // Inclusive, see BBox::does_overlap
   bool does_overlap(const BVHNode &other) const {
-    return all_gt(aabb_max, other.aabb_min) &&
-           (all_lt(aabb_min, other.aabb_max));
+    return all_ge(aabb_max, other.aabb_min) &&
+           (all_le(aabb_min, other.aabb_max));
   }
   bool does_overlap(const BBox &bbox) const {
-    return all_gt(aabb_max, bbox.min) && all_lt(aabb_min, bbox.max);
+    return all_ge(aabb_max, bbox.min) && all_le(aabb_min, bbox.max);
   }
+  // Zero when p is inside the box
+  float squared_distance(const Vec3 &p) const {
+    float dx = std::max(std::max(aabb_min.x - p.x, p.x - aabb_max.x), 0.0f);
+    float dy = std::max(std::max(aabb_min.y - p.y, p.y - aabb_max.y), 0.0f);
+    float dz = std::max(std::max(aabb_min.z - p.z, p.z - aabb_max.z), 0.0f);
+    return dx * dx + dy * dy + dz * dz;
+  }
+};
+
+// Pair of triangles whose bounding boxes overlap, as indices into the triangle
+// vectors the BVHs were built from
+struct BVHCandidatePair {
+  int a, b;
+};
+
+// One buffer per OpenMP thread, so traversal threads never synchronize
+using BVHCandidatePairBuffers = std::vector<std::vector<BVHCandidatePair>>;
+
+// Intersecting triangles a and b and where they meet
+struct BVHIntersection {
+  int a, b;
+  TriTriSegment segment;
 };
 
-void intersect_ray_tri(BVHRay &ray, const BVHTriangle &tri) {
+using BVHIntersectionBuffers = std::vector<std::vector<BVHIntersection>>;
+
+// Closest point on the mesh to a query point, tri_index is -1 when no
+// triangle was found within the search radius
+struct BVHClosestPoint {
+  Vec3 point;
+  float squared_distance = INFINITY;
+  int tri_index = -1;
+};
+
+template <typename T>
+size_t count_pairs(const std::vector<std::vector<T>> &buffers) {
+  size_t n = 0;
+  for (const auto &buffer : buffers) {
+    n += buffer.size();
+  }
+  return n;
+}
+
+// Moller-Trumbore, true when the ray hits tri at some t > 0.0001
+inline bool ray_hits_tri(const BVHRay &ray, const BVHTriangle &tri, float &t) {
   const Vec3 edge1 = tri.b - tri.a;
   const Vec3 edge2 = tri.c - tri.a;
   const Vec3 h = cross(ray.D, edge2);
   const float a = dot(edge1, h);
   if (a > -0.0001f && a < 0.0001f)
-    return; // ray parallel to triangle
+    return false; // ray parallel to triangle
   const float f = 1 / a;
   const Vec3 s = ray.O - tri.a;
   const float u = f * dot(s, h);
   if (u < 0 || u > 1)
-    return;
+    return false;
   const Vec3 q = cross(s, edge1);
   const float v = f * dot(ray.D, q);
   if (v < 0 || u + v > 1)
-    return;
-  const float t = f * dot(edge2, q);
-  if (t > 0.0001f)
+    return false;
+  t = f * dot(edge2, q);
+  return t > 0.0001f;
+}
+
+inline void intersect_ray_tri(BVHRay &ray, const BVHTriangle &tri) {
+  float t;
+  if (ray_hits_tri(ray, tri, t))
     ray.t = std::min(ray.t, t);
 }
 
-bool intersect_ray_aabb(const BVHRay &ray, const Vec3 &bmin, const Vec3 &bmax) {
+// 1 + 2 gamma(3), with gamma(n) = n u / (1 - n u) and u = 2^-24
+const float RAY_AABB_EXIT_SCALE = 1.0f + 2.0f * 3.0f * 5.96046448e-08f /
+                                             (1.0f - 3.0f * 5.96046448e-08f);
+
+inline bool intersect_ray_aabb(const BVHRay &ray, const Vec3 &bmin,
+                               const Vec3 &bmax) {
   float tx1 = (bmin.x - ray.O.x) / ray.D.x, tx2 = (bmax.x - ray.O.x) / ray.D.x;
   float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
   float ty1 = (bmin.y - ray.O.y) / ray.D.y, ty2 = (bmax.y - ray.O.y) / ray.D.y;
@@ -87,134 +197,2037 @@ bool intersect_ray_aabb(const BVHRay &ray, const Vec3 &bmin, const Vec3 &bmax) {
   return tmax >= tmin && tmin < ray.t && tmax > 0;
 }
 
+// 1 / D with zero components replaced by tiny ones, keeping slabs finite
+inline Vec3 safe_inverse_direction(const Vec3 &D) {
+  Vec3 inverse;
+  for (int axis = 0; axis < 3; axis++) {
+    float d = D[axis];
+    if (std::abs(d) < 1e-30f) {
+      d = std::copysign(1e-30f, d);
+    }
+    inverse[axis] = 1.0f / d;
+  }
+  return inverse;
+}
+
+/* Slab test with the exit distance widened by the rounding bound of "Robust
+ * BVH Ray Traversal" (Ize 2013), boxes the ray touches are never culled, so
+ * exact triangle tests see every candidate */
+inline bool ray_may_hit_aabb(const Vec3 &O, const Vec3 &inverse, float max_t,
+                             const Vec3 &bmin, const Vec3 &bmax) {
+  float t_enter = 0.0f, t_exit = max_t;
+  for (int axis = 0; axis < 3; axis++) {
+    float t0 = (bmin[axis] - O[axis]) * inverse[axis];
+    float t1 = (bmax[axis] - O[axis]) * inverse[axis];
+    t_enter = std::max(t_enter, std::min(t0, t1));
+    t_exit = std::min(t_exit, std::max(t0, t1) * RAY_AABB_EXIT_SCALE);
+  }
+  return t_enter <= t_exit;
+}
+
+/* Array that either owns its elements or views read only memory owned
+ * elsewhere, such as a mapped BVH snapshot. Const access goes through data_,
+ * which points to whichever storage is active, mutable access is only valid
+ * on owned arrays (see detach). */
+template <typename T> class BVHArray {
+private:
+  std::vector<T> owned_;
+  const T *data_ = nullptr;
+  size_t size_ = 0;
+  bool is_view_ = false;
+
+  void rebind() {
+    if (!is_view_) {
+      data_ = owned_.data();
+      size_ = owned_.size();
+    }
+  }
+
+public:
+  BVHArray() = default;
+  BVHArray(const BVHArray &other)
+      : owned_(other.owned_), data_(other.data_), size_(other.size_),
+        is_view_(other.is_view_) {
+    rebind();
+  }
+  BVHArray &operator=(const BVHArray &other) {
+    owned_ = other.owned_;
+    data_ = other.data_;
+    size_ = other.size_;
+    is_view_ = other.is_view_;
+    rebind();
+    return *this;
+  }
+  BVHArray(BVHArray &&other) noexcept
+      : owned_(std::move(other.owned_)), data_(other.data_),
+        size_(other.size_), is_view_(other.is_view_) {
+    rebind();
+  }
+  BVHArray &operator=(BVHArray &&other) noexcept {
+    owned_ = std::move(other.owned_);
+    data_ = other.data_;
+    size_ = other.size_;
+    is_view_ = other.is_view_;
+    rebind();
+    return *this;
+  }
+
+  size_t size() const { return size_; }
+  const T *data() const { return data_; }
+  const T &operator[](size_t i) const { return data_[i]; }
+  T &operator[](size_t i) {
+    tassert(!is_view_);
+    return owned_[i];
+  }
+  const T *begin() const { return data_; }
+  const T *end() const { return data_ + size_; }
+  typename std::vector<T>::iterator begin() {
+    tassert(!is_view_);
+    return owned_.begin();
+  }
+  typename std::vector<T>::iterator end() {
+    tassert(!is_view_);
+    return owned_.end();
+  }
+
+  void resize(size_t n) {
+    owned_.resize(n);
+    rebind();
+  }
+  void swap(std::vector<T> &other) {
+    owned_.swap(other);
+    rebind();
+  }
+
+  void view(const T *data, size_t n) {
+    owned_.clear();
+    data_ = data;
+    size_ = n;
+    is_view_ = true;
+  }
+  // Copies a view into owned memory so it can be modified
+  void detach() {
+    if (is_view_) {
+      owned_.assign(data_, data_ + size_);
+      is_view_ = false;
+      rebind();
+    }
+  }
+};
+
+// Hash of the vertex coordinates, used to tell whether a BVH snapshot was
+// built from a given mesh. Chunks are hashed in parallel then combined in
+// order, so the result does not depend on the number of threads.
+inline uint64_t hash_triangles(const std::vector<BVHTriangle> &tris) {
+  const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+  const uint64_t FNV_PRIME = 0x100000001b3ull;
+  const int chunk_size = 1 << 14;
+  const int num_tris = tris.size();
+  const int num_chunks = (num_tris + chunk_size - 1) / chunk_size;
+  std::vector<uint64_t> chunk_hashes(num_chunks);
+#pragma omp parallel for
+  for (int chunk = 0; chunk < num_chunks; chunk++) {
+    const int first = chunk * chunk_size;
+    const int last = std::min(first + chunk_size, num_tris);
+    uint64_t h = FNV_OFFSET;
+    for (int t = first; t < last; t++) {
+      for (int v = 0; v < 3; v++) {
+        for (int axis = 0; axis < 3; axis++) {
+          uint32_t bits;
+          float coordinate = tris[t][v][axis];
+          std::memcpy(&bits, &coordinate, sizeof(bits));
+          h = (h ^ bits) * FNV_PRIME;
+        }
+      }
+    }
+    chunk_hashes[chunk] = h;
+  }
+  uint64_t h = FNV_OFFSET ^ uint64_t(num_tris);
+  for (uint64_t chunk_hash : chunk_hashes) {
+    h = (h ^ chunk_hash) * FNV_PRIME;
+  }
+  return h;
+}
+
+/* BVH snapshot file layout: this header followed by the node array and the
+ * triangle permutation, at 64 byte aligned offsets from the start of the
+ * file. There are no pointers so the file can be mapped at any address and
+ * used in place. */
+struct BVHSnapshotHeader {
+  static constexpr uint32_t VERSION = 1;
+  char magic[8];
+  uint32_t version;
+  // sizeof(BVHNode) of the writer, guards against layout changes
+  uint32_t node_size;
+  uint64_t num_nodes;
+  uint64_t num_tri_indices;
+  uint64_t mesh_hash;
+  uint64_t nodes_offset;
+  uint64_t tri_indices_offset;
+  float build_sah_cost;
+  uint32_t padding;
+};
+
+inline const char BVH_SNAPSHOT_MAGIC[8] = {'M', 'P', 'B', 'V', 'H', 0, 0, 0};
+
+enum class BVHBuildMethod {
+  // Recursive top-down split at the middle of the largest axis
+  Midpoint,
+  // Linear BVH, triangles are sorted along a Morton curve and the hierarchy is
+  // emitted in parallel, see "Maximizing Parallelism in the Construction of
+  // BVHs, Octrees, and k-d Trees" (Karras 2012)
+  LBVH,
+  // Top-down binned SAH build that may also split space, clipping triangles
+  // straddling the plane into both children. Long thin triangles (common in
+  // tessellated CAD models) then stop inflating every node above them, at the
+  // cost of referencing some triangles from several leaves
+  SBVH,
+};
+
+struct BVHBuildOptions {
+  BVHBuildMethod method = BVHBuildMethod::Midpoint;
+  // LBVH only: use 63 bit Morton codes (21 bits per axis) instead of 30 bits
+  // (10 bits per axis), sorting takes twice the passes but large meshes get
+  // far fewer duplicate codes
+  bool morton_63_bits = false;
+  // LBVH only: number of bottom-up treelet restructuring passes, see "Fast
+  // Parallel Construction of High-Quality Bounding Volume Hierarchies" (Karras
+  // and Aila 2013), 0 disables the optimization
+  int treelet_passes = 0;
+  // SBVH only: spatial splits are tried when the children of the best object
+  // split overlap by more than this fraction of the root surface area
+  float spatial_split_alpha = 1e-5f;
+  // SBVH only: at most this fraction of the triangle count is added as
+  // duplicate references
+  float max_duplication = 0.3f;
+};
+
 class BVH {
 private:
-  BVHNode *nodes_;
-  int num_used_nodes_;
-
-  void recalc_bounds(BVHNode *node, const std::vector<BVHTriangle> &tris) {
-    node->aabb_max = -INFINITY;
-    node->aabb_min = INFINITY;
-    tassert(node->start >= tris.begin());
-    tassert(node->start <= tris.end());
-    tassert(node->end >= tris.begin());
-    tassert(node->end <= tris.end());
-
-    for (auto it = node->start; it != node->end; it++) {
+  BVHArray<BVHNode> nodes_;
+  // Triangles are never moved, nodes refer to ranges of this permutation
+  BVHArray<int> tri_indices_;
+  const std::vector<BVHTriangle> *tris_;
+  float build_sah_cost_;
+  // Keeps the mapping alive when nodes_ and tri_indices_ view a snapshot
+  std::shared_ptr<const MappedFile> snapshot_;
+
+  // SAH constants, used to score treelet topologies
+  static constexpr float NODE_TRAVERSAL_COST = 1.2f;
+  static constexpr float TRIANGLE_INTERSECTION_COST = 1.0f;
+  static constexpr int MAX_TREELET_LEAVES = 7;
+
+  struct Treelet {
+    int leaves[MAX_TREELET_LEAVES];
+    int internals[MAX_TREELET_LEAVES - 1];
+    int num_leaves;
+    int partitions[1 << MAX_TREELET_LEAVES];
+    float areas[1 << MAX_TREELET_LEAVES];
+  };
+
+  void recalc_bounds(BVHNode &node) {
+    node.aabb_max = -INFINITY;
+    node.aabb_min = INFINITY;
+    tassert(node.start >= 0);
+    tassert(node.end <= int(tri_indices_.size()));
+
+    // Const access, the indices may still view a mapped snapshot
+    const auto &tri_indices = std::as_const(tri_indices_);
+    for (int i = node.start; i < node.end; i++) {
+      const BVHTriangle &tri = (*tris_)[tri_indices[i]];
       for (int vi = 0; vi < 3; vi++) {
-        node->aabb_max.max((*it)[vi]);
-        node->aabb_min.min((*it)[vi]);
+        node.aabb_max.max(tri[vi]);
+        node.aabb_min.min(tri[vi]);
       }
     }
   }
 
-  void subdivide(BVHNode *nodes_pool, BVHNode *root,
-                 std::vector<BVHTriangle> &tris, int num_used_nodes) {
-    if (root->count() <= 2) {
+  void set_bounds_from_children(BVHNode &node) {
+    const BVHNode &L = nodes_[node.L];
+    const BVHNode &R = nodes_[node.R];
+    node.aabb_max = L.aabb_max;
+    node.aabb_max.max(R.aabb_max);
+    node.aabb_min = L.aabb_min;
+    node.aabb_min.min(R.aabb_min);
+  }
+
+  void subdivide(int node_index, int &num_used_nodes) {
+    BVHNode &root = nodes_[node_index];
+    if (root.count() <= 2) {
       return;
     }
-    Vec3 dims = root->aabb_max - root->aabb_min;
+    Vec3 dims = root.aabb_max - root.aabb_min;
     int split_axis = 0;
-    if (dims.y < dims.x) {
+    if (dims.y > dims.x) {
       split_axis = 1;
     }
     if (dims.z > dims[split_axis]) {
       split_axis = 2;
     }
-    float split_pos = root->aabb_min[split_axis] + dims[split_axis] * .5;
+    float split_pos = root.aabb_min[split_axis] + dims[split_axis] * .5;
 
-    auto it = std::partition(root->start, root->end, [=](const BVHTriangle &t) {
-      return t.centroid()[split_axis] < split_pos;
+    auto first = tri_indices_.begin() + root.start;
+    auto last = tri_indices_.begin() + root.end;
+    auto it = std::partition(first, last, [=](int tri_index) {
+      return (*tris_)[tri_index].centroid()[split_axis] < split_pos;
     });
 
-    if ((it == root->start) || (it == root->end)) {
+    if ((it == first) || (it == last)) {
       // abort split
       return;
     }
 
-    BVHNode *L = nodes_pool + (num_used_nodes++);
-    L->start = root->start;
-    L->end = it - 1;
-    recalc_bounds(L, tris);
-    L->L = L->R = nullptr;
+    int mid = it - tri_indices_.begin();
+
+    root.L = num_used_nodes++;
+    BVHNode &L = nodes_[root.L];
+    L.start = root.start;
+    L.end = mid;
+    recalc_bounds(L);
+    L.L = L.R = -1;
+
+    root.R = num_used_nodes++;
+    BVHNode &R = nodes_[root.R];
+    R.start = mid;
+    R.end = root.end;
+    recalc_bounds(R);
+    R.L = R.R = -1;
+
+    int left = root.L, right = root.R;
+    subdivide(left, num_used_nodes);
+    subdivide(right, num_used_nodes);
+  }
+
+  template <typename MortonCode> void build_lbvh(int treelet_passes) {
+    const int n = tri_indices_.size();
+    const std::vector<BVHTriangle> &tris = *tris_;
+
+    // Centroid bounds, Morton codes are computed relative to them
+    float min_x = INFINITY, min_y = INFINITY, min_z = INFINITY;
+    float max_x = -INFINITY, max_y = -INFINITY, max_z = -INFINITY;
+#pragma omp parallel for reduction(min : min_x, min_y, min_z)                 \
+    reduction(max : max_x, max_y, max_z)
+    for (int i = 0; i < n; i++) {
+      Vec3 c = tris[i].centroid();
+      min_x = std::min(min_x, c.x);
+      min_y = std::min(min_y, c.y);
+      min_z = std::min(min_z, c.z);
+      max_x = std::max(max_x, c.x);
+      max_y = std::max(max_y, c.y);
+      max_z = std::max(max_z, c.z);
+    }
+    Vec3 centroids_min(min_x, min_y, min_z);
+    Vec3 extent(max_x - min_x, max_y - min_y, max_z - min_z);
+    Vec3 inv_extent;
+    for (int axis = 0; axis < 3; axis++) {
+      inv_extent[axis] = extent[axis] > 0 ? 1.0f / extent[axis] : 0.0f;
+    }
+
+    std::vector<MortonCode> codes(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      Vec3 c = tris[i].centroid() - centroids_min;
+      if (sizeof(MortonCode) == sizeof(uint64_t)) {
+        codes[i] = morton3d_63(c.x * inv_extent.x, c.y * inv_extent.y,
+                               c.z * inv_extent.z);
+      } else {
+        codes[i] = morton3d_30(c.x * inv_extent.x, c.y * inv_extent.y,
+                               c.z * inv_extent.z);
+      }
+    }
+    std::vector<int> sorted_tri_indices(tri_indices_.begin(),
+                                        tri_indices_.end());
+    radix_sort_parallel(codes, sorted_tri_indices);
+    tri_indices_.swap(sorted_tri_indices);
+
+    // Internal nodes are [0, n - 1), leaves are [n - 1, 2n - 1), leaf i
+    // holds sorted triangle i
+    nodes_.resize(2 * n - 1);
+    std::vector<int> parents(2 * n - 1, -1);
+
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      BVHNode &leaf = nodes_[n - 1 + i];
+      leaf.L = leaf.R = -1;
+      leaf.start = i;
+      leaf.end = i + 1;
+      recalc_bounds(leaf);
+    }
+
+    if (n == 1) {
+      return;
+    }
+
+    // Length of the longest common prefix of keys i and j, duplicate codes are
+    // made unique by falling back to the index
+    auto delta = [&](int i, int j) -> int {
+      if (j < 0 || j >= n) {
+        return -1;
+      }
+      if (codes[i] == codes[j]) {
+        return int(sizeof(MortonCode) * 8) +
+               count_leading_zeros(uint32_t(i ^ j));
+      }
+      return count_leading_zeros(MortonCode(codes[i] ^ codes[j]));
+    };
 
-    BVHNode *R = nodes_pool + (num_used_nodes++);
-    R->start = it;
-    R->end = root->end;
-    recalc_bounds(R, tris);
-    R->L = R->R = nullptr;
+#pragma omp parallel for
+    for (int i = 0; i < n - 1; i++) {
+      // Direction of the range covered by node i
+      int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+
+      // Upper bound for the length of the range
+      int delta_min = delta(i, i - d);
+      int l_max = 2;
+      while (delta(i, i + l_max * d) > delta_min) {
+        l_max *= 2;
+      }
+
+      // Binary search for the other end of the range
+      int l = 0;
+      for (int t = l_max / 2; t >= 1; t /= 2) {
+        if (delta(i, i + (l + t) * d) > delta_min) {
+          l += t;
+        }
+      }
+      int j = i + l * d;
+
+      // Binary search for the split position
+      int delta_node = delta(i, j);
+      int s = 0;
+      int t = l;
+      do {
+        t = (t + 1) / 2;
+        if (delta(i, i + (s + t) * d) > delta_node) {
+          s += t;
+        }
+      } while (t > 1);
+      int gamma = i + s * d + std::min(d, 0);
+
+      int first = std::min(i, j);
+      int last = std::max(i, j);
+
+      BVHNode &node = nodes_[i];
+      node.L = (first == gamma) ? n - 1 + gamma : gamma;
+      node.R = (last == gamma + 1) ? n - 1 + gamma + 1 : gamma + 1;
+      node.start = first;
+      node.end = last + 1;
+      parents[node.L] = i;
+      parents[node.R] = i;
+    }
 
-    root->L = L;
-    root->R = R;
+    update_bounds_bottom_up(parents);
 
-    subdivide(nodes_pool, L, tris, num_used_nodes);
-    subdivide(nodes_pool, R, tris, num_used_nodes);
+    if (treelet_passes > 0) {
+      optimize_treelets(parents, treelet_passes);
+      relayout_depth_first();
+    }
+  }
+
+  std::vector<int> calc_parents() const {
+    const int num_nodes = nodes_.size();
+    std::vector<int> parents(num_nodes, -1);
+#pragma omp parallel for
+    for (int i = 0; i < num_nodes; i++) {
+      if (!nodes_[i].is_leaf()) {
+        parents[nodes_[i].L] = i;
+        parents[nodes_[i].R] = i;
+      }
+    }
+    return parents;
   }
-  int count_(const BVHNode *root) const {
-    if (root == nullptr) {
-      return 0;
+
+  // Expects leaf bounds to be up to date, computes internal node bounds in
+  // parallel, a node is processed by the second thread that reaches it
+  void update_bounds_bottom_up(const std::vector<int> &parents) {
+    const int num_nodes = nodes_.size();
+    std::vector<std::atomic<int>> visits(num_nodes);
+#pragma omp parallel for
+    for (int i = 0; i < num_nodes; i++) {
+      visits[i].store(0, std::memory_order_relaxed);
     }
-    return 1 + count_(root->L) + count_(root->R);
+
+#pragma omp parallel for
+    for (int i = 0; i < num_nodes; i++) {
+      if (!nodes_[i].is_leaf()) {
+        continue;
+      }
+      int parent = parents[i];
+      while (parent >= 0) {
+        if (visits[parent].fetch_add(1, std::memory_order_acq_rel) == 0) {
+          break;
+        }
+        set_bounds_from_children(nodes_[parent]);
+        parent = parents[parent];
+      }
+    }
+  }
+
+  void optimize_treelets(std::vector<int> &parents, int num_passes) {
+    const int num_nodes = nodes_.size();
+    std::vector<float> costs(num_nodes);
+    std::vector<int> sizes(num_nodes);
+    std::vector<std::atomic<int>> visits(num_nodes);
+    std::vector<int> leaves;
+    for (int i = 0; i < num_nodes; i++) {
+      if (nodes_[i].is_leaf()) {
+        leaves.push_back(i);
+      }
+    }
+    const int num_leaves = leaves.size();
+
+    // Restructuring tiny subtrees is not worth it, the threshold doubles each
+    // pass so later passes focus on the upper levels
+    int min_subtree_size = MAX_TREELET_LEAVES;
+    for (int pass = 0; pass < num_passes; pass++) {
+#pragma omp parallel for
+      for (int i = 0; i < num_nodes; i++) {
+        visits[i].store(0, std::memory_order_relaxed);
+      }
+
+#pragma omp parallel for
+      for (int leaf_index = 0; leaf_index < num_leaves; leaf_index++) {
+        const int i = leaves[leaf_index];
+        const BVHNode &leaf = nodes_[i];
+        costs[i] = TRIANGLE_INTERSECTION_COST * leaf.bbox().surface_area() *
+                   leaf.count();
+        sizes[i] = leaf.count();
+
+        int parent = parents[i];
+        while (parent >= 0) {
+          if (visits[parent].fetch_add(1, std::memory_order_acq_rel) == 0) {
+            break;
+          }
+          BVHNode &node = nodes_[parent];
+          sizes[parent] = sizes[node.L] + sizes[node.R];
+          costs[parent] = NODE_TRAVERSAL_COST * node.bbox().surface_area() +
+                          costs[node.L] + costs[node.R];
+          if (sizes[parent] >= min_subtree_size) {
+            restructure_treelet(parent, parents, costs);
+          }
+          parent = parents[parent];
+        }
+      }
+      min_subtree_size *= 2;
+    }
+  }
+
+  void restructure_treelet(int root, std::vector<int> &parents,
+                           std::vector<float> &costs) {
+    Treelet treelet;
+    treelet.leaves[0] = nodes_[root].L;
+    treelet.leaves[1] = nodes_[root].R;
+    treelet.internals[0] = root;
+    treelet.num_leaves = 2;
+
+    // Grow the treelet by expanding the leaf with the largest surface area
+    while (treelet.num_leaves < MAX_TREELET_LEAVES) {
+      int best = -1;
+      float best_area = -1.0f;
+      for (int i = 0; i < treelet.num_leaves; i++) {
+        const BVHNode &node = nodes_[treelet.leaves[i]];
+        float area = node.bbox().surface_area();
+        if (!node.is_leaf() && area > best_area) {
+          best = i;
+          best_area = area;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+      int expanded = treelet.leaves[best];
+      treelet.internals[treelet.num_leaves - 1] = expanded;
+      treelet.leaves[best] = nodes_[expanded].L;
+      treelet.leaves[treelet.num_leaves++] = nodes_[expanded].R;
+    }
+
+    if (treelet.num_leaves < 3) {
+      return;
+    }
+
+    // Optimal SAH cost of every subset of treelet leaves, subsets are visited
+    // in increasing order so their own subsets are already solved
+    const int full_set = (1 << treelet.num_leaves) - 1;
+    float optimal_costs[1 << MAX_TREELET_LEAVES];
+    BBox bboxes[1 << MAX_TREELET_LEAVES];
+    for (int s = 1; s <= full_set; s++) {
+      const int lowest_bit = s & -s;
+      if (s == lowest_bit) {
+        int i = 0;
+        while (!(s & (1 << i))) {
+          i++;
+        }
+        bboxes[s] = nodes_[treelet.leaves[i]].bbox();
+        treelet.areas[s] = bboxes[s].surface_area();
+        optimal_costs[s] = costs[treelet.leaves[i]];
+        continue;
+      }
+
+      bboxes[s] = bboxes[s ^ lowest_bit];
+      bboxes[s].grow(bboxes[lowest_bit]);
+      treelet.areas[s] = bboxes[s].surface_area();
+
+      // Partitions are symmetric, only visit the ones holding the lowest bit
+      float best_cost = INFINITY;
+      const int rest = s ^ lowest_bit;
+      for (int q = (rest - 1) & rest;; q = (q - 1) & rest) {
+        const int p = q | lowest_bit;
+        float cost = optimal_costs[p] + optimal_costs[s ^ p];
+        if (cost < best_cost) {
+          best_cost = cost;
+          treelet.partitions[s] = p;
+        }
+        if (q == 0) {
+          break;
+        }
+      }
+      optimal_costs[s] = NODE_TRAVERSAL_COST * treelet.areas[s] + best_cost;
+    }
+
+    if (!(optimal_costs[full_set] < costs[root] * 0.999f)) {
+      return;
+    }
+
+    int num_used_internals = 1;
+    assign_treelet_subset(treelet, full_set, root, num_used_internals, parents,
+                          costs);
+  }
+
+  void assign_treelet_subset(const Treelet &treelet, int subset, int node_index,
+                             int &num_used_internals,
+                             std::vector<int> &parents,
+                             std::vector<float> &costs) {
+    int child_subsets[2] = {treelet.partitions[subset],
+                            subset ^ treelet.partitions[subset]};
+    int children[2];
+    for (int c = 0; c < 2; c++) {
+      int s = child_subsets[c];
+      if ((s & (s - 1)) == 0) {
+        int i = 0;
+        while (!(s & (1 << i))) {
+          i++;
+        }
+        children[c] = treelet.leaves[i];
+      } else {
+        children[c] = treelet.internals[num_used_internals++];
+        assign_treelet_subset(treelet, s, children[c], num_used_internals,
+                              parents, costs);
+      }
+      parents[children[c]] = node_index;
+    }
+
+    BVHNode &node = nodes_[node_index];
+    node.L = children[0];
+    node.R = children[1];
+    set_bounds_from_children(node);
+    costs[node_index] = NODE_TRAVERSAL_COST * treelet.areas[subset] +
+                        costs[node.L] + costs[node.R];
+  }
+
+  // Reorders nodes depth first (left child right after its parent) and
+  // triangle indices in leaf order, so every node covers a contiguous range
+  // again after treelet restructuring
+  void relayout_depth_first() {
+    std::vector<BVHNode> new_nodes;
+    new_nodes.reserve(nodes_.size());
+    std::vector<int> new_tri_indices;
+    new_tri_indices.reserve(tri_indices_.size());
+    std::vector<int> new_node_indices(nodes_.size());
+
+    std::vector<int> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+      int old_index = stack.back();
+      stack.pop_back();
+      new_node_indices[old_index] = new_nodes.size();
+      BVHNode node = nodes_[old_index];
+      if (node.is_leaf()) {
+        int start = new_tri_indices.size();
+        new_tri_indices.insert(new_tri_indices.end(),
+                               tri_indices_.begin() + node.start,
+                               tri_indices_.begin() + node.end);
+        node.start = start;
+        node.end = new_tri_indices.size();
+      } else {
+        stack.push_back(node.R);
+        stack.push_back(node.L);
+      }
+      new_nodes.push_back(node);
+    }
+
+    // Children come after their parents, so walking backwards visits them
+    // first
+    for (int i = int(new_nodes.size()) - 1; i >= 0; i--) {
+      BVHNode &node = new_nodes[i];
+      if (node.is_leaf()) {
+        continue;
+      }
+      node.L = new_node_indices[node.L];
+      node.R = new_node_indices[node.R];
+      node.start = new_nodes[node.L].start;
+      node.end = new_nodes[node.R].end;
+    }
+
+    nodes_.swap(new_nodes);
+    tri_indices_.swap(new_tri_indices);
+  }
+
+  /* SBVH reference: a triangle, or the part of it left after clipping by the
+   * spatial splits above, see "Spatial Splits in Bounding Volume
+   * Hierarchies" (Stich et al. 2009) */
+  struct SBVHReference {
+    int tri;
+    BBox bbox;
   };
 
-public:
-  BVH(std::vector<BVHTriangle> &tris) {
-    if (tris.size() == 0) {
-      throw "Empty mesh";
+  struct SBVHSplit {
+    float cost = INFINITY;
+    int axis = -1;
+    bool spatial = false;
+    // Object splits: first centroid bin of the right child
+    int bin = 0;
+    // Spatial splits: position of the splitting plane
+    float position = 0.0f;
+    float centroid_min = 0.0f, bin_scale = 0.0f;
+    int num_left = 0, num_right = 0;
+    BBox left, right;
+  };
+
+  struct SBVHBuildState {
+    std::atomic<int> num_nodes;
+    std::atomic<int> num_tri_indices;
+    // Number of extra references spatial splits may still create
+    std::atomic<int> duplication_budget;
+    // Spatial splits are only tried when the children of the best object
+    // split overlap by more than this area
+    float min_overlap_area;
+  };
+
+  static constexpr int SBVH_BINS = 16;
+  static constexpr int SBVH_MAX_LEAF_SIZE = 8;
+
+  static BBox intersect_boxes(const BBox &a, const BBox &b) {
+    BBox out;
+    out.min = a.min;
+    out.min.max(b.min);
+    out.max = a.max;
+    out.max.min(b.max);
+    return out;
+  }
+
+  static bool is_empty(const BBox &bbox) {
+    return bbox.min.x > bbox.max.x || bbox.min.y > bbox.max.y ||
+           bbox.min.z > bbox.max.z;
+  }
+
+  // Bounds of the parts of ref on each side of the plane, empty when the
+  // clipped triangle does not reach that side
+  void split_reference(const SBVHReference &ref, int axis, float position,
+                       SBVHReference &left, SBVHReference &right) const {
+    left = right = {ref.tri, BBox()};
+    const BVHTriangle &tri = (*tris_)[ref.tri];
+    for (int i = 0; i < 3; i++) {
+      const Vec3 &v0 = tri[i];
+      const Vec3 &v1 = tri[(i + 1) % 3];
+      const float p0 = v0[axis], p1 = v1[axis];
+      if (p0 <= position) {
+        left.bbox.grow(v0);
+      }
+      if (p0 >= position) {
+        right.bbox.grow(v0);
+      }
+      if ((p0 < position && p1 > position) ||
+          (p0 > position && p1 < position)) {
+        Vec3 crossing = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+        crossing[axis] = position;
+        left.bbox.grow(crossing);
+        right.bbox.grow(crossing);
+      }
+    }
+    left.bbox = intersect_boxes(left.bbox, ref.bbox);
+    right.bbox = intersect_boxes(right.bbox, ref.bbox);
+  }
+
+  // Binned SAH over reference centroids
+  SBVHSplit find_object_split(const std::vector<SBVHReference> &refs) const {
+    BBox centroid_bounds;
+    for (const auto &ref : refs) {
+      centroid_bounds.grow((ref.bbox.min + ref.bbox.max) * 0.5f);
+    }
+
+    SBVHSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+      const float extent =
+          centroid_bounds.max[axis] - centroid_bounds.min[axis];
+      if (!(extent > 0)) {
+        continue;
+      }
+      const float scale = SBVH_BINS / extent;
+      BBox bins[SBVH_BINS];
+      int counts[SBVH_BINS] = {};
+      for (const auto &ref : refs) {
+        float centroid = (ref.bbox.min[axis] + ref.bbox.max[axis]) * 0.5f;
+        int b = std::min(
+            SBVH_BINS - 1,
+            int((centroid - centroid_bounds.min[axis]) * scale));
+        bins[b].grow(ref.bbox);
+        counts[b]++;
+      }
+
+      // Right to left sweep, then evaluate every plane left to right
+      float right_costs[SBVH_BINS];
+      BBox right_boxes[SBVH_BINS];
+      int right_counts[SBVH_BINS];
+      BBox accumulated;
+      int count = 0;
+      for (int b = SBVH_BINS - 1; b > 0; b--) {
+        accumulated.grow(bins[b]);
+        count += counts[b];
+        right_boxes[b] = accumulated;
+        right_counts[b] = count;
+        right_costs[b] = count ? accumulated.surface_area() * count : 0.0f;
+      }
+      accumulated = BBox();
+      count = 0;
+      for (int b = 1; b < SBVH_BINS; b++) {
+        accumulated.grow(bins[b - 1]);
+        count += counts[b - 1];
+        if (count == 0 || right_counts[b] == 0) {
+          continue;
+        }
+        float cost =
+            TRIANGLE_INTERSECTION_COST *
+            (accumulated.surface_area() * count + right_costs[b]);
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.spatial = false;
+          best.bin = b;
+          best.centroid_min = centroid_bounds.min[axis];
+          best.bin_scale = scale;
+          best.num_left = count;
+          best.num_right = right_counts[b];
+          best.left = accumulated;
+          best.right = right_boxes[b];
+        }
+      }
     }
-    nodes_ = new BVHNode[2 * tris.size() - 1];
+    return best;
+  }
+
+  // Binned SAH over planes cutting through the node, references are clipped
+  // to every bin they span
+  SBVHSplit find_spatial_split(const std::vector<SBVHReference> &refs,
+                               const BBox &bbox) const {
+    SBVHSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+      const float origin = bbox.min[axis];
+      const float bin_size = (bbox.max[axis] - origin) / SBVH_BINS;
+      if (!(bin_size > 0)) {
+        continue;
+      }
+      BBox bins[SBVH_BINS];
+      int entries[SBVH_BINS] = {}, exits[SBVH_BINS] = {};
+      auto bin_of = [&](float x) {
+        return std::min(SBVH_BINS - 1,
+                        std::max(0, int((x - origin) / bin_size)));
+      };
+      for (const auto &ref : refs) {
+        const int first = bin_of(ref.bbox.min[axis]);
+        const int last = std::max(first, bin_of(ref.bbox.max[axis]));
+        SBVHReference rest = ref, left, right;
+        for (int b = first; b < last; b++) {
+          split_reference(rest, axis, origin + (b + 1) * bin_size, left,
+                          right);
+          if (!is_empty(left.bbox)) {
+            bins[b].grow(left.bbox);
+          }
+          rest = right;
+        }
+        if (!is_empty(rest.bbox)) {
+          bins[last].grow(rest.bbox);
+        }
+        entries[first]++;
+        exits[last]++;
+      }
 
-    BVHNode *root = nodes_;
-    root->start = tris.begin();
-    root->end = tris.end();
-    root->L = root->R = nullptr;
-    recalc_bounds(root, tris);
-    subdivide(nodes_, root, tris, 1);
+      float right_costs[SBVH_BINS];
+      BBox right_boxes[SBVH_BINS];
+      int right_counts[SBVH_BINS];
+      BBox accumulated;
+      int count = 0;
+      for (int b = SBVH_BINS - 1; b > 0; b--) {
+        accumulated.grow(bins[b]);
+        count += exits[b];
+        right_boxes[b] = accumulated;
+        right_counts[b] = count;
+        right_costs[b] = count ? accumulated.surface_area() * count : 0.0f;
+      }
+      accumulated = BBox();
+      count = 0;
+      for (int b = 1; b < SBVH_BINS; b++) {
+        accumulated.grow(bins[b - 1]);
+        count += entries[b - 1];
+        if (count == 0 || right_counts[b] == 0) {
+          continue;
+        }
+        float cost =
+            TRIANGLE_INTERSECTION_COST *
+            (accumulated.surface_area() * count + right_costs[b]);
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.spatial = true;
+          best.position = origin + b * bin_size;
+          best.num_left = count;
+          best.num_right = right_counts[b];
+          best.left = accumulated;
+          best.right = right_boxes[b];
+        }
+      }
+    }
+    return best;
   }
 
-  int count() const { return count_(nodes_); }
+  // References on each side of a spatial split plane, straddling ones are
+  // clipped into both
+  void partition_spatial(const std::vector<SBVHReference> &refs,
+                         const SBVHSplit &split,
+                         std::vector<SBVHReference> &left_refs,
+                         std::vector<SBVHReference> &right_refs) const {
+    left_refs.reserve(split.num_left);
+    right_refs.reserve(split.num_right);
+    for (const auto &ref : refs) {
+      if (ref.bbox.max[split.axis] <= split.position) {
+        left_refs.push_back(ref);
+      } else if (ref.bbox.min[split.axis] >= split.position) {
+        right_refs.push_back(ref);
+      } else {
+        SBVHReference left, right;
+        split_reference(ref, split.axis, split.position, left, right);
+        if (!is_empty(left.bbox)) {
+          left_refs.push_back(left);
+        }
+        if (!is_empty(right.bbox)) {
+          right_refs.push_back(right);
+        }
+      }
+    }
+  }
 
-  void overlap(const BVHNode &node, const BVHNode &other_node,
-               int &overlap_count) {
-    if (!node.does_overlap(other_node)) {
+  /* Top-down SBVH build of the subtree at node_index. Nodes and leaf ranges
+   * are allocated from preallocated arrays with atomic counters, so large
+   * subtrees are built as OpenMP tasks, relayout_depth_first makes the
+   * ranges contiguous afterwards. */
+  void build_sbvh_node(int node_index, std::vector<SBVHReference> refs,
+                       SBVHBuildState &state) {
+    const int n = refs.size();
+    BBox bbox;
+    for (const auto &ref : refs) {
+      bbox.grow(ref.bbox);
+    }
+    {
+      BVHNode &node = nodes_[node_index];
+      node.aabb_min = bbox.min;
+      node.aabb_max = bbox.max;
+      node.L = node.R = -1;
+    }
+
+    SBVHSplit split;
+    std::vector<SBVHReference> left_refs, right_refs;
+    int duplicates = 0;
+    if (n > 1) {
+      split = find_object_split(refs);
+      BBox overlap = intersect_boxes(split.left, split.right);
+      if (split.axis < 0 || (!is_empty(overlap) &&
+                             overlap.surface_area() > state.min_overlap_area)) {
+        SBVHSplit spatial = find_spatial_split(refs, bbox);
+        if (spatial.cost < split.cost) {
+          /* The budget is charged with the references the partition actually
+           * creates, the binned counts can be off when rounding puts a
+           * vertex next to the plane in the neighbouring bin. Both children
+           * must shrink or the recursion might not end. */
+          partition_spatial(refs, spatial, left_refs, right_refs);
+          const int num_left = left_refs.size();
+          const int num_right = right_refs.size();
+          const bool shrinks = num_left > 0 && num_right > 0 &&
+                               num_left < n && num_right < n;
+          duplicates = num_left + num_right - n;
+          if (shrinks &&
+              state.duplication_budget.fetch_sub(duplicates) >= duplicates) {
+            split = spatial;
+          } else {
+            if (shrinks) {
+              state.duplication_budget.fetch_add(duplicates);
+            }
+            // Falls back to the object split
+            left_refs.clear();
+            right_refs.clear();
+          }
+        }
+      }
+    }
+
+    const float leaf_cost =
+        TRIANGLE_INTERSECTION_COST * bbox.surface_area() * n;
+    const float split_cost =
+        NODE_TRAVERSAL_COST * bbox.surface_area() + split.cost;
+    if (n == 1 || (n <= SBVH_MAX_LEAF_SIZE && leaf_cost <= split_cost)) {
+      if (split.spatial) {
+        state.duplication_budget.fetch_add(duplicates);
+      }
+      const int start = state.num_tri_indices.fetch_add(n);
+      // The budget bounds the references, so they fit the preallocation
+      tassert(start + n <= int(tri_indices_.size()));
+      for (int i = 0; i < n; i++) {
+        tri_indices_[start + i] = refs[i].tri;
+      }
+      nodes_[node_index].start = start;
+      nodes_[node_index].end = start + n;
       return;
     }
-    overlap_count++;
-    if (other_node.L) {
-      overlap(node, *other_node.L, overlap_count);
+
+    if (split.axis < 0) {
+      // Every centroid coincides and nothing to clip, halve the list
+      left_refs.assign(refs.begin(), refs.begin() + n / 2);
+      right_refs.assign(refs.begin() + n / 2, refs.end());
+    } else if (!split.spatial) {
+      for (const auto &ref : refs) {
+        float centroid =
+            (ref.bbox.min[split.axis] + ref.bbox.max[split.axis]) * 0.5f;
+        int b = std::min(SBVH_BINS - 1, int((centroid - split.centroid_min) *
+                                            split.bin_scale));
+        (b < split.bin ? left_refs : right_refs).push_back(ref);
+      }
     }
-    if (other_node.R) {
-      overlap(node, *other_node.R, overlap_count);
+    refs.clear();
+    refs.shrink_to_fit();
+
+    const int left = state.num_nodes.fetch_add(2);
+    const int right = left + 1;
+    tassert(right < int(nodes_.size()));
+    nodes_[node_index].L = left;
+    nodes_[node_index].R = right;
+    if (n >= MIN_TASK_TRIANGLES) {
+#pragma omp task shared(left_refs, state)
+      build_sbvh_node(left, std::move(left_refs), state);
+      build_sbvh_node(right, std::move(right_refs), state);
+#pragma omp taskwait
+    } else {
+      build_sbvh_node(left, std::move(left_refs), state);
+      build_sbvh_node(right, std::move(right_refs), state);
     }
   }
 
-  void overlap(const BVHTriangle *triangle, const BVHNode *node) {
-    if (!node->does_overlap(triangle->calc_bounding_box())) {
+  void build_sbvh(float max_duplication, float spatial_split_alpha) {
+    const std::vector<BVHTriangle> &tris = *tris_;
+    const int n = tris.size();
+    const int budget = int(max_duplication * n);
+    const int max_refs = n + budget;
+
+    std::vector<SBVHReference> refs(n);
+    BBox root_bbox;
+    for (int i = 0; i < n; i++) {
+      refs[i] = {i, tris[i].calc_bounding_box()};
+      root_bbox.grow(refs[i].bbox);
+    }
+
+    nodes_.resize(2 * max_refs - 1);
+    tri_indices_.resize(max_refs);
+    SBVHBuildState state;
+    state.num_nodes = 1;
+    state.num_tri_indices = 0;
+    state.duplication_budget = budget;
+    state.min_overlap_area = spatial_split_alpha * root_bbox.surface_area();
+
+#pragma omp parallel
+#pragma omp single
+    build_sbvh_node(0, std::move(refs), state);
+
+    nodes_.resize(state.num_nodes);
+    tri_indices_.resize(state.num_tri_indices);
+    relayout_depth_first();
+  }
+
+  // Subtree pairs covering fewer triangles than this are traversed serially
+  static constexpr int MIN_TASK_TRIANGLES = 2048;
+
+  /* Leaves holding each triangle in node order, leaves[offsets[t],
+   * offsets[t + 1]) for triangle t. Spatial splits reference a triangle from
+   * several leaves, so a pair of triangles can be found through several leaf
+   * pairs. */
+  struct TriangleLeaves {
+    std::vector<int> offsets;
+    std::vector<int> leaves;
+  };
+
+  TriangleLeaves triangle_leaves() const {
+    TriangleLeaves out;
+    out.offsets.assign(tris_->size() + 1, 0);
+    for (int i : tri_indices_) {
+      out.offsets[i + 1]++;
+    }
+    for (size_t t = 0; t < tris_->size(); t++) {
+      out.offsets[t + 1] += out.offsets[t];
+    }
+    out.leaves.resize(tri_indices_.size());
+    std::vector<int> next(out.offsets.begin(), out.offsets.end() - 1);
+    for (int node_index = 0; node_index < int(nodes_.size()); node_index++) {
+      const BVHNode &node = nodes_[node_index];
+      if (!node.is_leaf()) {
+        continue;
+      }
+      for (int i = node.start; i < node.end; i++) {
+        out.leaves[next[tri_indices_[i]]++] = node_index;
+      }
+    }
+    return out;
+  }
+
+  /* Triangle leaves of both BVHs of a pair query, which passes none when
+   * neither has duplicates. self is set for self overlap, where the pairs are
+   * unordered and both sides are the same BVH. */
+  struct PairLeaves {
+    const TriangleLeaves *a = nullptr, *b = nullptr;
+    bool self = false;
+  };
+
+  /* Whether the traversal reaches the leaf pair (leaf_a, leaf_b) and finds
+   * tri_a and tri_b there, which are in these leaves and have overlapping
+   * bounding boxes. In self overlap two leaves are traversed with the first
+   * in node order as a, which is the left subtree of their common ancestor
+   * after relayout_depth_first. */
+  static bool reaches_leaf_pair(const BVH &a, int tri_a, int leaf_a,
+                                const BVH &b, int tri_b, int leaf_b,
+                                bool self) {
+    if (self && leaf_a == leaf_b) {
+      return true;
+    }
+    if (self && leaf_b < leaf_a) {
+      std::swap(leaf_a, leaf_b);
+      std::swap(tri_a, tri_b);
+    }
+    const BVHNode &node_a = a.nodes_[leaf_a];
+    const BVHNode &node_b = b.nodes_[leaf_b];
+    return node_a.does_overlap(node_b) &&
+           node_b.does_overlap((*a.tris_)[tri_a].calc_bounding_box());
+  }
+
+  /* Whether the pair found through leaf_a and leaf_b is reported, a pair the
+   * traversal finds through several leaf pairs is reported from the first of
+   * them only. The check runs on the candidate alone, so threads never
+   * compare notes and there is no global sort. Self overlap pairs are
+   * unordered, (a, a) is not a pair. */
+  static bool is_first_leaf_pair(const BVH &a, int tri_a, int leaf_a,
+                                 const BVH &b, int tri_b, int leaf_b,
+                                 const PairLeaves &pair_leaves) {
+    if (pair_leaves.self) {
+      if (tri_a == tri_b) {
+        return false;
+      }
+      if (tri_b < tri_a) {
+        std::swap(tri_a, tri_b);
+        std::swap(leaf_a, leaf_b);
+      }
+    }
+    const TriangleLeaves &leaves_a = *pair_leaves.a;
+    const TriangleLeaves &leaves_b = *pair_leaves.b;
+    const int a_begin = leaves_a.offsets[tri_a];
+    const int a_end = leaves_a.offsets[tri_a + 1];
+    const int b_begin = leaves_b.offsets[tri_b];
+    const int b_end = leaves_b.offsets[tri_b + 1];
+    if (a_end - a_begin == 1 && b_end - b_begin == 1) {
+      return true;
+    }
+    // Leaf pairs in order, the first one reached is the reporting one
+    for (int i = a_begin; i < a_end; i++) {
+      for (int j = b_begin; j < b_end; j++) {
+        const int first_a = leaves_a.leaves[i];
+        const int first_b = leaves_b.leaves[j];
+        if (reaches_leaf_pair(a, tri_a, first_a, b, tri_b, first_b,
+                              pair_leaves.self)) {
+          return first_a == leaf_a && first_b == leaf_b;
+        }
+      }
+    }
+    return false;
+  }
+
+  void self_overlap_task(int node_index,
+                         std::vector<BVHCandidatePair> *buffers,
+                         const PairLeaves *pair_leaves) const {
+    const BVHNode &node = nodes_[node_index];
+    if (node.is_leaf()) {
+      std::vector<BVHCandidatePair> &out = buffers[omp_get_thread_num()];
+      for (int i = node.start; i < node.end; i++) {
+        const int tri_a = tri_indices_[i];
+        const BBox bbox = (*tris_)[tri_a].calc_bounding_box();
+        for (int j = i + 1; j < node.end; j++) {
+          const int tri_b = tri_indices_[j];
+          if (!bbox.does_overlap((*tris_)[tri_b].calc_bounding_box())) {
+            continue;
+          }
+          if (pair_leaves &&
+              !is_first_leaf_pair(*this, tri_a, node_index, *this, tri_b,
+                                  node_index, *pair_leaves)) {
+            continue;
+          }
+          out.push_back({tri_a, tri_b});
+        }
+      }
+      return;
+    }
+
+    // Pairs inside each child, then pairs straddling both children, so no
+    // pair is visited twice
+    const int left = node.L, right = node.R;
+    if (node.count() >= MIN_TASK_TRIANGLES) {
+#pragma omp task
+      self_overlap_task(left, buffers, pair_leaves);
+#pragma omp task
+      self_overlap_task(right, buffers, pair_leaves);
+    } else {
+      self_overlap_task(left, buffers, pair_leaves);
+      self_overlap_task(right, buffers, pair_leaves);
+    }
+    overlap_task(this, left, this, right, buffers, pair_leaves);
+  }
+
+  // BVHs are passed by pointer, OpenMP tasks would copy them if they were
+  // captured by reference
+  static void overlap_task(const BVH *a, int a_index, const BVH *b,
+                           int b_index,
+                           std::vector<BVHCandidatePair> *buffers,
+                           const PairLeaves *pair_leaves) {
+    const BVHNode &node_a = a->nodes_[a_index];
+    const BVHNode &node_b = b->nodes_[b_index];
+    if (!node_a.does_overlap(node_b)) {
+      return;
+    }
+    if ((node_a.count() + node_b.count() < MIN_TASK_TRIANGLES) ||
+        (node_a.is_leaf() && node_b.is_leaf())) {
+      overlap_serial(*a, a_index, *b, b_index, buffers[omp_get_thread_num()],
+                     pair_leaves);
       return;
     }
 
-    for (auto it = node->start; it != node->end; it++) {
+    // Descend into the bigger node, the other one stays as is
+    bool descend_a = !node_a.is_leaf() &&
+                     (node_b.is_leaf() || node_a.count() >= node_b.count());
+    if (descend_a) {
+      const int left = node_a.L, right = node_a.R;
+#pragma omp task
+      overlap_task(a, left, b, b_index, buffers, pair_leaves);
+#pragma omp task
+      overlap_task(a, right, b, b_index, buffers, pair_leaves);
+    } else {
+      const int left = node_b.L, right = node_b.R;
+#pragma omp task
+      overlap_task(a, a_index, b, left, buffers, pair_leaves);
+#pragma omp task
+      overlap_task(a, a_index, b, right, buffers, pair_leaves);
+    }
+  }
+
+  static void overlap_serial(const BVH &a, int a_index, const BVH &b,
+                             int b_index, std::vector<BVHCandidatePair> &out,
+                             const PairLeaves *pair_leaves) {
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(a_index, b_index);
+    while (!stack.empty()) {
+      auto [ia, ib] = stack.back();
+      stack.pop_back();
+      const BVHNode &node_a = a.nodes_[ia];
+      const BVHNode &node_b = b.nodes_[ib];
+      if (!node_a.does_overlap(node_b)) {
+        continue;
+      }
+
+      if (node_a.is_leaf() && node_b.is_leaf()) {
+        for (int i = node_a.start; i < node_a.end; i++) {
+          const int tri_a = a.tri_indices_[i];
+          const BBox bbox = (*a.tris_)[tri_a].calc_bounding_box();
+          if (!node_b.does_overlap(bbox)) {
+            continue;
+          }
+          for (int j = node_b.start; j < node_b.end; j++) {
+            const int tri_b = b.tri_indices_[j];
+            if (!bbox.does_overlap((*b.tris_)[tri_b].calc_bounding_box())) {
+              continue;
+            }
+            if (pair_leaves && !is_first_leaf_pair(a, tri_a, ia, b, tri_b,
+                                                   ib, *pair_leaves)) {
+              continue;
+            }
+            out.push_back({tri_a, tri_b});
+          }
+        }
+        continue;
+      }
+
+      bool descend_a = !node_a.is_leaf() &&
+                       (node_b.is_leaf() || node_a.count() >= node_b.count());
+      if (descend_a) {
+        stack.emplace_back(node_a.R, ib);
+        stack.emplace_back(node_a.L, ib);
+      } else {
+        stack.emplace_back(ia, node_b.R);
+        stack.emplace_back(ia, node_b.L);
+      }
+    }
+  }
+
+  void intersect_candidates(const BVH &other,
+                            const BVHCandidatePairBuffers &pairs,
+                            BVHIntersectionBuffers &out,
+                            bool skip_neighbour_contacts) const {
+    const int block_size = 256;
+    out.assign(omp_get_max_threads(), {});
+#pragma omp parallel
+    {
+      std::vector<BVHIntersection> &local = out[omp_get_thread_num()];
+      const BVHTriangle *tris_a[block_size];
+      const BVHTriangle *tris_b[block_size];
+      bool separated[block_size];
+      for (const auto &buffer : pairs) {
+        const int num_blocks = (buffer.size() + block_size - 1) / block_size;
+#pragma omp for schedule(dynamic) nowait
+        for (int block = 0; block < num_blocks; block++) {
+          const int first = block * block_size;
+          const int count = std::min(block_size, int(buffer.size()) - first);
+          for (int i = 0; i < count; i++) {
+            tris_a[i] = &(*tris_)[buffer[first + i].a];
+            tris_b[i] = &(*other.tris_)[buffer[first + i].b];
+          }
+          reject_tri_tri_batch(tris_a, tris_b, count, separated);
+
+          for (int i = 0; i < count; i++) {
+            if (separated[i]) {
+              continue;
+            }
+            const BVHTriangle &a = *tris_a[i], &b = *tris_b[i];
+            TriTriSegment segment;
+            if (!intersect_tri_tri(a.a, a.b, a.c, b.a, b.b, b.c, segment)) {
+              continue;
+            }
+            if (skip_neighbour_contacts &&
+                is_neighbour_contact(a, b, segment)) {
+              continue;
+            }
+            local.push_back({buffer[first + i].a, buffer[first + i].b,
+                             segment});
+          }
+        }
+      }
+    }
+  }
+
+  // Intersecting triangles a and b only touch at vertices or an edge they
+  // share
+  static bool is_neighbour_contact(const BVHTriangle &a, const BVHTriangle &b,
+                                   const TriTriSegment &segment) {
+    int shared_a[3], shared_b[3];
+    int num_shared = 0;
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        if (a[i] == b[j]) {
+          shared_a[num_shared] = i;
+          shared_b[num_shared] = j;
+          num_shared++;
+          break;
+        }
+      }
+    }
+    if (num_shared == 0 || num_shared == 3) {
+      return false;
+    }
+
+    const Vec3 &v = a[shared_a[0]];
+    if (!segment.coplanar) {
+      // Non coplanar triangles sharing an edge meet exactly along it, with
+      // one shared vertex the segment collapses onto it
+      return num_shared == 2 || (segment.source == v && segment.target == v);
+    }
+
+    int axis = tri_tri::projection_axis(a.a, a.b, a.c);
+    tri_tri::Point2 pv = tri_tri::project(v, axis);
+    if (num_shared == 2) {
+      // Coplanar neighbours overlap when folded onto the same side of the
+      // shared edge
+      tri_tri::Point2 pw = tri_tri::project(a[shared_a[1]], axis);
+      tri_tri::Point2 pa =
+          tri_tri::project(a[3 - shared_a[0] - shared_a[1]], axis);
+      tri_tri::Point2 pb =
+          tri_tri::project(b[3 - shared_b[0] - shared_b[1]], axis);
+      return tri_tri::orient(pv, pw, pa) * tri_tri::orient(pv, pw, pb) <= 0;
+    }
+
+    // Coplanar triangles sharing a single vertex overlap when the angular
+    // sectors they span at that vertex overlap
+    tri_tri::Point2 sector_a[2] = {
+        tri_tri::project(a[(shared_a[0] + 1) % 3], axis),
+        tri_tri::project(a[(shared_a[0] + 2) % 3], axis)};
+    tri_tri::Point2 sector_b[2] = {
+        tri_tri::project(b[(shared_b[0] + 1) % 3], axis),
+        tri_tri::project(b[(shared_b[0] + 2) % 3], axis)};
+    for (auto *sector : {sector_a, sector_b}) {
+      if (tri_tri::orient(pv, sector[0], sector[1]) < 0) {
+        std::swap(sector[0], sector[1]);
+      }
+    }
+    auto strictly_inside = [&](const tri_tri::Point2 *sector,
+                               const tri_tri::Point2 &p) {
+      return tri_tri::orient(pv, sector[0], p) > 0 &&
+             tri_tri::orient(pv, p, sector[1]) > 0;
+    };
+    auto same_direction = [&](const tri_tri::Point2 &p,
+                              const tri_tri::Point2 &q) {
+      return tri_tri::orient(pv, p, q) == 0 &&
+             (p.x - pv.x) * (q.x - pv.x) + (p.y - pv.y) * (q.y - pv.y) > 0;
+    };
+    bool overlapping =
+        strictly_inside(sector_a, sector_b[0]) ||
+        strictly_inside(sector_a, sector_b[1]) ||
+        strictly_inside(sector_b, sector_a[0]) ||
+        strictly_inside(sector_b, sector_a[1]) ||
+        (same_direction(sector_a[0], sector_b[0]) &&
+         same_direction(sector_a[1], sector_b[1]));
+    return !overlapping;
+  }
+
+  // (squared distance to node box, node index), kept as a min heap
+  using DistanceHeap = std::vector<std::pair<float, int>>;
+
+  /* Best-first search: subtrees are visited in order of distance to their
+   * box and the search ends once the nearest unvisited box is farther than
+   * the best triangle so far. Leaf triangles are queued into a SoA batch and
+   * evaluated POINT_TRI_BATCH_SIZE at a time, the batch is flushed before
+   * every termination test so delaying them never changes the result. */
+  BVHClosestPoint closest_point_search(const Vec3 &query,
+                                       float max_squared_distance,
+                                       DistanceHeap &heap) const {
+    auto farther = [](const std::pair<float, int> &a,
+                      const std::pair<float, int> &b) {
+      return a.first > b.first;
+    };
+
+    BVHQueryCounter counter;
+    BVHClosestPoint best;
+    best.squared_distance = max_squared_distance;
+    PointTriBatch batch;
+    int batch_tris[POINT_TRI_BATCH_SIZE];
+    int batch_size = 0;
+    auto flush = [&]() {
+      if (batch_size == 0) {
+        return;
+      }
+      // Pad unused lanes with the last triangle
+      for (int lane = batch_size; lane < POINT_TRI_BATCH_SIZE; lane++) {
+        for (int v = 0; v < 3; v++) {
+          for (int axis = 0; axis < 3; axis++) {
+            batch.v[v][axis][lane] = batch.v[v][axis][batch_size - 1];
+          }
+        }
+      }
+      float squared_distances[POINT_TRI_BATCH_SIZE];
+      point_tri_squared_distance_batch(query, batch, squared_distances);
+      for (int lane = 0; lane < batch_size; lane++) {
+        if (squared_distances[lane] < best.squared_distance) {
+          best.squared_distance = squared_distances[lane];
+          best.tri_index = batch_tris[lane];
+        }
+      }
+      batch_size = 0;
+    };
+
+    heap.clear();
+    heap.push_back({nodes_[0].squared_distance(query), 0});
+    while (true) {
+      if (heap.empty() || heap.front().first >= best.squared_distance) {
+        flush();
+        if (heap.empty() || heap.front().first >= best.squared_distance) {
+          break;
+        }
+      }
+      std::pop_heap(heap.begin(), heap.end(), farther);
+      int node_index = heap.back().second;
+      heap.pop_back();
+
+      // Descend into the nearer child directly, only the farther one goes
+      // through the heap
+      while (!nodes_[node_index].is_leaf()) {
+        counter.visit_node();
+        const BVHNode &node = nodes_[node_index];
+        float distance_l = nodes_[node.L].squared_distance(query);
+        float distance_r = nodes_[node.R].squared_distance(query);
+        int near = node.L, far = node.R;
+        if (distance_r < distance_l) {
+          std::swap(near, far);
+          std::swap(distance_l, distance_r);
+        }
+        if (distance_r < best.squared_distance) {
+          heap.push_back({distance_r, far});
+          std::push_heap(heap.begin(), heap.end(), farther);
+          counter.stack_depth(heap.size());
+        }
+        if (distance_l >= best.squared_distance) {
+          node_index = -1;
+          break;
+        }
+        node_index = near;
+      }
+      if (node_index < 0) {
+        continue;
+      }
+
+      const BVHNode &leaf = nodes_[node_index];
+      counter.visit_node();
+      counter.test_primitives(leaf.count());
+      for (int i = leaf.start; i < leaf.end; i++) {
+        const BVHTriangle &tri = (*tris_)[tri_indices_[i]];
+        for (int v = 0; v < 3; v++) {
+          for (int axis = 0; axis < 3; axis++) {
+            batch.v[v][axis][batch_size] = tri[v][axis];
+          }
+        }
+        batch_tris[batch_size++] = tri_indices_[i];
+        if (batch_size == POINT_TRI_BATCH_SIZE) {
+          flush();
+        }
+      }
+    }
+
+    if (best.tri_index >= 0) {
+      const BVHTriangle &tri = (*tris_)[best.tri_index];
+      best.point = closest_point_on_triangle(query, tri.a, tri.b, tri.c);
     }
+    return best;
+  }
+
+  // Spatial splits reference some triangles from several leaves
+  bool has_duplicates() const { return tri_indices_.size() > tris_->size(); }
+
+  // Used by load
+  BVH() = default;
 
-    if (node->L) {
-      overlap(triangle, node->L);
+public:
+  BVH(const std::vector<BVHTriangle> &tris,
+      const BVHBuildOptions &options = BVHBuildOptions())
+      : tris_(&tris) {
+    if (tris.size() == 0) {
+      throw "Empty mesh";
     }
-    if (node->R) {
-      overlap(triangle, node->R);
+    tri_indices_.resize(tris.size());
+    std::iota(tri_indices_.begin(), tri_indices_.end(), 0);
+
+    if (options.method == BVHBuildMethod::SBVH) {
+      build_sbvh(options.max_duplication, options.spatial_split_alpha);
+    } else if (options.method == BVHBuildMethod::LBVH) {
+      if (options.morton_63_bits) {
+        build_lbvh<uint64_t>(options.treelet_passes);
+      } else {
+        build_lbvh<uint32_t>(options.treelet_passes);
+      }
+    } else {
+      nodes_.resize(2 * tris.size() - 1);
+      BVHNode &root = nodes_[0];
+      root.start = 0;
+      root.end = tris.size();
+      root.L = root.R = -1;
+      recalc_bounds(root);
+      int num_used_nodes = 1;
+      subdivide(0, num_used_nodes);
+      nodes_.resize(num_used_nodes);
     }
+
+    build_sah_cost_ = sah_cost();
   }
 
-  void self_overlap() {
-    int overlap_count = 0;
+  /* Updates node bounds from new vertex positions, keeping the topology.
+   * tris must hold the same triangles in the same order as the ones the BVH
+   * was built from (or last refitted to), and must outlive the BVH.
+   * Spatial split leaves get the bounds of their whole triangles back.
+   * Returns the SAH cost relative to the cost right after building, refitted
+   * trees only get worse, once this ratio passes ~1.5 a full rebuild is
+   * usually cheaper than the extra traversal work. The ratio is 1 when the
+   * root box had no surface area when built (every vertex on a line or a
+   * point), there is no cost to compare to. */
+  float refit(const std::vector<BVHTriangle> &tris) {
+    if (tris.size() != tris_->size()) {
+      throw "Refit requires the same number of triangles";
+    }
+    tris_ = &tris;
+    nodes_.detach();
 
+    const int num_nodes = nodes_.size();
 #pragma omp parallel for
-    for (int i = 0; i < count(); i++) {
-      overlap(nodes_[i], nodes_[0], overlap_count);
+    for (int i = 0; i < num_nodes; i++) {
+      if (nodes_[i].is_leaf()) {
+        recalc_bounds(nodes_[i]);
+      }
+    }
+    update_bounds_bottom_up(calc_parents());
+
+    return build_sah_cost_ > 0.0f ? sah_cost() / build_sah_cost_ : 1.0f;
+  }
+
+  // Surface area heuristic cost of the tree, normalized by the root area
+  float sah_cost() const {
+    const int num_nodes = nodes_.size();
+    double cost = 0.0;
+#pragma omp parallel for reduction(+ : cost)
+    for (int i = 0; i < num_nodes; i++) {
+      const BVHNode &node = nodes_[i];
+      if (node.is_leaf()) {
+        cost += TRIANGLE_INTERSECTION_COST * node.bbox().surface_area() *
+                node.count();
+      } else {
+        cost += NODE_TRAVERSAL_COST * node.bbox().surface_area();
+      }
+    }
+    float root_area = nodes_[0].bbox().surface_area();
+    return root_area > 0 ? cost / root_area : 0.0f;
+  }
+
+  // Shape of the tree, to compare builders and spot pathological meshes
+  BVHStats stats() const {
+    BVHStats stats;
+    stats.sah_cost = sah_cost();
+    stats.num_nodes = nodes_.size();
+    stats.num_tri_indices = tri_indices_.size();
+    stats.memory_bytes = nodes_.size() * sizeof(BVHNode) +
+                         tri_indices_.size() * sizeof(int);
+
+    double overlap_area = 0.0, parent_area = 0.0, depth_sum = 0.0;
+    std::vector<std::pair<int, int>> stack;
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+      auto [node_index, depth] = stack.back();
+      stack.pop_back();
+      const BVHNode &node = nodes_[node_index];
+      if (node.is_leaf()) {
+        stats.num_leaves++;
+        stats.max_depth = std::max(stats.max_depth, depth);
+        depth_sum += depth;
+        if (int(stats.depth_histogram.size()) <= depth) {
+          stats.depth_histogram.resize(depth + 1);
+        }
+        stats.depth_histogram[depth]++;
+        if (int(stats.leaf_size_histogram.size()) <= node.count()) {
+          stats.leaf_size_histogram.resize(node.count() + 1);
+        }
+        stats.leaf_size_histogram[node.count()]++;
+        continue;
+      }
+      BBox siblings = nodes_[node.L].bbox();
+      siblings.max.min(nodes_[node.R].aabb_max);
+      siblings.min.max(nodes_[node.R].aabb_min);
+      overlap_area += siblings.surface_area();
+      parent_area += node.bbox().surface_area();
+      stack.emplace_back(node.R, depth + 1);
+      stack.emplace_back(node.L, depth + 1);
+    }
+    stats.mean_leaf_depth = depth_sum / stats.num_leaves;
+    stats.sibling_overlap_ratio =
+        parent_area > 0 ? overlap_area / parent_area : 0.0;
+    return stats;
+  }
+
+  int count() const { return nodes_.size(); }
+  const BVHArray<BVHNode> &nodes() const { return nodes_; }
+  const BVHArray<int> &tri_indices() const { return tri_indices_; }
+
+  /* Writes the tree to a snapshot file, together with a hash of the
+   * triangles it was built from */
+  void save(const char *path) const {
+    auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+    BVHSnapshotHeader header = {};
+    std::memcpy(header.magic, BVH_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = BVHSnapshotHeader::VERSION;
+    header.node_size = sizeof(BVHNode);
+    header.num_nodes = nodes_.size();
+    header.num_tri_indices = tri_indices_.size();
+    header.mesh_hash = hash_triangles(*tris_);
+    header.nodes_offset = align(sizeof(header));
+    header.tri_indices_offset =
+        align(header.nodes_offset + header.num_nodes * sizeof(BVHNode));
+    header.build_sah_cost = build_sah_cost_;
+
+    std::ofstream file(path, std::ios::binary);
+    auto write_at = [&](uint64_t offset, const void *data, uint64_t size) {
+      while (uint64_t(file.tellp()) < offset) {
+        file.put(0);
+      }
+      file.write(static_cast<const char *>(data), size);
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.nodes_offset, nodes_.data(),
+             header.num_nodes * sizeof(BVHNode));
+    write_at(header.tri_indices_offset, tri_indices_.data(),
+             header.num_tri_indices * sizeof(int));
+    if (!file) {
+      throw "Could not write BVH snapshot";
+    }
+  }
+
+  /* Maps a snapshot written by save, the nodes are used in place so only the
+   * pages touched by queries are ever read. tris must be the triangles the
+   * snapshot was built from (checked by hash) and must outlive the BVH.
+   * Throws if the file is not a snapshot or is stale. */
+  static BVH load(const char *path, const std::vector<BVHTriangle> &tris) {
+    auto file = std::make_shared<const MappedFile>(path);
+    BVHSnapshotHeader header;
+    if (file->size() < sizeof(header)) {
+      throw "Not a BVH snapshot";
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, BVH_SNAPSHOT_MAGIC, sizeof(header.magic)) !=
+            0 ||
+        header.version != BVHSnapshotHeader::VERSION ||
+        header.node_size != sizeof(BVHNode)) {
+      throw "Not a BVH snapshot";
+    }
+    if (header.nodes_offset % alignof(BVHNode) != 0 ||
+        header.tri_indices_offset % alignof(int) != 0 ||
+        header.nodes_offset + header.num_nodes * sizeof(BVHNode) >
+            file->size() ||
+        header.tri_indices_offset + header.num_tri_indices * sizeof(int) >
+            file->size()) {
+      throw "Truncated BVH snapshot";
+    }
+    // Spatial splits may reference triangles more than once, the hash covers
+    // the triangle count
+    if (header.num_tri_indices < tris.size() ||
+        header.mesh_hash != hash_triangles(tris)) {
+      throw "Stale BVH snapshot";
+    }
+
+    BVH bvh;
+    bvh.tris_ = &tris;
+    bvh.build_sah_cost_ = header.build_sah_cost;
+    bvh.nodes_.view(
+        reinterpret_cast<const BVHNode *>(file->data() + header.nodes_offset),
+        header.num_nodes);
+    bvh.tri_indices_.view(
+        reinterpret_cast<const int *>(file->data() + header.tri_indices_offset),
+        header.num_tri_indices);
+    bvh.snapshot_ = file;
+    return bvh;
+  }
+
+  /* Calls visit(tri_index) for the triangles touching box until it returns
+   * false, triangles split by SBVH may be visited several times. Returns false
+   * when stopped. Nothing is allocated: the traversal stack lives on the call
+   * stack, it only spills to the heap for trees deeper than the builders
+   * produce. Subtrees inside the box are visited without testing their
+   * triangles. */
+  template <typename Visit>
+  bool visit_box(const BBox &box, const Visit &visit) const {
+    BVHQueryCounter counter;
+    const int STACK_SIZE = 64;
+    int stack[STACK_SIZE];
+    int stack_size = 0;
+    std::vector<int> overflow;
+    int node_index = 0;
+    while (true) {
+      counter.visit_node();
+      const BVHNode &node = nodes_[node_index];
+      if (node.does_overlap(box)) {
+        const bool inside =
+            all_ge(node.aabb_min, box.min) && all_le(node.aabb_max, box.max);
+        if (inside) {
+          for (int i = node.start; i < node.end; i++) {
+            if (!visit(tri_indices_[i])) {
+              return false;
+            }
+          }
+        } else if (!node.is_leaf()) {
+          if (stack_size < STACK_SIZE) {
+            stack[stack_size++] = node.R;
+          } else {
+            overflow.push_back(node.R);
+          }
+          node_index = node.L;
+          continue;
+        } else {
+          counter.test_primitives(node.count());
+          for (int i = node.start; i < node.end; i++) {
+            const BVHTriangle &tri = (*tris_)[tri_indices_[i]];
+            if (tri_box_overlap(box.min, box.max, tri.a, tri.b, tri.c) &&
+                !visit(tri_indices_[i])) {
+              return false;
+            }
+          }
+        }
+      }
+      if (!overflow.empty()) {
+        node_index = overflow.back();
+        overflow.pop_back();
+      } else if (stack_size > 0) {
+        node_index = stack[--stack_size];
+      } else {
+        return true;
+      }
+    }
+  }
+
+  // Appends the indices of the triangles touching box to out, each once
+  void query_box(const BBox &box, std::vector<int> &out) const {
+    const size_t first = out.size();
+    visit_box(box, [&](int tri_index) {
+      out.push_back(tri_index);
+      return true;
+    });
+    if (has_duplicates()) {
+      std::sort(out.begin() + first, out.end());
+      out.erase(std::unique(out.begin() + first, out.end()), out.end());
+    }
+  }
+
+  // Whether any triangle touches box, stops at the first one found
+  bool touches_box(const BBox &box) const {
+    return !visit_box(box, [](int) { return false; });
+  }
+
+  /* query_box for many boxes in parallel, the triangles touching boxes[i]
+   * are indices[offsets[i], offsets[i + 1]). Each thread answers a contiguous
+   * block of boxes into its own arena, the arenas are then concatenated in
+   * order. */
+  void query_boxes(const std::vector<BBox> &boxes, std::vector<int> &offsets,
+                   std::vector<int> &indices) const {
+    const int num_boxes = boxes.size();
+    offsets.assign(num_boxes + 1, 0);
+    std::vector<std::vector<int>> arenas(omp_get_max_threads());
+    std::vector<size_t> arena_starts(arenas.size() + 1, 0);
+#pragma omp parallel
+    {
+      std::vector<int> &arena = arenas[omp_get_thread_num()];
+      // Static without a chunk size hands out contiguous blocks in thread
+      // order
+#pragma omp for schedule(static)
+      for (int i = 0; i < num_boxes; i++) {
+        size_t before = arena.size();
+        query_box(boxes[i], arena);
+        offsets[i + 1] = arena.size() - before;
+      }
+#pragma omp single
+      {
+        for (size_t t = 0; t < arenas.size(); t++) {
+          arena_starts[t + 1] = arena_starts[t] + arenas[t].size();
+        }
+        indices.resize(arena_starts.back());
+        for (int i = 0; i < num_boxes; i++) {
+          offsets[i + 1] += offsets[i];
+        }
+      }
+      const int t = omp_get_thread_num();
+      std::copy(arenas[t].begin(), arenas[t].end(),
+                indices.begin() + arena_starts[t]);
+    }
+  }
+
+  // Appends the triangles of this BVH intersecting the given triangle, the
+  // results have a = triangle_index
+  void intersect(const BVHTriangle &triangle, int triangle_index,
+                 std::vector<BVHIntersection> &out) const {
+    BVHQueryCounter counter;
+    const size_t first = out.size();
+    const BBox bbox = triangle.calc_bounding_box();
+    std::vector<int> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+      counter.stack_depth(stack.size());
+      counter.visit_node();
+      const BVHNode &node = nodes_[stack.back()];
+      stack.pop_back();
+      if (!node.does_overlap(bbox)) {
+        continue;
+      }
+      if (!node.is_leaf()) {
+        stack.push_back(node.R);
+        stack.push_back(node.L);
+        continue;
+      }
+      counter.test_primitives(node.count());
+      for (int i = node.start; i < node.end; i++) {
+        const BVHTriangle &other = (*tris_)[tri_indices_[i]];
+        TriTriSegment segment;
+        if (intersect_tri_tri(triangle.a, triangle.b, triangle.c, other.a,
+                              other.b, other.c, segment)) {
+          out.push_back({triangle_index, tri_indices_[i], segment});
+        }
+      }
+    }
+    if (has_duplicates()) {
+      auto by_b = [](const BVHIntersection &x, const BVHIntersection &y) {
+        return x.b < y.b;
+      };
+      auto same_b = [](const BVHIntersection &x, const BVHIntersection &y) {
+        return x.b == y.b;
+      };
+      std::sort(out.begin() + first, out.end(), by_b);
+      out.erase(std::unique(out.begin() + first, out.end(), same_b),
+                out.end());
+    }
+  }
+
+  /* Broad phase: collects every pair of distinct triangles of this mesh whose
+   * bounding boxes overlap, each unordered pair once. The tree is traversed
+   * against itself simultaneously, subtree pairs become OpenMP tasks (which
+   * idle threads steal) and each thread appends to its own buffer. */
+  void self_overlap(BVHCandidatePairBuffers &pairs) const {
+    pairs.assign(omp_get_max_threads(), {});
+    TriangleLeaves leaves;
+    PairLeaves pair_leaves;
+    if (has_duplicates()) {
+      leaves = triangle_leaves();
+      pair_leaves = {&leaves, &leaves, true};
+    }
+#pragma omp parallel
+#pragma omp single
+    self_overlap_task(0, pairs.data(),
+                      has_duplicates() ? &pair_leaves : nullptr);
+  }
+
+  // Broad phase between two meshes, pair.a indexes this BVH's triangles and
+  // pair.b the other's
+  void overlap(const BVH &other, BVHCandidatePairBuffers &pairs) const {
+    pairs.assign(omp_get_max_threads(), {});
+    const bool duplicates = has_duplicates() || other.has_duplicates();
+    TriangleLeaves leaves, other_leaves;
+    PairLeaves pair_leaves;
+    if (duplicates) {
+      leaves = triangle_leaves();
+      other_leaves = other.triangle_leaves();
+      pair_leaves = {&leaves, &other_leaves, false};
+    }
+#pragma omp parallel
+#pragma omp single
+    overlap_task(this, 0, &other, 0, pairs.data(),
+                 duplicates ? &pair_leaves : nullptr);
+  }
+
+  // Narrow phase over candidate pairs from overlap(other, pairs), pair.a
+  // indexes this BVH's triangles and pair.b the other's
+  void intersect_pairs(const BVH &other, const BVHCandidatePairBuffers &pairs,
+                       BVHIntersectionBuffers &out) const {
+    intersect_candidates(other, pairs, out, false);
+  }
+
+  /* Self intersections of the mesh. Neighbouring triangles meeting only at
+   * their shared vertices or edge (compared by exact coordinates, as in a
+   * triangle soup) are not reported. */
+  void self_intersect(BVHIntersectionBuffers &out) const {
+    BVHCandidatePairBuffers pairs;
+    self_overlap(pairs);
+    intersect_candidates(*this, pairs, out, true);
+  }
+
+  /* Number of triangles crossed by the ray in (0, ray.t), odd counts mean the
+   * origin is inside a closed mesh. Triangles are tested with the watertight
+   * kernel, rays through shared edges or vertices count them exactly once. */
+  int count_ray_hits(const BVHRay &ray) const {
+    const WatertightRay watertight = make_watertight_ray(ray.O, ray.D);
+    const Vec3 inverse = safe_inverse_direction(ray.D);
+    // Triangles referenced by several leaves are counted once
+    std::vector<int> hit_tris;
+    RayTriBatch batch;
+    int batch_tris[RAY_TRI_BATCH_SIZE];
+    int batch_size = 0;
+    auto flush = [&]() {
+      if (batch_size == 0) {
+        return;
+      }
+      for (int lane = batch_size; lane < RAY_TRI_BATCH_SIZE; lane++) {
+        for (int v = 0; v < 3; v++) {
+          for (int axis = 0; axis < 3; axis++) {
+            batch.v[v][axis][lane] = batch.v[v][axis][batch_size - 1];
+          }
+        }
+      }
+      float hits[RAY_TRI_BATCH_SIZE];
+      watertight_ray_tri_batch(watertight, batch, ray.t, hits);
+      for (int lane = 0; lane < batch_size; lane++) {
+        if (hits[lane] > 0.0f) {
+          hit_tris.push_back(batch_tris[lane]);
+        }
+      }
+      batch_size = 0;
+    };
+
+    BVHQueryCounter counter;
+    std::vector<int> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+      counter.stack_depth(stack.size());
+      counter.visit_node();
+      const BVHNode &node = nodes_[stack.back()];
+      stack.pop_back();
+      if (!ray_may_hit_aabb(ray.O, inverse, ray.t, node.aabb_min,
+                            node.aabb_max)) {
+        continue;
+      }
+      if (!node.is_leaf()) {
+        stack.push_back(node.R);
+        stack.push_back(node.L);
+        continue;
+      }
+      counter.test_primitives(node.count());
+      for (int i = node.start; i < node.end; i++) {
+        const BVHTriangle &tri = (*tris_)[tri_indices_[i]];
+        for (int v = 0; v < 3; v++) {
+          for (int axis = 0; axis < 3; axis++) {
+            batch.v[v][axis][batch_size] = tri[v][axis];
+          }
+        }
+        batch_tris[batch_size++] = tri_indices_[i];
+        if (batch_size == RAY_TRI_BATCH_SIZE) {
+          flush();
+        }
+      }
+    }
+    flush();
+
+    int hits = hit_tris.size();
+    if (has_duplicates() && hits > 1) {
+      std::sort(hit_tris.begin(), hit_tris.end());
+      hits = std::unique(hit_tris.begin(), hit_tris.end()) - hit_tris.begin();
+    }
+    return hits;
+  }
+
+  /* Closest point on the mesh to query, only triangles closer than
+   * sqrt(max_squared_distance) are considered, narrowing the radius speeds up
+   * narrow band queries */
+  BVHClosestPoint closest_point(const Vec3 &query,
+                                float max_squared_distance = INFINITY) const {
+    DistanceHeap heap;
+    return closest_point_search(query, max_squared_distance, heap);
+  }
+
+  // Unsigned squared distance from query to the mesh
+  float squared_distance(const Vec3 &query) const {
+    return closest_point(query).squared_distance;
+  }
+
+  /* Closest points for many queries in parallel, out[i] answers queries[i].
+   * Neighbouring queries should be close to each other (e.g grid order), so
+   * each thread keeps revisiting the same part of the tree. */
+  void closest_points(const std::vector<Vec3> &queries,
+                      std::vector<BVHClosestPoint> &out,
+                      float max_squared_distance = INFINITY) const {
+    const int num_queries = queries.size();
+    out.resize(num_queries);
+#pragma omp parallel
+    {
+      DistanceHeap heap;
+#pragma omp for schedule(dynamic, 256)
+      for (int i = 0; i < num_queries; i++) {
+        out[i] = closest_point_search(queries[i], max_squared_distance, heap);
+      }
     }
-    printf("Overlapping BVH nodes count = %d\n", overlap_count);
   }
 
-  ~BVH() { delete[] nodes_; }
   // void intersect_ray(BVHRay &ray, int node_index)
   // {
   //     BVHNode &node = nodes_[node_index];
@@ -0,0 +1,167 @@
+/* BVH quality statistics and per-query traversal counters.
+ * The counters are only compiled in when BVH_QUERY_STATS is defined (CMake
+ * option of the same name), otherwise BVHQueryCounter is empty and every call
+ * on it inlines to nothing. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Shape of a built tree, see BVH::stats
+struct BVHStats {
+  float sah_cost = 0.0f;
+  int num_nodes = 0;
+  int num_leaves = 0;
+  // Leaf references, more than the triangle count with spatial splits
+  int num_tri_indices = 0;
+  int max_depth = 0;
+  double mean_leaf_depth = 0.0;
+  // depth_histogram[d] leaves at depth d, the root is at depth 0
+  std::vector<int> depth_histogram;
+  // leaf_size_histogram[n] leaves with n triangles
+  std::vector<int> leaf_size_histogram;
+  // Surface area of the intersections of sibling boxes over the surface area
+  // of their parents, both summed over internal nodes. 0 when siblings are
+  // disjoint, close to 1 when both children span their parent
+  double sibling_overlap_ratio = 0.0;
+  // Nodes and triangle indices, the triangles belong to the caller
+  size_t memory_bytes = 0;
+
+  void write_json(std::ostream &out) const {
+    auto write_array = [&](const std::vector<int> &values) {
+      out << "[";
+      for (size_t i = 0; i < values.size(); i++) {
+        out << (i ? ", " : "") << values[i];
+      }
+      out << "]";
+    };
+    out << "{\"sah_cost\": " << sah_cost << ", \"num_nodes\": " << num_nodes
+        << ", \"num_leaves\": " << num_leaves
+        << ", \"num_tri_indices\": " << num_tri_indices
+        << ", \"max_depth\": " << max_depth
+        << ", \"mean_leaf_depth\": " << mean_leaf_depth
+        << ", \"depth_histogram\": ";
+    write_array(depth_histogram);
+    out << ", \"leaf_size_histogram\": ";
+    write_array(leaf_size_histogram);
+    out << ", \"sibling_overlap_ratio\": " << sibling_overlap_ratio
+        << ", \"memory_bytes\": " << memory_bytes << "}";
+  }
+};
+
+// Totals and per-query maxima over the queries of all threads
+struct BVHQueryStats {
+  uint64_t queries = 0;
+  uint64_t nodes_visited = 0;
+  uint64_t primitives_tested = 0;
+  uint64_t max_nodes_visited = 0;
+  uint64_t max_primitives_tested = 0;
+  // Deepest traversal stack (or heap, for closest point queries)
+  uint64_t max_stack_depth = 0;
+
+  void merge(const BVHQueryStats &other) {
+    queries += other.queries;
+    nodes_visited += other.nodes_visited;
+    primitives_tested += other.primitives_tested;
+    max_nodes_visited = std::max(max_nodes_visited, other.max_nodes_visited);
+    max_primitives_tested =
+        std::max(max_primitives_tested, other.max_primitives_tested);
+    max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+  }
+
+  void write_json(std::ostream &out) const {
+    auto mean = [&](uint64_t total) {
+      return queries ? double(total) / queries : 0.0;
+    };
+    out << "{\"queries\": " << queries
+        << ", \"nodes_visited\": " << nodes_visited
+        << ", \"primitives_tested\": " << primitives_tested
+        << ", \"mean_nodes_visited\": " << mean(nodes_visited)
+        << ", \"mean_primitives_tested\": " << mean(primitives_tested)
+        << ", \"max_nodes_visited\": " << max_nodes_visited
+        << ", \"max_primitives_tested\": " << max_primitives_tested
+        << ", \"max_stack_depth\": " << max_stack_depth << "}";
+  }
+};
+
+#ifdef BVH_QUERY_STATS
+namespace bvh_query_stats {
+// One cache line per thread so counting never contends
+struct alignas(64) Slot {
+  BVHQueryStats stats;
+};
+
+/* Every thread that counts queries gets its own slot on first use, OpenMP or
+ * not and whatever team it is in. Slots outlive their threads so the totals
+ * keep their counts, the deque never moves them. */
+inline std::mutex slots_mutex;
+inline std::deque<Slot> slots;
+
+inline Slot &thread_slot() {
+  thread_local Slot *slot = []() {
+    std::scoped_lock lock(slots_mutex);
+    return &slots.emplace_back();
+  }();
+  return *slot;
+}
+} // namespace bvh_query_stats
+
+// Counts one query, adds itself to the calling thread's totals when destroyed
+class BVHQueryCounter {
+private:
+  uint64_t nodes_visited_ = 0;
+  uint64_t primitives_tested_ = 0;
+  uint64_t max_stack_depth_ = 0;
+
+public:
+  void visit_node() { nodes_visited_++; }
+  void test_primitives(int count) { primitives_tested_ += count; }
+  void stack_depth(size_t depth) {
+    max_stack_depth_ = std::max<uint64_t>(max_stack_depth_, depth);
+  }
+
+  ~BVHQueryCounter() {
+    BVHQueryStats &stats = bvh_query_stats::thread_slot().stats;
+    stats.queries++;
+    stats.nodes_visited += nodes_visited_;
+    stats.primitives_tested += primitives_tested_;
+    stats.max_nodes_visited = std::max(stats.max_nodes_visited, nodes_visited_);
+    stats.max_primitives_tested =
+        std::max(stats.max_primitives_tested, primitives_tested_);
+    stats.max_stack_depth = std::max(stats.max_stack_depth, max_stack_depth_);
+  }
+};
+
+// Not thread safe, call outside of parallel regions
+inline void reset_bvh_query_stats() {
+  std::scoped_lock lock(bvh_query_stats::slots_mutex);
+  for (auto &slot : bvh_query_stats::slots) {
+    slot.stats = BVHQueryStats();
+  }
+}
+
+inline BVHQueryStats bvh_query_stats_total() {
+  BVHQueryStats total;
+  std::scoped_lock lock(bvh_query_stats::slots_mutex);
+  for (const auto &slot : bvh_query_stats::slots) {
+    total.merge(slot.stats);
+  }
+  return total;
+}
+#else
+class BVHQueryCounter {
+public:
+  void visit_node() {}
+  void test_primitives(int) {}
+  void stack_depth(size_t) {}
+};
+
+inline void reset_bvh_query_stats() {}
+inline BVHQueryStats bvh_query_stats_total() { return BVHQueryStats(); }
+#endif
@@ -0,0 +1,475 @@
+/* 8-wide BVH with quantized child bounds, for meshes where the binary nodes
+ * no longer fit in cache.
+ * Each node stores its box as an origin and a power of two scale per axis,
+ * and the boxes of its up to 8 children as 8 bit offsets on that grid,
+ * rounded outward so they always contain the original boxes. A node is 80
+ * bytes against ~7 binary nodes of 40 bytes it replaces, and all 8 children
+ * are decoded and tested together, see "Efficient Incoherent Ray Traversal on
+ * GPUs Through Compressed Wide BVHs" (Ylitie et al. 2017). */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "bvh.hh"
+
+struct BVHCompressedNode {
+  static constexpr int WIDTH = 8;
+  // Leaf children hold at most this many triangles
+  static constexpr int MAX_LEAF_SIZE = 127;
+  static constexpr uint8_t INTERNAL = 0x80;
+
+  float origin[3];
+  int8_t exponent[3];
+  uint8_t padding;
+  // Internal children are stored contiguously from child_base, in slot order
+  int child_base;
+  // Leaf children triangles are stored contiguously from tri_base, in slot
+  // order
+  int tri_base;
+  // 0 for empty slots, INTERNAL for internal children, otherwise the number of
+  // triangles of a leaf child
+  uint8_t meta[WIDTH];
+  uint8_t qmin[3][WIDTH];
+  uint8_t qmax[3][WIDTH];
+
+  // 2^exponent, built from the exponent bits directly
+  float scale(int axis) const {
+    uint32_t bits = uint32_t(exponent[axis] + 127) << 23;
+    float out;
+    std::memcpy(&out, &bits, sizeof(out));
+    return out;
+  }
+};
+static_assert(sizeof(BVHCompressedNode) == 80, "Unexpected node padding");
+
+class CompressedBVH {
+private:
+  std::vector<BVHCompressedNode> nodes_;
+  std::vector<int> tri_indices_;
+  const std::vector<BVHTriangle> *tris_;
+
+  // A subtree of the binary BVH (node >= 0), or a range of its triangle
+  // indices (node < 0) that becomes a leaf once small enough
+  struct Source {
+    int node;
+    int start, end;
+    BBox bbox;
+    bool is_leaf() const {
+      return node < 0 && end - start <= BVHCompressedNode::MAX_LEAF_SIZE;
+    }
+  };
+
+  static Source make_source(const BVH &bvh, int node_index) {
+    const BVHNode &node = bvh.nodes()[node_index];
+    return {node.is_leaf() ? -1 : node_index, node.start, node.end,
+            node.bbox()};
+  }
+
+  /* Children of a wide node: binary subtrees are opened largest surface area
+   * first until 8 children are collected, oversized leaf ranges are cut into
+   * 8 parts */
+  static std::vector<Source> collect_children(const BVH &bvh,
+                                              const Source &source) {
+    const int width = BVHCompressedNode::WIDTH;
+    std::vector<Source> children;
+    if (source.node < 0) {
+      if (source.is_leaf()) {
+        children.push_back(source);
+        return children;
+      }
+      const int count = source.end - source.start;
+      for (int i = 0; i < width; i++) {
+        children.push_back({-1, source.start + count * i / width,
+                            source.start + count * (i + 1) / width,
+                            source.bbox});
+      }
+      return children;
+    }
+
+    const BVHNode &node = bvh.nodes()[source.node];
+    children.push_back(make_source(bvh, node.L));
+    children.push_back(make_source(bvh, node.R));
+    while (int(children.size()) < width) {
+      int largest = -1;
+      float largest_area = -1.0f;
+      for (int i = 0; i < int(children.size()); i++) {
+        float area = children[i].bbox.surface_area();
+        if (children[i].node >= 0 && area > largest_area) {
+          largest = i;
+          largest_area = area;
+        }
+      }
+      if (largest < 0) {
+        break;
+      }
+      const BVHNode &opened = bvh.nodes()[children[largest].node];
+      children[largest] = make_source(bvh, opened.L);
+      children.push_back(make_source(bvh, opened.R));
+    }
+    return children;
+  }
+
+  // Smallest power of two grid covering the node with 255 steps, the check
+  // absorbs the rounding of origin + 255 * scale
+  static int8_t find_exponent(float origin, float max) {
+    int exponent = -126;
+    if (max > origin) {
+      exponent = std::max(
+          exponent, int(std::ceil(std::log2((max - origin) / 255.0f))));
+    }
+    while (exponent < 127 && origin + 255.0f * std::ldexp(1.0f, exponent) < max) {
+      exponent++;
+    }
+    return int8_t(exponent);
+  }
+
+  static void quantize(BVHCompressedNode &node, const BBox &bbox,
+                       const std::vector<Source> &children) {
+    for (int axis = 0; axis < 3; axis++) {
+      node.origin[axis] = bbox.min[axis];
+      node.exponent[axis] = find_exponent(bbox.min[axis], bbox.max[axis]);
+      const float origin = node.origin[axis], scale = node.scale(axis);
+      for (int slot = 0; slot < BVHCompressedNode::WIDTH; slot++) {
+        if (slot >= int(children.size())) {
+          // Inverted box, missed by every ray
+          node.qmin[axis][slot] = 255;
+          node.qmax[axis][slot] = 0;
+          continue;
+        }
+        const BBox &child = children[slot].bbox;
+        int lo = int(std::floor((child.min[axis] - origin) / scale));
+        int hi = int(std::ceil((child.max[axis] - origin) / scale));
+        lo = std::clamp(lo, 0, 255);
+        hi = std::clamp(hi, 0, 255);
+        while (lo > 0 && origin + lo * scale > child.min[axis]) {
+          lo--;
+        }
+        while (hi < 255 && origin + hi * scale < child.max[axis]) {
+          hi++;
+        }
+        node.qmin[axis][slot] = lo;
+        node.qmax[axis][slot] = hi;
+      }
+    }
+  }
+
+  /* Ray entry distance into every child box, INFINITY for missed children.
+   * Exit distances are widened as in ray_may_hit_aabb. */
+  static void intersect_children(const BVHCompressedNode &node,
+                                 const Vec3 &origin, const Vec3 &inverse,
+                                 float max_t,
+                                 float t_near[BVHCompressedNode::WIDTH]) {
+    const int width = BVHCompressedNode::WIDTH;
+    float t_enter[3][width], t_exit[3][width];
+    for (int axis = 0; axis < 3; axis++) {
+      // The near plane is picked per ray so the lanes never select. Planes
+      // are decoded exactly as quantize checked them (q * scale is exact),
+      // so the widened exit bound holds.
+      const float node_origin = node.origin[axis], scale = node.scale(axis);
+      const float o = origin[axis], inv = inverse[axis];
+      const uint8_t *q_near = inv >= 0 ? node.qmin[axis] : node.qmax[axis];
+      const uint8_t *q_far = inv >= 0 ? node.qmax[axis] : node.qmin[axis];
+#pragma omp simd
+      for (int lane = 0; lane < width; lane++) {
+        float near_plane = node_origin + float(q_near[lane]) * scale;
+        float far_plane = node_origin + float(q_far[lane]) * scale;
+        t_enter[axis][lane] = (near_plane - o) * inv;
+        t_exit[axis][lane] = (far_plane - o) * inv * RAY_AABB_EXIT_SCALE;
+      }
+    }
+#pragma omp simd
+    for (int lane = 0; lane < width; lane++) {
+      float enter = t_enter[0][lane] > 0.0f ? t_enter[0][lane] : 0.0f;
+      enter = t_enter[1][lane] > enter ? t_enter[1][lane] : enter;
+      enter = t_enter[2][lane] > enter ? t_enter[2][lane] : enter;
+      float exit = t_exit[0][lane] < max_t ? t_exit[0][lane] : max_t;
+      exit = t_exit[1][lane] < exit ? t_exit[1][lane] : exit;
+      exit = t_exit[2][lane] < exit ? t_exit[2][lane] : exit;
+      t_near[lane] = enter <= exit ? enter : INFINITY;
+    }
+  }
+
+  // Squared distance from p to every child box
+  static void child_squared_distances(
+      const BVHCompressedNode &node, const Vec3 &p,
+      float squared_distances[BVHCompressedNode::WIDTH]) {
+    const int width = BVHCompressedNode::WIDTH;
+    float distances[3][width];
+    for (int axis = 0; axis < 3; axis++) {
+      const float node_origin = node.origin[axis], scale = node.scale(axis);
+      const float pa = p[axis];
+      const uint8_t *qmin = node.qmin[axis];
+      const uint8_t *qmax = node.qmax[axis];
+#pragma omp simd
+      for (int lane = 0; lane < width; lane++) {
+        float below = (node_origin + float(qmin[lane]) * scale) - pa;
+        float above = pa - (node_origin + float(qmax[lane]) * scale);
+        float d = below > above ? below : above;
+        distances[axis][lane] = d > 0.0f ? d : 0.0f;
+      }
+    }
+#pragma omp simd
+    for (int lane = 0; lane < width; lane++) {
+      squared_distances[lane] = distances[0][lane] * distances[0][lane] +
+                                distances[1][lane] * distances[1][lane] +
+                                distances[2][lane] * distances[2][lane];
+    }
+  }
+
+  bool has_duplicates() const { return tri_indices_.size() > tris_->size(); }
+
+  // (squared distance to node box, node index), kept as a min heap
+  using DistanceHeap = std::vector<std::pair<float, int>>;
+
+  BVHClosestPoint closest_point_search(const Vec3 &query,
+                                       float max_squared_distance,
+                                       DistanceHeap &heap) const {
+    auto farther = [](const std::pair<float, int> &a,
+                      const std::pair<float, int> &b) {
+      return a.first > b.first;
+    };
+
+    BVHQueryCounter counter;
+    BVHClosestPoint best;
+    best.squared_distance = max_squared_distance;
+    PointTriBatch batch;
+    int batch_tris[POINT_TRI_BATCH_SIZE];
+    int batch_size = 0;
+    auto flush = [&]() {
+      if (batch_size == 0) {
+        return;
+      }
+      for (int lane = batch_size; lane < POINT_TRI_BATCH_SIZE; lane++) {
+        for (int v = 0; v < 3; v++) {
+          for (int axis = 0; axis < 3; axis++) {
+            batch.v[v][axis][lane] = batch.v[v][axis][batch_size - 1];
+          }
+        }
+      }
+      float squared_distances[POINT_TRI_BATCH_SIZE];
+      point_tri_squared_distance_batch(query, batch, squared_distances);
+      for (int lane = 0; lane < batch_size; lane++) {
+        if (squared_distances[lane] < best.squared_distance) {
+          best.squared_distance = squared_distances[lane];
+          best.tri_index = batch_tris[lane];
+        }
+      }
+      batch_size = 0;
+    };
+
+    heap.clear();
+    heap.push_back({0.0f, 0});
+    while (true) {
+      if (heap.empty() || heap.front().first >= best.squared_distance) {
+        flush();
+        if (heap.empty() || heap.front().first >= best.squared_distance) {
+          break;
+        }
+      }
+      std::pop_heap(heap.begin(), heap.end(), farther);
+      const BVHCompressedNode &node = nodes_[heap.back().second];
+      heap.pop_back();
+      counter.visit_node();
+
+      float squared_distances[BVHCompressedNode::WIDTH];
+      child_squared_distances(node, query, squared_distances);
+      int internal = 0, tri_offset = 0;
+      for (int slot = 0; slot < BVHCompressedNode::WIDTH; slot++) {
+        const uint8_t meta = node.meta[slot];
+        if (meta == BVHCompressedNode::INTERNAL) {
+          if (squared_distances[slot] < best.squared_distance) {
+            heap.push_back(
+                {squared_distances[slot], node.child_base + internal});
+            std::push_heap(heap.begin(), heap.end(), farther);
+            counter.stack_depth(heap.size());
+          }
+          internal++;
+          continue;
+        }
+        if (meta != 0 && squared_distances[slot] < best.squared_distance) {
+          counter.test_primitives(meta);
+          for (int i = 0; i < meta; i++) {
+            const int tri_index = tri_indices_[node.tri_base + tri_offset + i];
+            const BVHTriangle &tri = (*tris_)[tri_index];
+            for (int v = 0; v < 3; v++) {
+              for (int axis = 0; axis < 3; axis++) {
+                batch.v[v][axis][batch_size] = tri[v][axis];
+              }
+            }
+            batch_tris[batch_size++] = tri_index;
+            if (batch_size == POINT_TRI_BATCH_SIZE) {
+              flush();
+            }
+          }
+        }
+        tri_offset += meta;
+      }
+    }
+
+    if (best.tri_index >= 0) {
+      const BVHTriangle &tri = (*tris_)[best.tri_index];
+      best.point = closest_point_on_triangle(query, tri.a, tri.b, tri.c);
+    }
+    return best;
+  }
+
+public:
+  /* Collapses a built BVH, which is only needed during construction. tris
+   * must be the triangles bvh was built from and must outlive this tree. */
+  CompressedBVH(const std::vector<BVHTriangle> &tris, const BVH &bvh)
+      : tris_(&tris) {
+    if (bvh.tri_indices().size() < tris.size()) {
+      throw "BVH was built from other triangles";
+    }
+    tri_indices_.reserve(bvh.tri_indices().size());
+
+    // Breadth first, so the internal children of a node can be allocated
+    // next to each other
+    std::vector<std::pair<int, Source>> queue;
+    const BVHNode &root = bvh.nodes()[0];
+    queue.push_back({0, {root.is_leaf() ? -1 : 0, root.start, root.end,
+                         root.bbox()}});
+    nodes_.emplace_back();
+    for (size_t next = 0; next < queue.size(); next++) {
+      const int node_index = queue[next].first;
+      const Source source = queue[next].second;
+      std::vector<Source> children = collect_children(bvh, source);
+
+      BVHCompressedNode node = {};
+      quantize(node, source.bbox, children);
+      node.child_base = nodes_.size();
+      node.tri_base = tri_indices_.size();
+      for (int slot = 0; slot < int(children.size()); slot++) {
+        const Source &child = children[slot];
+        if (child.is_leaf()) {
+          node.meta[slot] = child.end - child.start;
+          for (int i = child.start; i < child.end; i++) {
+            tri_indices_.push_back(bvh.tri_indices()[i]);
+          }
+        } else {
+          node.meta[slot] = BVHCompressedNode::INTERNAL;
+          queue.push_back({int(nodes_.size()), child});
+          nodes_.emplace_back();
+        }
+      }
+      nodes_[node_index] = node;
+    }
+  }
+
+  int count() const { return nodes_.size(); }
+  const std::vector<BVHCompressedNode> &nodes() const { return nodes_; }
+
+  size_t memory_bytes() const {
+    return nodes_.size() * sizeof(BVHCompressedNode) +
+           tri_indices_.size() * sizeof(int);
+  }
+
+  // Number of triangles crossed by the ray in (0, ray.t), see
+  // BVH::count_ray_hits
+  int count_ray_hits(const BVHRay &ray) const {
+    const WatertightRay watertight = make_watertight_ray(ray.O, ray.D);
+    const Vec3 inverse = safe_inverse_direction(ray.D);
+    std::vector<int> hit_tris;
+    RayTriBatch batch;
+    int batch_tris[RAY_TRI_BATCH_SIZE];
+    int batch_size = 0;
+    auto flush = [&]() {
+      if (batch_size == 0) {
+        return;
+      }
+      for (int lane = batch_size; lane < RAY_TRI_BATCH_SIZE; lane++) {
+        for (int v = 0; v < 3; v++) {
+          for (int axis = 0; axis < 3; axis++) {
+            batch.v[v][axis][lane] = batch.v[v][axis][batch_size - 1];
+          }
+        }
+      }
+      float hits[RAY_TRI_BATCH_SIZE];
+      watertight_ray_tri_batch(watertight, batch, ray.t, hits);
+      for (int lane = 0; lane < batch_size; lane++) {
+        if (hits[lane] > 0.0f) {
+          hit_tris.push_back(batch_tris[lane]);
+        }
+      }
+      batch_size = 0;
+    };
+
+    BVHQueryCounter counter;
+    std::vector<int> stack;
+    stack.push_back(0);
+    while (!stack.empty()) {
+      counter.stack_depth(stack.size());
+      counter.visit_node();
+      const BVHCompressedNode &node = nodes_[stack.back()];
+      stack.pop_back();
+
+      float t_near[BVHCompressedNode::WIDTH];
+      intersect_children(node, ray.O, inverse, ray.t, t_near);
+      int internal = 0, tri_offset = 0;
+      for (int slot = 0; slot < BVHCompressedNode::WIDTH; slot++) {
+        const uint8_t meta = node.meta[slot];
+        if (meta == BVHCompressedNode::INTERNAL) {
+          if (t_near[slot] != INFINITY) {
+            stack.push_back(node.child_base + internal);
+          }
+          internal++;
+          continue;
+        }
+        if (meta != 0 && t_near[slot] != INFINITY) {
+          counter.test_primitives(meta);
+          for (int i = 0; i < meta; i++) {
+            const int tri_index = tri_indices_[node.tri_base + tri_offset + i];
+            const BVHTriangle &tri = (*tris_)[tri_index];
+            for (int v = 0; v < 3; v++) {
+              for (int axis = 0; axis < 3; axis++) {
+                batch.v[v][axis][batch_size] = tri[v][axis];
+              }
+            }
+            batch_tris[batch_size++] = tri_index;
+            if (batch_size == RAY_TRI_BATCH_SIZE) {
+              flush();
+            }
+          }
+        }
+        tri_offset += meta;
+      }
+    }
+    flush();
+
+    int hits = hit_tris.size();
+    if (has_duplicates() && hits > 1) {
+      std::sort(hit_tris.begin(), hit_tris.end());
+      hits = std::unique(hit_tris.begin(), hit_tris.end()) - hit_tris.begin();
+    }
+    return hits;
+  }
+
+  // See BVH::closest_point
+  BVHClosestPoint closest_point(const Vec3 &query,
+                                float max_squared_distance = INFINITY) const {
+    DistanceHeap heap;
+    return closest_point_search(query, max_squared_distance, heap);
+  }
+
+  // See BVH::closest_points
+  void closest_points(const std::vector<Vec3> &queries,
+                      std::vector<BVHClosestPoint> &out,
+                      float max_squared_distance = INFINITY) const {
+    const int num_queries = queries.size();
+    out.resize(num_queries);
+#pragma omp parallel
+    {
+      DistanceHeap heap;
+#pragma omp for schedule(dynamic, 256)
+      for (int i = 0; i < num_queries; i++) {
+        out[i] = closest_point_search(queries[i], max_squared_distance, heap);
+      }
+    }
+  }
+};
@@ -0,0 +1,229 @@
+/* Fast generalized winding numbers over a BVH, see "Fast Winding Numbers for
+ * Soups and Clouds" (Barill et al. 2018).
+ * Every node stores a Taylor expansion of the winding number of its
+ * triangles around their area weighted center: the dipole term (the area
+ * weighted normal sum) and the second order term (the area weighted
+ * outer products of centroid offsets and normals). A query uses the expansion
+ * of nodes farther than beta times their radius and sums the exact solid
+ * angles of the triangles of the leaves it reaches. With beta = 2 the error
+ * is ~1e-3 typically and a few 1e-2 at worst, larger is more exact and
+ * slower. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bvh.hh"
+#include "vec3.hh"
+
+// Half the solid angle tri subtends at p, positive when p is behind the
+// counter clockwise side, see "The Solid Angle of a Plane Triangle" (Van
+// Oosterom and Strackee 1983)
+inline float tri_half_solid_angle(const Vec3 &p, const BVHTriangle &tri) {
+  const Vec3 a = tri.a - p, b = tri.b - p, c = tri.c - p;
+  const float al = a.length(), bl = b.length(), cl = c.length();
+  const float determinant = dot(a, cross(b, c));
+  const float denominator =
+      al * bl * cl + dot(a, b) * cl + dot(a, c) * bl + dot(b, c) * al;
+  return std::atan2(determinant, denominator);
+}
+
+struct BVHWindingExpansion {
+  // Area weighted center of the triangles, the expansion point
+  Vec3 center;
+  // Distance from center to the farthest vertex
+  float radius = 0.0f;
+  float area = 0.0f;
+  // Sum of area * unit normal
+  Vec3 normal;
+  // Sum of area * (centroid - center) * normal^T, row major
+  float moment[9] = {};
+};
+
+class FastWindingNumber {
+private:
+  const std::vector<BVHTriangle> *tris_;
+  const BVH *bvh_;
+  std::vector<BVHWindingExpansion> expansions_;
+  float beta_;
+
+  static constexpr float INV_4PI = 0.0795774715459476679f;
+  static constexpr float INV_2PI = 0.159154943091895336f;
+
+  void expand_leaf(const BVHNode &node, BVHWindingExpansion &out) const {
+    const std::vector<BVHTriangle> &tris = *tris_;
+    const auto &tri_indices = bvh_->tri_indices();
+    Vec3 weighted_center(0.0f);
+    for (int i = node.start; i < node.end; i++) {
+      const BVHTriangle &tri = tris[tri_indices[i]];
+      const Vec3 area_normal = cross(tri.b - tri.a, tri.c - tri.a) * 0.5f;
+      const float tri_area = area_normal.length();
+      out.normal += area_normal;
+      weighted_center += tri.centroid() * tri_area;
+      out.area += tri_area;
+    }
+    out.center = out.area > 0.0f ? weighted_center / out.area
+                                 : (node.aabb_min + node.aabb_max) * 0.5f;
+    for (int i = node.start; i < node.end; i++) {
+      const BVHTriangle &tri = tris[tri_indices[i]];
+      const Vec3 area_normal = cross(tri.b - tri.a, tri.c - tri.a) * 0.5f;
+      const Vec3 offset = tri.centroid() - out.center;
+      for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+          out.moment[3 * r + c] += offset[r] * area_normal[c];
+        }
+      }
+      for (int v = 0; v < 3; v++) {
+        out.radius = std::max(out.radius, (tri[v] - out.center).length());
+      }
+    }
+  }
+
+  /* Moves the expansions of the children to their area weighted center. The
+   * moments shift by (child center - center) * child normal^T, the radius
+   * bounds the children spheres. */
+  void combine(const BVHWindingExpansion &left,
+               const BVHWindingExpansion &right,
+               BVHWindingExpansion &out) const {
+    out.normal = left.normal + right.normal;
+    out.area = left.area + right.area;
+    out.center = out.area > 0.0f ? (left.center * left.area +
+                                    right.center * right.area) /
+                                       out.area
+                                 : (left.center + right.center) * 0.5f;
+    out.radius = 0.0f;
+    for (const BVHWindingExpansion *child : {&left, &right}) {
+      const Vec3 shift = child->center - out.center;
+      for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+          out.moment[3 * r + c] +=
+              child->moment[3 * r + c] + shift[r] * child->normal[c];
+        }
+      }
+      out.radius = std::max(out.radius, shift.length() + child->radius);
+    }
+  }
+
+  // Winding number of the triangles of a node seen from far away
+  float far_field(const BVHWindingExpansion &e, const Vec3 &p) const {
+    const Vec3 r = e.center - p;
+    const float inv_r2 = 1.0f / r.length_squared();
+    const float inv_r = std::sqrt(inv_r2);
+    const float inv_r3 = inv_r * inv_r2;
+    const float trace = e.moment[0] + e.moment[4] + e.moment[8];
+    float rmr = 0.0f;
+    for (int i = 0; i < 3; i++) {
+      rmr += r[i] * (e.moment[3 * i] * r.x + e.moment[3 * i + 1] * r.y +
+                     e.moment[3 * i + 2] * r.z);
+    }
+    return INV_4PI * (dot(r, e.normal) * inv_r3 + trace * inv_r3 -
+                      3.0f * rmr * inv_r3 * inv_r2);
+  }
+
+public:
+  /* Precomputes the expansions of every node of bvh, which must be built
+   * from tris without spatial splits. tris and bvh must outlive this. */
+  FastWindingNumber(const std::vector<BVHTriangle> &tris, const BVH &bvh,
+                    float beta = 2.0f)
+      : tris_(&tris), bvh_(&bvh), beta_(beta) {
+    if (bvh.tri_indices().size() < tris.size()) {
+      throw "BVH was built from other triangles";
+    }
+    if (bvh.tri_indices().size() > tris.size()) {
+      throw "Fast winding numbers need a BVH without spatial splits";
+    }
+    const auto &nodes = bvh.nodes();
+    expansions_.resize(nodes.size());
+
+    // Parents come before their children in breadth first order
+    std::vector<int> order = {0};
+    for (size_t i = 0; i < order.size(); i++) {
+      const BVHNode &node = nodes[order[i]];
+      if (!node.is_leaf()) {
+        order.push_back(node.L);
+        order.push_back(node.R);
+      }
+    }
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < order.size(); i++) {
+      const BVHNode &node = nodes[order[i]];
+      if (node.is_leaf()) {
+        expand_leaf(node, expansions_[order[i]]);
+      }
+    }
+    for (size_t i = order.size(); i-- > 0;) {
+      const BVHNode &node = nodes[order[i]];
+      if (!node.is_leaf()) {
+        combine(expansions_[node.L], expansions_[node.R],
+                expansions_[order[i]]);
+      }
+    }
+  }
+
+  float beta() const { return beta_; }
+  void set_beta(float beta) { beta_ = beta; }
+
+  // ~1 inside and ~0 outside a closed mesh
+  float winding_number(const Vec3 &p) const {
+    const auto &nodes = bvh_->nodes();
+    const auto &tri_indices = bvh_->tri_indices();
+    const std::vector<BVHTriangle> &tris = *tris_;
+    BVHQueryCounter counter;
+    float w = 0.0f;
+    const int STACK_SIZE = 64;
+    int stack[STACK_SIZE];
+    int stack_size = 0;
+    std::vector<int> overflow;
+    int node_index = 0;
+    while (true) {
+      counter.visit_node();
+      const BVHNode &node = nodes[node_index];
+      const BVHWindingExpansion &e = expansions_[node_index];
+      const float far = beta_ * e.radius;
+      if ((e.center - p).length_squared() > far * far) {
+        w += far_field(e, p);
+      } else if (!node.is_leaf()) {
+        if (stack_size < STACK_SIZE) {
+          stack[stack_size++] = node.R;
+        } else {
+          overflow.push_back(node.R);
+        }
+        node_index = node.L;
+        continue;
+      } else {
+        counter.test_primitives(node.count());
+        float half_angles = 0.0f;
+        for (int i = node.start; i < node.end; i++) {
+          half_angles += tri_half_solid_angle(p, tris[tri_indices[i]]);
+        }
+        w += half_angles * INV_2PI;
+      }
+      if (!overflow.empty()) {
+        node_index = overflow.back();
+        overflow.pop_back();
+      } else if (stack_size > 0) {
+        node_index = stack[--stack_size];
+      } else {
+        break;
+      }
+    }
+    return w;
+  }
+
+  // Winding numbers of a batch of points, in parallel
+  void winding_numbers(const std::vector<Vec3> &points,
+                       std::vector<float> &out) const {
+    out.resize(points.size());
+#pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < points.size(); i++) {
+      out[i] = winding_number(points[i]);
+    }
+  }
+
+  // Nodes and their expansions
+  size_t memory_bytes() const {
+    return expansions_.size() * sizeof(BVHWindingExpansion);
+  }
+};
@@ -0,0 +1,77 @@
+/* Read only memory mapped file.
+ * On POSIX systems the file is mapped with mmap so pages are only read from
+ * disk when first touched, elsewhere it is read into memory up front. */
+
+#pragma once
+
+#include <cstddef>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class MappedFile {
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+
+public:
+  explicit MappedFile(const char *path) {
+#ifdef _WIN32
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+      throw "Could not open file";
+    }
+    size_ = file.tellg();
+    char *buffer = new char[size_];
+    file.seekg(0);
+    if (!file.read(buffer, size_)) {
+      delete[] buffer;
+      throw "Could not read file";
+    }
+    data_ = buffer;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw "Could not open file";
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw "Could not read file";
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        close(fd);
+        throw "Could not map file";
+      }
+      data_ = static_cast<const char *>(data);
+    }
+    // The mapping stays valid after closing the descriptor
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() {
+#ifdef _WIN32
+    delete[] data_;
+#else
+    if (data_) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+};
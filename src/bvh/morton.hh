@@ -0,0 +1,81 @@
+/* Morton (Z-order) codes of points in the unit cube, used to linearize
+ * primitives for the LBVH builder.
+ * https://developer.nvidia.com/blog/thinking-parallel-part-iii-tree-construction-gpu/
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+// Spread the lower 10 bits of v so that there are two zero bits between each
+inline uint32_t expand_bits_30(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// Spread the lower 21 bits of v so that there are two zero bits between each
+inline uint64_t expand_bits_63(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x001f00000000ffffull;
+  v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+  v = (v | (v << 8)) & 0x100f00f00f00f00full;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+// x, y and z are expected to be in [0, 1]
+inline uint32_t morton3d_30(float x, float y, float z) {
+  auto quantize = [](float v) {
+    return static_cast<uint32_t>(std::min(std::max(v * 1024.0f, 0.0f), 1023.0f));
+  };
+  return (expand_bits_30(quantize(x)) << 2) |
+         (expand_bits_30(quantize(y)) << 1) | expand_bits_30(quantize(z));
+}
+
+// x, y and z are expected to be in [0, 1]
+inline uint64_t morton3d_63(float x, float y, float z) {
+  auto quantize = [](float v) {
+    return static_cast<uint64_t>(
+        std::min(std::max(v * 2097152.0f, 0.0f), 2097151.0f));
+  };
+  return (expand_bits_63(quantize(x)) << 2) |
+         (expand_bits_63(quantize(y)) << 1) | expand_bits_63(quantize(z));
+}
+
+inline int count_leading_zeros(uint32_t v) {
+  if (v == 0) {
+    return 32;
+  }
+#if defined(_MSC_VER) && !defined(__INTEL_COMPILER)
+  int n = 0;
+  while (!(v & 0x80000000u)) {
+    v <<= 1;
+    n++;
+  }
+  return n;
+#else
+  return __builtin_clz(v);
+#endif
+}
+
+inline int count_leading_zeros(uint64_t v) {
+  if (v == 0) {
+    return 64;
+  }
+#if defined(_MSC_VER) && !defined(__INTEL_COMPILER)
+  int n = 0;
+  while (!(v & 0x8000000000000000ull)) {
+    v <<= 1;
+    n++;
+  }
+  return n;
+#else
+  return __builtin_clzll(v);
+#endif
+}
@@ -0,0 +1,155 @@
+/* Point to triangle distance.
+ * closest_point_on_triangle is the scalar Voronoi region walk from "Real-Time
+ * Collision Detection" (Ericson 2004), the batch kernel evaluates a branch
+ * free formulation for POINT_TRI_BATCH_SIZE triangles at a time. */
+
+#pragma once
+
+#include <algorithm>
+
+#include "vec3.hh"
+
+inline Vec3 closest_point_on_triangle(const Vec3 &p, const Vec3 &a,
+                                      const Vec3 &b, const Vec3 &c) {
+  Vec3 ab = b - a;
+  Vec3 ac = c - a;
+  Vec3 ap = p - a;
+  float d1 = dot(ab, ap);
+  float d2 = dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0) {
+    return a;
+  }
+
+  Vec3 bp = p - b;
+  float d3 = dot(ab, bp);
+  float d4 = dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3) {
+    return b;
+  }
+
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    float v = d1 / (d1 - d3);
+    return a + v * ab;
+  }
+
+  Vec3 cp = p - c;
+  float d5 = dot(ab, cp);
+  float d6 = dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6) {
+    return c;
+  }
+
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    float w = d2 / (d2 - d6);
+    return a + w * ac;
+  }
+
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+    float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return b + w * (c - b);
+  }
+
+  float denom = 1.0f / (va + vb + vc);
+  float v = vb * denom;
+  float w = vc * denom;
+  return a + ab * v + ac * w;
+}
+
+// Number of triangles point_tri_squared_distance_batch evaluates at once
+const int POINT_TRI_BATCH_SIZE = 8;
+
+// Triangles in SoA layout, [vertex][axis][lane]
+struct PointTriBatch {
+  float v[3][3][POINT_TRI_BATCH_SIZE];
+};
+
+/* Squared distances from p to every triangle of the batch: the distance to
+ * the plane when p projects inside the triangle, otherwise the distance to
+ * the closest edge. Every lane computes both, and the clamps and the final
+ * select read their inputs from small arrays, otherwise GCC sinks the
+ * arithmetic feeding only one side of a select into a branch and the loops no
+ * longer vectorize without AVX-512 masking. */
+inline void point_tri_squared_distance_batch(const Vec3 &p,
+                                             const PointTriBatch &batch,
+                                             float out[POINT_TRI_BATCH_SIZE]) {
+  const float px = p.x, py = p.y, pz = p.z;
+  const auto &v = batch.v;
+
+  // Parameter of the point closest to p on edge (v[e], v[(e + 1) % 3])
+  float edge_t[3][POINT_TRI_BATCH_SIZE];
+  for (int e = 0; e < 3; e++) {
+    const int e1 = (e + 1) % 3;
+#pragma omp simd
+    for (int lane = 0; lane < POINT_TRI_BATCH_SIZE; lane++) {
+      float ex = v[e1][0][lane] - v[e][0][lane];
+      float ey = v[e1][1][lane] - v[e][1][lane];
+      float ez = v[e1][2][lane] - v[e][2][lane];
+      float numerator = (px - v[e][0][lane]) * ex +
+                        (py - v[e][1][lane]) * ey + (pz - v[e][2][lane]) * ez;
+      // Degenerate edges have a zero numerator and end up with t = 0
+      float t = numerator / (ex * ex + ey * ey + ez * ez + 1e-30f);
+      t = t > 0.0f ? t : 0.0f;
+      edge_t[e][lane] = t < 1.0f ? t : 1.0f;
+    }
+  }
+
+  float edges_squared_distance[POINT_TRI_BATCH_SIZE];
+  float plane_squared_distance[POINT_TRI_BATCH_SIZE];
+  float inside[POINT_TRI_BATCH_SIZE];
+#pragma omp simd
+  for (int lane = 0; lane < POINT_TRI_BATCH_SIZE; lane++) {
+    float ax = v[0][0][lane], ay = v[0][1][lane], az = v[0][2][lane];
+    float bx = v[1][0][lane], by = v[1][1][lane], bz = v[1][2][lane];
+    float cx = v[2][0][lane], cy = v[2][1][lane], cz = v[2][2][lane];
+
+    auto edge_squared_distance = [&](float ox, float oy, float oz, float ex,
+                                     float ey, float ez, float t) {
+      float dx = px - (ox + t * ex);
+      float dy = py - (oy + t * ey);
+      float dz = pz - (oz + t * ez);
+      return dx * dx + dy * dy + dz * dz;
+    };
+    float d0 = edge_squared_distance(ax, ay, az, bx - ax, by - ay, bz - az,
+                                     edge_t[0][lane]);
+    float d1 = edge_squared_distance(bx, by, bz, cx - bx, cy - by, cz - bz,
+                                     edge_t[1][lane]);
+    float d2 = edge_squared_distance(cx, cy, cz, ax - cx, ay - cy, az - cz,
+                                     edge_t[2][lane]);
+    float closest = d0 < d1 ? d0 : d1;
+    edges_squared_distance[lane] = closest < d2 ? closest : d2;
+
+    float abx = bx - ax, aby = by - ay, abz = bz - az;
+    float acx = cx - ax, acy = cy - ay, acz = cz - az;
+    float nx = aby * acz - abz * acy;
+    float ny = abz * acx - abx * acz;
+    float nz = abx * acy - aby * acx;
+    float n_length_squared = nx * nx + ny * ny + nz * nz;
+
+    // p projects inside when it lies on the inner side of all three edges
+    auto edge_side = [&](float ex, float ey, float ez, float ox, float oy,
+                         float oz) {
+      float qx = px - ox, qy = py - oy, qz = pz - oz;
+      return (ey * qz - ez * qy) * nx + (ez * qx - ex * qz) * ny +
+             (ex * qy - ey * qx) * nz;
+    };
+    // Bitwise and, short circuiting would add branches
+    bool is_inside = (n_length_squared > 0) &
+                     (edge_side(abx, aby, abz, ax, ay, az) >= 0) &
+                     (edge_side(cx - bx, cy - by, cz - bz, bx, by, bz) >= 0) &
+                     (edge_side(-acx, -acy, -acz, cx, cy, cz) >= 0);
+    inside[lane] = is_inside ? 1.0f : 0.0f;
+
+    float plane_distance = (px - ax) * nx + (py - ay) * ny + (pz - az) * nz;
+    plane_squared_distance[lane] =
+        plane_distance * plane_distance / (n_length_squared + 1e-30f);
+  }
+
+#pragma omp simd
+  for (int lane = 0; lane < POINT_TRI_BATCH_SIZE; lane++) {
+    out[lane] = inside[lane] > 0.0f ? plane_squared_distance[lane]
+                                    : edges_squared_distance[lane];
+  }
+}
@@ -0,0 +1,196 @@
+/* Filtered exact geometric predicates on float coordinates.
+ * The determinant is first evaluated in double with Shewchuk's static error
+ * bound, only when the sign is uncertain it is recomputed exactly using
+ * floating point expansions.
+ * https://www.cs.cmu.edu/~quake/robust.html */
+
+#pragma once
+
+#include <cmath>
+
+#include "vec3.hh"
+
+namespace predicates {
+/* Nonoverlapping components sorted by increasing magnitude, sized for the
+ * largest intermediate of orient3d_exact so nothing is heap allocated */
+struct Expansion {
+  static const int MAX_COMPONENTS = 192;
+  double components[MAX_COMPONENTS];
+  int size = 0;
+};
+
+const double EPSILON = 1.1102230246251565e-16; // 2^-53
+const double ORIENT2D_ERRBOUND = (3.0 + 16.0 * EPSILON) * EPSILON;
+const double ORIENT3D_ERRBOUND = (7.0 + 56.0 * EPSILON) * EPSILON;
+
+inline void two_sum(double a, double b, double &x, double &y) {
+  x = a + b;
+  double b_virtual = x - a;
+  double a_virtual = x - b_virtual;
+  y = (a - a_virtual) + (b - b_virtual);
+}
+
+inline void two_diff(double a, double b, double &x, double &y) {
+  x = a - b;
+  double b_virtual = a - x;
+  double a_virtual = x + b_virtual;
+  y = (a - a_virtual) + (b_virtual - b);
+}
+
+inline void two_product(double a, double b, double &x, double &y) {
+  x = a * b;
+  y = std::fma(a, b, -x);
+}
+
+// e += b, components equal to zero are dropped
+inline void grow(Expansion &e, double b) {
+  double q = b;
+  int size = 0;
+  for (int i = 0; i < e.size; i++) {
+    double sum, error;
+    two_sum(q, e.components[i], sum, error);
+    q = sum;
+    if (error != 0.0) {
+      e.components[size++] = error;
+    }
+  }
+  if (q != 0.0) {
+    e.components[size++] = q;
+  }
+  e.size = size;
+}
+
+// e += sign * f
+inline void add(Expansion &e, const Expansion &f, double sign = 1.0) {
+  for (int i = 0; i < f.size; i++) {
+    grow(e, sign * f.components[i]);
+  }
+}
+
+// h = e * f
+inline void product(const Expansion &e, const Expansion &f, Expansion &h) {
+  h.size = 0;
+  for (int i = 0; i < e.size; i++) {
+    for (int j = 0; j < f.size; j++) {
+      double x, y;
+      two_product(e.components[i], f.components[j], x, y);
+      grow(h, y);
+      grow(h, x);
+    }
+  }
+}
+
+inline void difference(double a, double b, Expansion &h) {
+  double x, y;
+  two_diff(a, b, x, y);
+  h.size = 0;
+  grow(h, y);
+  grow(h, x);
+}
+
+// Largest component comes last
+inline int sign(const Expansion &e) {
+  double most_significant = e.size == 0 ? 0.0 : e.components[e.size - 1];
+  return (most_significant > 0) - (most_significant < 0);
+}
+
+// h = a * b - c * d
+inline void cross_term(const Expansion &a, const Expansion &b,
+                       const Expansion &c, const Expansion &d, Expansion &h) {
+  Expansion right;
+  product(a, b, h);
+  product(c, d, right);
+  add(h, right, -1.0);
+}
+
+inline int orient3d_exact(const Vec3 &a, const Vec3 &b, const Vec3 &c,
+                          const Vec3 &d) {
+  Expansion adx, ady, adz, bdx, bdy, bdz, cdx, cdy, cdz;
+  difference(a.x, d.x, adx);
+  difference(a.y, d.y, ady);
+  difference(a.z, d.z, adz);
+  difference(b.x, d.x, bdx);
+  difference(b.y, d.y, bdy);
+  difference(b.z, d.z, bdz);
+  difference(c.x, d.x, cdx);
+  difference(c.y, d.y, cdy);
+  difference(c.z, d.z, cdz);
+
+  Expansion minor, term, det;
+  cross_term(bdx, cdy, cdx, bdy, minor);
+  product(adz, minor, det);
+  cross_term(cdx, ady, adx, cdy, minor);
+  product(bdz, minor, term);
+  add(det, term);
+  cross_term(adx, bdy, bdx, ady, minor);
+  product(cdz, minor, term);
+  add(det, term);
+  return sign(det);
+}
+
+inline int orient2d_exact(double ax, double ay, double bx, double by,
+                          double cx, double cy) {
+  Expansion acx, acy, bcx, bcy, det;
+  difference(ax, cx, acx);
+  difference(ay, cy, acy);
+  difference(bx, cx, bcx);
+  difference(by, cy, bcy);
+  cross_term(acx, bcy, acy, bcx, det);
+  return sign(det);
+}
+} // namespace predicates
+
+/* Sign of (a - d) . ((b - d) x (c - d)), positive when d lies below the plane
+ * through a, b and c (a, b, c appear counterclockwise seen from above) */
+inline int orient3d(const Vec3 &a, const Vec3 &b, const Vec3 &c,
+                    const Vec3 &d) {
+  double adx = double(a.x) - d.x, ady = double(a.y) - d.y,
+         adz = double(a.z) - d.z;
+  double bdx = double(b.x) - d.x, bdy = double(b.y) - d.y,
+         bdz = double(b.z) - d.z;
+  double cdx = double(c.x) - d.x, cdy = double(c.y) - d.y,
+         cdz = double(c.z) - d.z;
+
+  double bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+  double cdxady = cdx * ady, adxcdy = adx * cdy;
+  double adxbdy = adx * bdy, bdxady = bdx * ady;
+
+  double det = adz * (bdxcdy - cdxbdy) + bdz * (cdxady - adxcdy) +
+               cdz * (adxbdy - bdxady);
+  double permanent = (std::abs(bdxcdy) + std::abs(cdxbdy)) * std::abs(adz) +
+                     (std::abs(cdxady) + std::abs(adxcdy)) * std::abs(bdz) +
+                     (std::abs(adxbdy) + std::abs(bdxady)) * std::abs(cdz);
+  double errbound = predicates::ORIENT3D_ERRBOUND * permanent;
+  if (det > errbound) {
+    return 1;
+  }
+  if (-det > errbound) {
+    return -1;
+  }
+  // Repeated points, common for triangles sharing vertices
+  if (a == b || a == c || a == d || b == c || b == d || c == d) {
+    return 0;
+  }
+  return predicates::orient3d_exact(a, b, c, d);
+}
+
+// Sign of the signed area of triangle a, b, c, positive if counterclockwise
+inline int orient2d(double ax, double ay, double bx, double by, double cx,
+                    double cy) {
+  double left = (ax - cx) * (by - cy);
+  double right = (ay - cy) * (bx - cx);
+  double det = left - right;
+  double errbound =
+      predicates::ORIENT2D_ERRBOUND * (std::abs(left) + std::abs(right));
+  if (det > errbound) {
+    return 1;
+  }
+  if (-det > errbound) {
+    return -1;
+  }
+  if ((ax == bx && ay == by) || (ax == cx && ay == cy) ||
+      (bx == cx && by == cy)) {
+    return 0;
+  }
+  return predicates::orient2d_exact(ax, ay, bx, by, cx, cy);
+}
@@ -0,0 +1,76 @@
+/* Parallel least-significant-digit radix sort of unsigned integer keys with
+ * an attached payload, 8 bits per pass.
+ * Each thread histograms and scatters its own contiguous chunk of the input,
+ * so the sort is stable, and passes where every key shares the same digit are
+ * skipped (common for the high bits of Morton codes). */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <omp.h>
+#include <vector>
+
+template <typename Key, typename Value>
+void radix_sort_parallel(std::vector<Key> &keys, std::vector<Value> &values) {
+  const size_t n = keys.size();
+  if (n < 2) {
+    return;
+  }
+
+  std::vector<Key> keys_tmp(n);
+  std::vector<Value> values_tmp(n);
+
+  const int max_threads = omp_get_max_threads();
+  std::vector<size_t> histograms(max_threads * 256);
+
+  for (int shift = 0; shift < int(sizeof(Key) * 8); shift += 8) {
+    bool skip_pass = false;
+
+#pragma omp parallel num_threads(max_threads)
+    {
+      const int tid = omp_get_thread_num();
+      const int num_threads = omp_get_num_threads();
+      const size_t begin = n * tid / num_threads;
+      const size_t end = n * (tid + 1) / num_threads;
+      size_t *histogram = &histograms[tid * 256];
+
+      std::fill(histogram, histogram + 256, 0);
+      for (size_t i = begin; i < end; i++) {
+        histogram[(keys[i] >> shift) & 0xff]++;
+      }
+
+#pragma omp barrier
+#pragma omp single
+      {
+        // Turn per thread counts into per thread scatter offsets
+        size_t offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+          size_t digit_count = 0;
+          for (int t = 0; t < num_threads; t++) {
+            size_t count = histograms[t * 256 + digit];
+            histograms[t * 256 + digit] = offset;
+            offset += count;
+            digit_count += count;
+          }
+          if (digit_count == n) {
+            skip_pass = true;
+          }
+        }
+      }
+
+      if (!skip_pass) {
+        for (size_t i = begin; i < end; i++) {
+          size_t dst = histogram[(keys[i] >> shift) & 0xff]++;
+          keys_tmp[dst] = keys[i];
+          values_tmp[dst] = values[i];
+        }
+      }
+    }
+
+    if (!skip_pass) {
+      keys.swap(keys_tmp);
+      values.swap(values_tmp);
+    }
+  }
+}
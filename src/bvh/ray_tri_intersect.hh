@@ -0,0 +1,179 @@
+/* Watertight ray triangle intersection, see "Watertight Ray/Triangle
+ * Intersection" (Woop et al. 2013).
+ * The ray is turned into a shear transform once, after which every vertex is
+ * mapped to the same 2D point in all the triangles sharing it. The edge
+ * functions are products of floats evaluated in double, so their signs are
+ * exact and opposite for the two triangles sharing an edge. Rays passing
+ * exactly through an edge or a vertex are resolved as if they were moved by an
+ * infinitesimal offset in the sheared plane: every edge is then claimed by
+ * exactly one of the triangles sharing it and the parity of the hit count is
+ * exact on closed meshes. */
+
+#pragma once
+
+#include <cmath>
+#include <utility>
+
+#include "vec3.hh"
+
+// Ray in the frame of the shear transform, see make_watertight_ray
+struct WatertightRay {
+  Vec3 O;
+  // kz is the dominant axis of the direction, kx and ky keep the winding
+  int kx, ky, kz;
+  float Sx, Sy, Sz;
+};
+
+inline WatertightRay make_watertight_ray(const Vec3 &O, const Vec3 &D) {
+  WatertightRay ray;
+  ray.O = O;
+  ray.kz = 0;
+  if (std::abs(D.y) > std::abs(D[ray.kz])) {
+    ray.kz = 1;
+  }
+  if (std::abs(D.z) > std::abs(D[ray.kz])) {
+    ray.kz = 2;
+  }
+  ray.kx = (ray.kz + 1) % 3;
+  ray.ky = (ray.kx + 1) % 3;
+  if (D[ray.kz] < 0.0f) {
+    std::swap(ray.kx, ray.ky);
+  }
+  ray.Sx = D[ray.kx] / D[ray.kz];
+  ray.Sy = D[ray.ky] / D[ray.kz];
+  ray.Sz = 1.0f / D[ray.kz];
+  return ray;
+}
+
+/* Sign of the edge function from p to q for a ray passing exactly through the
+ * edge, as seen by the ray moved by (e, e^2) with e -> 0+ */
+inline double perturbed_edge_sign(float px, float py, float qx, float qy) {
+  if (qy != py) {
+    return qy > py ? 1.0 : -1.0;
+  }
+  if (qx != px) {
+    return qx < px ? 1.0 : -1.0;
+  }
+  return 0.0;
+}
+
+/* Hit test on the sheared vertices (x, y) of a triangle and their scaled
+ * depths z, the ray starts at the origin along +z. t in (0, max_t), hits
+ * exactly at the origin do not count. */
+inline bool watertight_sheared_hit(const float x[3], const float y[3],
+                                   const float z[3], float max_t, float &t) {
+  double u = double(x[2]) * y[1] - double(y[2]) * x[1];
+  double v = double(x[0]) * y[2] - double(y[0]) * x[2];
+  double w = double(x[1]) * y[0] - double(y[1]) * x[0];
+  const double det = u + v + w;
+  if (det == 0.0) {
+    // Degenerate, or the ray lies in the plane of the triangle
+    return false;
+  }
+  const double t_scaled = u * z[0] + v * z[1] + w * z[2];
+
+  // Only the signs matter from here on
+  if (u == 0.0) {
+    u = perturbed_edge_sign(x[1], y[1], x[2], y[2]);
+  }
+  if (v == 0.0) {
+    v = perturbed_edge_sign(x[2], y[2], x[0], y[0]);
+  }
+  if (w == 0.0) {
+    w = perturbed_edge_sign(x[0], y[0], x[1], y[1]);
+  }
+  if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) {
+    return false;
+  }
+  if (u == 0.0 || v == 0.0 || w == 0.0) {
+    return false;
+  }
+  t = float(t_scaled / det);
+  return t_scaled / det > 0.0 && t < max_t;
+}
+
+inline bool watertight_ray_hits_tri(const WatertightRay &ray, const Vec3 &a,
+                                    const Vec3 &b, const Vec3 &c, float max_t,
+                                    float &t) {
+  const Vec3 *vertices[3] = {&a, &b, &c};
+  float x[3], y[3], z[3];
+  for (int i = 0; i < 3; i++) {
+    const Vec3 p = *vertices[i] - ray.O;
+    x[i] = p[ray.kx] - ray.Sx * p[ray.kz];
+    y[i] = p[ray.ky] - ray.Sy * p[ray.kz];
+    z[i] = ray.Sz * p[ray.kz];
+  }
+  return watertight_sheared_hit(x, y, z, max_t, t);
+}
+
+// Number of triangles watertight_ray_tri_batch tests at once
+const int RAY_TRI_BATCH_SIZE = 8;
+
+// Triangles in SoA layout, [vertex][axis][lane]
+struct RayTriBatch {
+  float v[3][3][RAY_TRI_BATCH_SIZE];
+};
+
+/* hits[lane] is 1 when the ray crosses triangle lane at t in (0, max_t), 0
+ * otherwise. The shear and the edge functions of all lanes are evaluated
+ * together, the rare lanes with a zero edge function (the ray passes through
+ * an edge or a vertex) are finished by watertight_sheared_hit. The vertices of
+ * a mesh must all go through the same kernel for a given ray, the scalar
+ * kernel may round the shear differently. */
+inline void watertight_ray_tri_batch(const WatertightRay &ray,
+                                     const RayTriBatch &batch, float max_t,
+                                     float hits[RAY_TRI_BATCH_SIZE]) {
+  const int n = RAY_TRI_BATCH_SIZE;
+  const auto &v = batch.v;
+  const float ox = ray.O[ray.kx], oy = ray.O[ray.ky], oz = ray.O[ray.kz];
+  const float Sx = ray.Sx, Sy = ray.Sy, Sz = ray.Sz;
+
+  // Sheared 2D coordinates and scaled depths, [vertex][lane]
+  float x[3][n], y[3][n], z[3][n];
+  for (int vertex = 0; vertex < 3; vertex++) {
+    const float *px = v[vertex][ray.kx];
+    const float *py = v[vertex][ray.ky];
+    const float *pz = v[vertex][ray.kz];
+#pragma omp simd
+    for (int lane = 0; lane < n; lane++) {
+      float dz = pz[lane] - oz;
+      x[vertex][lane] = (px[lane] - ox) - Sx * dz;
+      y[vertex][lane] = (py[lane] - oy) - Sy * dz;
+      z[vertex][lane] = Sz * dz;
+    }
+  }
+
+  // Bitwise operations on 0/1 values, short circuiting would add branches
+  float ambiguous[n];
+#pragma omp simd
+  for (int lane = 0; lane < n; lane++) {
+    double u = double(x[2][lane]) * y[1][lane] - double(y[2][lane]) * x[1][lane];
+    double v = double(x[0][lane]) * y[2][lane] - double(y[0][lane]) * x[2][lane];
+    double w = double(x[1][lane]) * y[0][lane] - double(y[1][lane]) * x[0][lane];
+    double det = u + v + w;
+    double t_scaled = u * z[0][lane] + v * z[1][lane] + w * z[2][lane];
+    bool has_negative = (u < 0.0) | (v < 0.0) | (w < 0.0);
+    bool has_positive = (u > 0.0) | (v > 0.0) | (w > 0.0);
+    bool has_zero = (u == 0.0) | (v == 0.0) | (w == 0.0);
+    // t in (0, max_t) without dividing, the sign of det flips the range
+    bool in_range = ((det > 0.0) & (t_scaled > 0.0) &
+                     (t_scaled < max_t * det)) |
+                    ((det < 0.0) & (t_scaled < 0.0) &
+                     (t_scaled > max_t * det));
+    bool hit = !(has_negative & has_positive) & !has_zero & in_range;
+    hits[lane] = hit ? 1.0f : 0.0f;
+    ambiguous[lane] = has_zero ? 1.0f : 0.0f;
+  }
+
+  for (int lane = 0; lane < n; lane++) {
+    if (ambiguous[lane] > 0.0f) {
+      float lane_x[3] = {x[0][lane], x[1][lane], x[2][lane]};
+      float lane_y[3] = {y[0][lane], y[1][lane], y[2][lane]};
+      float lane_z[3] = {z[0][lane], z[1][lane], z[2][lane]};
+      float t;
+      hits[lane] =
+          watertight_sheared_hit(lane_x, lane_y, lane_z, max_t, t) ? 1.0f
+                                                                   : 0.0f;
+    }
+  }
+}
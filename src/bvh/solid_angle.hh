@@ -0,0 +1,155 @@
+/* Exact generalized winding numbers summed over every triangle, batches of
+ * triangles in SoA layout evaluated with one vectorized solid angle kernel.
+ * The per triangle terms are computed in float like tri_half_solid_angle,
+ * with a polynomial atan2 in place of the scalar libm call, and accumulated
+ * in double so the sum over millions of triangles does not drift. The sqrt
+ * calls only vectorize without errno, the bvh target sets -fno-math-errno. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bvh.hh"
+#include "vec3.hh"
+
+// Number of triangles tri_half_solid_angle_batch evaluates at once
+const int SOLID_ANGLE_BATCH_SIZE = 8;
+
+// Triangles in SoA layout, [vertex][axis][lane]
+struct SolidAngleBatch {
+  float v[3][3][SOLID_ANGLE_BATCH_SIZE];
+};
+
+/* atan2(y, x) without branches or libm calls so it vectorizes: a minimax
+ * polynomial of atan on [0, 1] (Abramowitz and Stegun 4.4.49, error below
+ * 2e-8 rad) applied to min(|x|, |y|) / max(|x|, |y|) and moved to the right
+ * octant. Below 1e-6 rad from std::atan2 once float rounding is included,
+ * atan2(0, 0) is 0. The octant fixups are blends by 0 / 1 factors rather than
+ * selects, GCC turns selects with arithmetic on one side into branches and
+ * the loop calling this no longer vectorizes. */
+inline float atan2_approx(float y, float x) {
+  const float ax = std::fabs(x), ay = std::fabs(y);
+  const float hi = ax > ay ? ax : ay;
+  const float lo = ax > ay ? ay : ax;
+  const float t = lo / (hi + 1e-30f);
+  const float t2 = t * t;
+  float r = -0.0040540580f;
+  r = r * t2 + 0.0218612288f;
+  r = r * t2 - 0.0559098861f;
+  r = r * t2 + 0.0964200441f;
+  r = r * t2 - 0.1390853351f;
+  r = r * t2 + 0.1994653599f;
+  r = r * t2 - 0.3332985605f;
+  r = r * t2 + 0.9999993329f;
+  r *= t;
+  const float steep = ay > ax;
+  r += steep * (1.57079632679f - 2.0f * r);
+  const float negative_x = x < 0.0f;
+  r += negative_x * (3.14159265359f - 2.0f * r);
+  return std::copysign(r, y);
+}
+
+// Half the solid angles every triangle of the batch subtends at p, the
+// formula of tri_half_solid_angle
+inline void tri_half_solid_angle_batch(const Vec3 &p,
+                                       const SolidAngleBatch &batch,
+                                       float out[SOLID_ANGLE_BATCH_SIZE]) {
+  const float px = p.x, py = p.y, pz = p.z;
+  const auto &v = batch.v;
+#pragma omp simd
+  for (int lane = 0; lane < SOLID_ANGLE_BATCH_SIZE; lane++) {
+    float ax = v[0][0][lane] - px, ay = v[0][1][lane] - py,
+          az = v[0][2][lane] - pz;
+    float bx = v[1][0][lane] - px, by = v[1][1][lane] - py,
+          bz = v[1][2][lane] - pz;
+    float cx = v[2][0][lane] - px, cy = v[2][1][lane] - py,
+          cz = v[2][2][lane] - pz;
+    float al = std::sqrt(ax * ax + ay * ay + az * az);
+    float bl = std::sqrt(bx * bx + by * by + bz * bz);
+    float cl = std::sqrt(cx * cx + cy * cy + cz * cz);
+    float determinant = ax * (by * cz - bz * cy) + ay * (bz * cx - bx * cz) +
+                        az * (bx * cy - by * cx);
+    float denominator = al * bl * cl + (ax * bx + ay * by + az * bz) * cl +
+                        (ax * cx + ay * cy + az * cz) * bl +
+                        (bx * cx + by * cy + bz * cz) * al;
+    out[lane] = atan2_approx(determinant, denominator);
+  }
+}
+
+class SolidAngleTriangles {
+private:
+  std::vector<SolidAngleBatch> batches_;
+  size_t size_ = 0;
+
+public:
+  SolidAngleTriangles() = default;
+
+  explicit SolidAngleTriangles(const std::vector<BVHTriangle> &tris) {
+    batches_.reserve((tris.size() + SOLID_ANGLE_BATCH_SIZE - 1) /
+                     SOLID_ANGLE_BATCH_SIZE);
+    for (const auto &tri : tris) {
+      add(tri.a, tri.b, tri.c);
+    }
+  }
+
+  void add(const Vec3 &a, const Vec3 &b, const Vec3 &c) {
+    const int lane = size_ % SOLID_ANGLE_BATCH_SIZE;
+    if (lane == 0) {
+      batches_.push_back({});
+    }
+    SolidAngleBatch &batch = batches_.back();
+    const Vec3 *verts[3] = {&a, &b, &c};
+    for (int vert = 0; vert < 3; vert++) {
+      for (int axis = 0; axis < 3; axis++) {
+        batch.v[vert][axis][lane] = (*verts[vert])[axis];
+      }
+    }
+    size_++;
+  }
+
+  size_t size() const { return size_; }
+  const std::vector<SolidAngleBatch> &batches() const { return batches_; }
+
+  // Sum of the half solid angles of the triangles of batches [begin, end)
+  double half_solid_angle_sum(const Vec3 &p, size_t begin, size_t end) const {
+    double sums[SOLID_ANGLE_BATCH_SIZE] = {};
+    float half_angles[SOLID_ANGLE_BATCH_SIZE];
+    for (size_t i = begin; i < end; i++) {
+      tri_half_solid_angle_batch(p, batches_[i], half_angles);
+      // Skips the unused lanes of the last batch
+      const size_t lanes = std::min(size_ - i * SOLID_ANGLE_BATCH_SIZE,
+                                    size_t(SOLID_ANGLE_BATCH_SIZE));
+      if (lanes < SOLID_ANGLE_BATCH_SIZE) {
+        for (size_t lane = 0; lane < lanes; lane++) {
+          sums[lane] += half_angles[lane];
+        }
+        continue;
+      }
+#pragma omp simd
+      for (int lane = 0; lane < SOLID_ANGLE_BATCH_SIZE; lane++) {
+        sums[lane] += half_angles[lane];
+      }
+    }
+    double sum = 0.0;
+    for (int lane = 0; lane < SOLID_ANGLE_BATCH_SIZE; lane++) {
+      sum += sums[lane];
+    }
+    return sum;
+  }
+
+  // Sum over every triangle, 2 * PI times the winding number
+  double half_solid_angle_sum(const Vec3 &p) const {
+    return half_solid_angle_sum(p, 0, batches_.size());
+  }
+
+  // ~1 inside and ~0 outside a closed mesh
+  double winding_number(const Vec3 &p) const {
+    return half_solid_angle_sum(p) / (2.0 * 3.14159265358979323846);
+  }
+
+  size_t memory_bytes() const {
+    return batches_.size() * sizeof(SolidAngleBatch);
+  }
+};
@@ -0,0 +1,46 @@
+/* Triangle against axis aligned box overlap test, by separating axes: the box
+ * face normals, the triangle normal and the 9 cross products of box and
+ * triangle edges, see "Fast 3D Triangle-Box Overlap Testing" (Akenine-Moller
+ * 2001). Touching counts as overlapping, like BBox::does_overlap. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "vec3.hh"
+
+inline bool tri_box_overlap(const Vec3 &box_min, const Vec3 &box_max,
+                            const Vec3 &a, const Vec3 &b, const Vec3 &c) {
+  const Vec3 center = (box_min + box_max) * 0.5f;
+  const Vec3 half = (box_max - box_min) * 0.5f;
+  const Vec3 v[3] = {a - center, b - center, c - center};
+
+  // Projections of the triangle and the box on axis do not overlap
+  auto separated = [&](const Vec3 &axis) {
+    float p0 = dot(axis, v[0]), p1 = dot(axis, v[1]), p2 = dot(axis, v[2]);
+    float r = half.x * std::abs(axis.x) + half.y * std::abs(axis.y) +
+              half.z * std::abs(axis.z);
+    return std::min({p0, p1, p2}) > r || std::max({p0, p1, p2}) < -r;
+  };
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (std::min({v[0][axis], v[1][axis], v[2][axis]}) > half[axis] ||
+        std::max({v[0][axis], v[1][axis], v[2][axis]}) < -half[axis]) {
+      return false;
+    }
+  }
+
+  const Vec3 edges[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+  if (separated(cross(edges[0], edges[1]))) {
+    return false;
+  }
+  for (const Vec3 &edge : edges) {
+    if (separated(Vec3(0.0f, -edge.z, edge.y)) ||
+        separated(Vec3(edge.z, 0.0f, -edge.x)) ||
+        separated(Vec3(-edge.y, edge.x, 0.0f))) {
+      return false;
+    }
+  }
+  return true;
+}
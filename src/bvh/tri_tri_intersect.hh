@@ -0,0 +1,341 @@
+/* Exact triangle-triangle intersection test returning the intersection
+ * segment.
+ * Like Moller's test, pairs are first rejected when one triangle lies
+ * strictly on one side of the other's plane. Survivors intersect iff an edge
+ * of one triangle crosses the other (the endpoints of the intersection
+ * segment lie on triangle edges), all decided with the filtered exact
+ * predicates in predicates.hh. Only the segment itself is constructed in
+ * floating point. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "predicates.hh"
+#include "vec3.hh"
+
+struct TriTriSegment {
+  Vec3 source, target;
+  // Triangles lie in the same plane, the intersection is a polygon and no
+  // segment is computed
+  bool coplanar = false;
+};
+
+namespace tri_tri {
+struct Point2 {
+  double x, y;
+};
+
+// Axis to drop when projecting the triangle on a coordinate plane, the one
+// along the largest component of its normal
+inline int projection_axis(const Vec3 &p, const Vec3 &q, const Vec3 &r) {
+  Vec3 n = cross(q - p, r - p);
+  float ax = std::abs(n.x), ay = std::abs(n.y), az = std::abs(n.z);
+  if (ax >= ay && ax >= az) {
+    return 0;
+  }
+  return ay >= az ? 1 : 2;
+}
+
+inline Point2 project(const Vec3 &v, int axis) {
+  if (axis == 0) {
+    return {v.y, v.z};
+  }
+  if (axis == 1) {
+    return {v.z, v.x};
+  }
+  return {v.x, v.y};
+}
+
+inline int orient(const Point2 &a, const Point2 &b, const Point2 &c) {
+  return orient2d(a.x, a.y, b.x, b.y, c.x, c.y);
+}
+
+// c is collinear with a and b, checks it lies between them
+inline bool on_segment(const Point2 &a, const Point2 &b, const Point2 &c) {
+  return std::min(a.x, b.x) <= c.x && c.x <= std::max(a.x, b.x) &&
+         std::min(a.y, b.y) <= c.y && c.y <= std::max(a.y, b.y);
+}
+
+inline bool segments_intersect(const Point2 &a, const Point2 &b,
+                               const Point2 &c, const Point2 &d) {
+  int o1 = orient(a, b, c), o2 = orient(a, b, d);
+  int o3 = orient(c, d, a), o4 = orient(c, d, b);
+  if (o1 * o2 < 0 && o3 * o4 < 0) {
+    return true;
+  }
+  return (o1 == 0 && on_segment(a, b, c)) || (o2 == 0 && on_segment(a, b, d)) ||
+         (o3 == 0 && on_segment(c, d, a)) || (o4 == 0 && on_segment(c, d, b));
+}
+
+inline bool point_in_triangle(const Point2 &p, const Point2 t[3]) {
+  if (orient(t[0], t[1], t[2]) == 0) {
+    // Degenerate, edge tests cover it
+    return false;
+  }
+  int o1 = orient(t[0], t[1], p), o2 = orient(t[1], t[2], p),
+      o3 = orient(t[2], t[0], p);
+  return (o1 >= 0 && o2 >= 0 && o3 >= 0) || (o1 <= 0 && o2 <= 0 && o3 <= 0);
+}
+
+inline bool segment_intersects_triangle(const Point2 &a, const Point2 &b,
+                                        const Point2 t[3]) {
+  for (int i = 0; i < 3; i++) {
+    if (segments_intersect(a, b, t[i], t[(i + 1) % 3])) {
+      return true;
+    }
+  }
+  return point_in_triangle(a, t);
+}
+
+inline bool triangles_intersect(const Point2 t1[3], const Point2 t2[3]) {
+  for (int i = 0; i < 3; i++) {
+    if (segment_intersects_triangle(t1[i], t1[(i + 1) % 3], t2)) {
+      return true;
+    }
+  }
+  return point_in_triangle(t2[0], t1);
+}
+
+/* Checks whether any edge of triangle t touching the plane of triangle other
+ * (sides holds the orient3d signs of t's vertices against that plane) hits
+ * other. */
+inline bool edges_hit_triangle(const Vec3 *const t[3], const int sides[3],
+                               const Vec3 *const other[3]) {
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    if (sides[i] * sides[j] > 0) {
+      continue;
+    }
+    const Vec3 &e0 = *t[i], &e1 = *t[j];
+    if (sides[i] == 0 && sides[j] == 0) {
+      // Edge lies in the other plane
+      int axis = projection_axis(*other[0], *other[1], *other[2]);
+      Point2 o[3] = {project(*other[0], axis), project(*other[1], axis),
+                     project(*other[2], axis)};
+      if (segment_intersects_triangle(project(e0, axis), project(e1, axis),
+                                      o)) {
+        return true;
+      }
+      continue;
+    }
+    // The edge reaches the plane, check where its line pierces the triangle
+    int o1 = orient3d(e0, e1, *other[0], *other[1]);
+    int o2 = orient3d(e0, e1, *other[1], *other[2]);
+    int o3 = orient3d(e0, e1, *other[2], *other[0]);
+    if ((o1 >= 0 && o2 >= 0 && o3 >= 0) || (o1 <= 0 && o2 <= 0 && o3 <= 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Segment where triangle t meets the plane through p with normal n
+inline void plane_segment(const Vec3 *const t[3], const int sides[3],
+                          const Vec3 &p, const double n[3], double out[2][3],
+                          int &num_points) {
+  double distances[3];
+  for (int i = 0; i < 3; i++) {
+    double d = n[0] * (double(t[i]->x) - p.x) +
+               n[1] * (double(t[i]->y) - p.y) +
+               n[2] * (double(t[i]->z) - p.z);
+    // Keep the rounded distance consistent with the exact side, orient3d is
+    // positive below the plane
+    if ((d > 0) - (d < 0) != -sides[i]) {
+      d = -sides[i] * 1e-300;
+    }
+    distances[i] = d;
+  }
+
+  num_points = 0;
+  for (int i = 0; i < 3 && num_points < 2; i++) {
+    if (sides[i] == 0) {
+      out[num_points][0] = t[i]->x;
+      out[num_points][1] = t[i]->y;
+      out[num_points][2] = t[i]->z;
+      num_points++;
+    }
+  }
+  for (int i = 0; i < 3 && num_points < 2; i++) {
+    int j = (i + 1) % 3;
+    if (sides[i] * sides[j] < 0) {
+      double s = distances[i] / (distances[i] - distances[j]);
+      for (int axis = 0; axis < 3; axis++) {
+        double a = (*t[i])[axis], b = (*t[j])[axis];
+        out[num_points][axis] = a + (b - a) * s;
+      }
+      num_points++;
+    }
+  }
+  if (num_points == 1) {
+    for (int axis = 0; axis < 3; axis++) {
+      out[1][axis] = out[0][axis];
+    }
+  }
+}
+
+inline void normal(const Vec3 *const t[3], double n[3]) {
+  double u[3], v[3];
+  for (int axis = 0; axis < 3; axis++) {
+    u[axis] = double((*t[1])[axis]) - (*t[0])[axis];
+    v[axis] = double((*t[2])[axis]) - (*t[0])[axis];
+  }
+  n[0] = u[1] * v[2] - u[2] * v[1];
+  n[1] = u[2] * v[0] - u[0] * v[2];
+  n[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+/* Both triangles are known to intersect along a line, overlaps the two plane
+ * segments along that line */
+inline void construct_segment(const Vec3 *const t1[3], const int sides1[3],
+                              const Vec3 *const t2[3], const int sides2[3],
+                              TriTriSegment &out) {
+  double n1[3], n2[3];
+  normal(t1, n1);
+  normal(t2, n2);
+
+  double s1[2][3], s2[2][3];
+  int num_points1, num_points2;
+  plane_segment(t1, sides1, *t2[0], n2, s1, num_points1);
+  plane_segment(t2, sides2, *t1[0], n1, s2, num_points2);
+
+  double direction[3] = {n1[1] * n2[2] - n1[2] * n2[1],
+                         n1[2] * n2[0] - n1[0] * n2[2],
+                         n1[0] * n2[1] - n1[1] * n2[0]};
+  auto param = [&](const double p[3]) {
+    return direction[0] * p[0] + direction[1] * p[1] + direction[2] * p[2];
+  };
+
+  // Sort both segments along the line
+  double t_s1[2] = {param(s1[0]), param(s1[1])};
+  double t_s2[2] = {param(s2[0]), param(s2[1])};
+  int lo1 = t_s1[0] <= t_s1[1] ? 0 : 1, lo2 = t_s2[0] <= t_s2[1] ? 0 : 1;
+
+  const double *source = t_s1[lo1] >= t_s2[lo2] ? s1[lo1] : s2[lo2];
+  const double *target =
+      t_s1[1 - lo1] <= t_s2[1 - lo2] ? s1[1 - lo1] : s2[1 - lo2];
+  if (param(source) > param(target)) {
+    // Touching in a single point, lost to rounding
+    target = source;
+  }
+
+  out.source = Vec3(source[0], source[1], source[2]);
+  out.target = Vec3(target[0], target[1], target[2]);
+  out.coplanar = false;
+}
+} // namespace tri_tri
+
+inline bool intersect_tri_tri(const Vec3 &p1, const Vec3 &q1, const Vec3 &r1,
+                              const Vec3 &p2, const Vec3 &q2, const Vec3 &r2,
+                              TriTriSegment &out) {
+  const Vec3 *t1[3] = {&p1, &q1, &r1};
+  const Vec3 *t2[3] = {&p2, &q2, &r2};
+
+  int sides1[3], sides2[3];
+  for (int i = 0; i < 3; i++) {
+    sides1[i] = orient3d(p2, q2, r2, *t1[i]);
+  }
+  if ((sides1[0] > 0 && sides1[1] > 0 && sides1[2] > 0) ||
+      (sides1[0] < 0 && sides1[1] < 0 && sides1[2] < 0)) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    sides2[i] = orient3d(p1, q1, r1, *t2[i]);
+  }
+  if ((sides2[0] > 0 && sides2[1] > 0 && sides2[2] > 0) ||
+      (sides2[0] < 0 && sides2[1] < 0 && sides2[2] < 0)) {
+    return false;
+  }
+
+  if (sides1[0] == 0 && sides1[1] == 0 && sides1[2] == 0) {
+    int axis = tri_tri::projection_axis(p1, q1, r1);
+    tri_tri::Point2 a[3] = {tri_tri::project(p1, axis),
+                            tri_tri::project(q1, axis),
+                            tri_tri::project(r1, axis)};
+    tri_tri::Point2 b[3] = {tri_tri::project(p2, axis),
+                            tri_tri::project(q2, axis),
+                            tri_tri::project(r2, axis)};
+    out = TriTriSegment();
+    out.coplanar = true;
+    return tri_tri::triangles_intersect(a, b);
+  }
+
+  if (!tri_tri::edges_hit_triangle(t1, sides1, t2) &&
+      !tri_tri::edges_hit_triangle(t2, sides2, t1)) {
+    return false;
+  }
+
+  tri_tri::construct_segment(t1, sides1, t2, sides2, out);
+  return true;
+}
+
+// Number of triangle pairs reject_tri_tri_batch evaluates at once
+const int TRI_TRI_BATCH_SIZE = 8;
+
+/* Flags the pairs (a[i], b[i]) where one triangle certainly lies strictly on
+ * one side of the other's plane, using the filtered orient3d determinant
+ * evaluated for TRI_TRI_BATCH_SIZE pairs at a time in SoA layout so the
+ * compiler vectorizes across pairs. Pairs left unflagged need the exact test.
+ * Triangle must expose its vertices through operator[]. */
+template <typename Triangle>
+void reject_tri_tri_batch(const Triangle *const *a, const Triangle *const *b,
+                          int n, bool *separated) {
+  for (int first = 0; first < n; first += TRI_TRI_BATCH_SIZE) {
+    const int count = std::min(TRI_TRI_BATCH_SIZE, n - first);
+
+    // [triangle][vertex][axis][lane]
+    double v[2][3][3][TRI_TRI_BATCH_SIZE];
+    for (int lane = 0; lane < TRI_TRI_BATCH_SIZE; lane++) {
+      // Pad the tail by repeating the last pair
+      int i = first + std::min(lane, count - 1);
+      for (int vi = 0; vi < 3; vi++) {
+        for (int axis = 0; axis < 3; axis++) {
+          v[0][vi][axis][lane] = (*a[i])[vi][axis];
+          v[1][vi][axis][lane] = (*b[i])[vi][axis];
+        }
+      }
+    }
+
+    bool lane_separated[TRI_TRI_BATCH_SIZE];
+#pragma omp simd
+    for (int lane = 0; lane < TRI_TRI_BATCH_SIZE; lane++) {
+      bool any_separated = false;
+      for (int t = 0; t < 2; t++) {
+        // Vertices of triangle 1 - t against the plane of triangle t
+        const int other = 1 - t;
+        int num_positive = 0, num_negative = 0;
+        for (int vi = 0; vi < 3; vi++) {
+          double adx = v[t][0][0][lane] - v[other][vi][0][lane];
+          double ady = v[t][0][1][lane] - v[other][vi][1][lane];
+          double adz = v[t][0][2][lane] - v[other][vi][2][lane];
+          double bdx = v[t][1][0][lane] - v[other][vi][0][lane];
+          double bdy = v[t][1][1][lane] - v[other][vi][1][lane];
+          double bdz = v[t][1][2][lane] - v[other][vi][2][lane];
+          double cdx = v[t][2][0][lane] - v[other][vi][0][lane];
+          double cdy = v[t][2][1][lane] - v[other][vi][1][lane];
+          double cdz = v[t][2][2][lane] - v[other][vi][2][lane];
+
+          double bdxcdy = bdx * cdy, cdxbdy = cdx * bdy;
+          double cdxady = cdx * ady, adxcdy = adx * cdy;
+          double adxbdy = adx * bdy, bdxady = bdx * ady;
+          double det = adz * (bdxcdy - cdxbdy) + bdz * (cdxady - adxcdy) +
+                       cdz * (adxbdy - bdxady);
+          double permanent =
+              (std::abs(bdxcdy) + std::abs(cdxbdy)) * std::abs(adz) +
+              (std::abs(cdxady) + std::abs(adxcdy)) * std::abs(bdz) +
+              (std::abs(adxbdy) + std::abs(bdxady)) * std::abs(cdz);
+          double errbound = predicates::ORIENT3D_ERRBOUND * permanent;
+          num_positive += det > errbound;
+          num_negative += -det > errbound;
+        }
+        any_separated |= (num_positive == 3) || (num_negative == 3);
+      }
+      lane_separated[lane] = any_separated;
+    }
+
+    for (int lane = 0; lane < count; lane++) {
+      separated[first + lane] = lane_separated[lane];
+    }
+  }
+}
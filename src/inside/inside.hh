@@ -0,0 +1,177 @@
+/* Point in mesh classification behind a single interface, so the inside tests
+ * of the apps (BVH ray parity, winding numbers, Embree and CGAL ray votes,
+ * fast winding numbers) can be swapped and compared on the same points.
+ * Backends are created by name from a Registry, the ones built on this tree
+ * are registered by register_bvh_backends (inside_bvh.hh), the apps register
+ * the ones depending on Embree, CGAL or libigl. */
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stl_io.hh"
+#include "vec3.hh"
+
+namespace mp::inside {
+
+/* Backends are held through the unique_ptr of Registry::make and are neither
+ * copied nor moved: several keep acceleration structures pointing into their
+ * own members (BVHs over their triangle copies, Embree scenes over their
+ * welded buffers), which a copy or move would leave dangling. */
+class Backend {
+public:
+  Backend() = default;
+  Backend(const Backend &) = delete;
+  Backend &operator=(const Backend &) = delete;
+  virtual ~Backend() = default;
+
+  // inside[i] is set to 1 when points[i] is inside the mesh, 0 otherwise.
+  // Implementations classify the points in parallel
+  virtual void classify(const std::vector<Vec3> &points,
+                        std::vector<char> &inside) const = 0;
+};
+
+using Factory = std::function<std::unique_ptr<Backend>(
+    const std::vector<mp::io::stl::Triangle> &tris)>;
+
+class Registry {
+private:
+  // In registration order, names() lists them the same way
+  std::vector<std::pair<std::string, Factory>> factories_;
+
+public:
+  void add(const std::string &name, Factory factory) {
+    for (auto &entry : factories_) {
+      if (entry.first == name) {
+        entry.second = std::move(factory);
+        return;
+      }
+    }
+    factories_.push_back({name, std::move(factory)});
+  }
+
+  bool contains(const std::string &name) const {
+    for (const auto &entry : factories_) {
+      if (entry.first == name) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::string> names() const {
+    std::vector<std::string> out;
+    for (const auto &entry : factories_) {
+      out.push_back(entry.first);
+    }
+    return out;
+  }
+
+  // Builds the named backend for tris, the triangles must outlive it
+  std::unique_ptr<Backend>
+  make(const std::string &name,
+       const std::vector<mp::io::stl::Triangle> &tris) const {
+    for (const auto &entry : factories_) {
+      if (entry.first == name) {
+        return entry.second(tris);
+      }
+    }
+    throw "Unknown inside backend";
+  }
+};
+
+/* Grid points covering the bounding box of a mesh: ceil(extent / step) points
+ * per axis starting at the minimum corner, as in mcpip_embree */
+struct Grid {
+  Vec3 origin;
+  float step;
+  int num_x = 0, num_y = 0, num_z = 0;
+
+  Grid(const std::vector<mp::io::stl::Triangle> &tris, float step)
+      : step(step) {
+    Vec3 bb_min(INFINITY, INFINITY, INFINITY);
+    Vec3 bb_max(-INFINITY, -INFINITY, -INFINITY);
+    for (const auto &tri : tris) {
+      for (int i = 0; i < 3; i++) {
+        Vec3 v(tri.verts[i]);
+        bb_min.min(v);
+        bb_max.max(v);
+      }
+    }
+    if (tris.empty()) {
+      return;
+    }
+    origin = bb_min;
+    Vec3 bb_dims = bb_max - bb_min;
+    num_x = std::ceil(bb_dims.x / step);
+    num_y = std::ceil(bb_dims.y / step);
+    num_z = std::ceil(bb_dims.z / step);
+  }
+
+  int64_t size() const { return int64_t(num_x) * num_y * num_z; }
+
+  Vec3 point(int i, int j, int k) const {
+    return Vec3(origin.x + i * step, origin.y + j * step, origin.z + k * step);
+  }
+
+  // The points of the y layers [first_layer, first_layer + num_layers), x
+  // fastest, then y, then z
+  void layer_points(int first_layer, int num_layers,
+                    std::vector<Vec3> &out) const {
+    out.clear();
+    out.reserve(int64_t(num_x) * num_layers * num_z);
+    for (int k = 0; k < num_z; k++) {
+      for (int j = first_layer; j < first_layer + num_layers; j++) {
+        for (int i = 0; i < num_x; i++) {
+          out.push_back(point(i, j, k));
+        }
+      }
+    }
+  }
+
+  // x fastest, then y, then z
+  std::vector<Vec3> points() const {
+    std::vector<Vec3> out;
+    layer_points(0, num_y, out);
+    return out;
+  }
+};
+
+// Appends the points classified inside to file as N * 3 floats, the .pts
+// format of the apps. Returns the number of points written
+inline int64_t write_points(std::ostream &file,
+                            const std::vector<Vec3> &points,
+                            const std::vector<char> &inside) {
+  int64_t num_written = 0;
+  for (size_t i = 0; i < points.size(); i++) {
+    if (inside[i]) {
+      const float xyz[3] = {points[i].x, points[i].y, points[i].z};
+      file.write(reinterpret_cast<const char *>(xyz), sizeof(xyz));
+      num_written++;
+    }
+  }
+  if (!file) {
+    throw "Cannot write output file";
+  }
+  return num_written;
+}
+
+inline int64_t write_points(const char *filepath,
+                            const std::vector<Vec3> &points,
+                            const std::vector<char> &inside) {
+  std::ofstream file(filepath, std::ios::binary);
+  if (!file) {
+    throw "Cannot open output file";
+  }
+  return write_points(file, points, inside);
+}
+
+} // namespace mp::inside
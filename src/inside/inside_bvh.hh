@@ -0,0 +1,116 @@
+/* Inside backends built on this tree only */
+
+#pragma once
+
+#include <vector>
+
+#include "bvh.hh"
+#include "fast_winding_number.hh"
+#include "inside.hh"
+#include "solid_angle.hh"
+#include "vec3.hh"
+
+namespace mp::inside {
+
+inline std::vector<BVHTriangle>
+to_bvh_triangles(const std::vector<mp::io::stl::Triangle> &tris) {
+  std::vector<BVHTriangle> out;
+  out.reserve(tris.size());
+  for (const auto &t : tris) {
+    out.push_back({t.verts[0], t.verts[1], t.verts[2]});
+  }
+  return out;
+}
+
+/* Parity of the BVH ray hits, majority of up to 3 skewed rays like the
+ * RayParity sign of SDFVolume. Exact on closed meshes. */
+class BVHParityBackend : public Backend {
+private:
+  std::vector<BVHTriangle> tris_;
+  BVH bvh_;
+
+public:
+  BVHParityBackend(const std::vector<mp::io::stl::Triangle> &tris)
+      : tris_(to_bvh_triangles(tris)), bvh_(tris_, {BVHBuildMethod::LBVH}) {}
+
+  void classify(const std::vector<Vec3> &points,
+                std::vector<char> &inside) const override {
+    static const Vec3 directions[3] = {Vec3(1.0f, 0.37f, 0.21f).normalized(),
+                                       Vec3(-0.29f, 1.0f, 0.43f).normalized(),
+                                       Vec3(0.31f, -0.47f, 1.0f).normalized()};
+    inside.resize(points.size());
+#pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < points.size(); i++) {
+      int votes = 0;
+      for (int r = 0; r < 3; r++) {
+        BVHRay ray;
+        ray.O = points[i];
+        ray.D = directions[r];
+        votes += bvh_.count_ray_hits(ray) % 2;
+        if (r == 1 && votes != 1) {
+          break;
+        }
+      }
+      inside[i] = votes >= 2;
+    }
+  }
+};
+
+/* Generalized winding number summed over every triangle with the vectorized
+ * solid angle kernel, the reference for open and self intersecting meshes,
+ * O(triangles) per point */
+class WindingNumberBackend : public Backend {
+private:
+  SolidAngleTriangles tris_;
+
+public:
+  WindingNumberBackend(const std::vector<mp::io::stl::Triangle> &tris)
+      : tris_(to_bvh_triangles(tris)) {}
+
+  void classify(const std::vector<Vec3> &points,
+                std::vector<char> &inside) const override {
+    inside.resize(points.size());
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < points.size(); i++) {
+      inside[i] = tris_.winding_number(points[i]) >= 0.5;
+    }
+  }
+};
+
+// Winding numbers with the far field of distant BVH nodes approximated
+class FastWindingNumberBVHBackend : public Backend {
+private:
+  std::vector<BVHTriangle> tris_;
+  BVH bvh_;
+  FastWindingNumber fwn_;
+
+public:
+  FastWindingNumberBVHBackend(const std::vector<mp::io::stl::Triangle> &tris,
+                              float beta = 2.0f)
+      : tris_(to_bvh_triangles(tris)), bvh_(tris_, {BVHBuildMethod::LBVH}),
+        fwn_(tris_, bvh_, beta) {}
+
+  void classify(const std::vector<Vec3> &points,
+                std::vector<char> &inside) const override {
+    std::vector<float> winding_numbers;
+    fwn_.winding_numbers(points, winding_numbers);
+    inside.resize(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+      inside[i] = winding_numbers[i] >= 0.5f;
+    }
+  }
+};
+
+inline void register_bvh_backends(Registry &registry) {
+  registry.add("bvh_parity", [](const auto &tris) {
+    return std::make_unique<BVHParityBackend>(tris);
+  });
+  registry.add("winding", [](const auto &tris) {
+    return std::make_unique<WindingNumberBackend>(tris);
+  });
+  registry.add("fast_winding", [](const auto &tris) {
+    return std::make_unique<FastWindingNumberBVHBackend>(tris);
+  });
+}
+
+} // namespace mp::inside
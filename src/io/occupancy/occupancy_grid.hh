@@ -0,0 +1,374 @@
+/* Occupancy grid file: one bit per grid point instead of 12 bytes per inside
+ * point. The header holds the grid origin, step and dimensions, followed by
+ * the grid either as raw bits or run length encoded.
+ *
+ * The grid is stored y layer by y layer (the points sharing j), so a program
+ * classifying the grid in slabs of layers writes each slab as soon as it is
+ * done, see OccupancyGridWriter.
+ *
+ * Raw bits: each z column (i, j) is padded to whole bytes, column
+ * j * num_x + i starts at byte (j * num_x + i) * column_bytes, point k is bit
+ * k % 8 of byte k / 8 of its column.
+ *
+ * Run length: num_y + 1 byte offsets of the y layers relative to the end of
+ * the offset table, then each layer as its num_x columns. A column is a
+ * sequence of LEB128 run lengths alternating outside and inside points,
+ * starting with outside (possibly an empty run), that add up to num_z.
+ *
+ * Version 1 stored x layers and is not read anymore. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace mp::io::occupancy {
+
+enum class Encoding : uint32_t {
+  Bits = 0,
+  RunLength = 1,
+};
+
+struct Header {
+  char magic[4] = {'O', 'C', 'C', 'G'};
+  uint32_t version = 2;
+  Encoding encoding = Encoding::Bits;
+  float origin[3] = {0.0f, 0.0f, 0.0f};
+  float step = 0.0f;
+  int32_t num_x = 0, num_y = 0, num_z = 0;
+};
+static_assert(sizeof(Header) == 40, "Header is written as is");
+
+inline size_t column_bytes(const Header &header) {
+  return (size_t(header.num_z) + 7) / 8;
+}
+
+// Raw bits of one y layer, its num_x columns
+inline size_t layer_bytes(const Header &header) {
+  return size_t(header.num_x) * column_bytes(header);
+}
+
+inline void put_varint(std::vector<uint8_t> &out, uint32_t value) {
+  while (value >= 0x80) {
+    out.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(uint8_t(value));
+}
+
+inline uint32_t get_varint(const uint8_t *&in, const uint8_t *end) {
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (in == end) {
+      break;
+    }
+    const uint8_t byte = *in++;
+    value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  throw "Corrupt run length";
+}
+
+// Appends the run lengths of the layer with raw bits layer to out
+inline void encode_layer(const Header &header, const uint8_t *layer,
+                         std::vector<uint8_t> &out) {
+  const int num_z = header.num_z;
+  for (int i = 0; i < header.num_x; i++) {
+    const uint8_t *column = layer + i * column_bytes(header);
+    bool inside = false;
+    uint32_t run = 0;
+    for (int k = 0; k < num_z;) {
+      // Whole bytes continuing the run
+      if ((k & 7) == 0 && k + 8 <= num_z &&
+          column[k >> 3] == (inside ? 0xff : 0x00)) {
+        run += 8;
+        k += 8;
+        continue;
+      }
+      if (bool((column[k >> 3] >> (k & 7)) & 1) != inside) {
+        put_varint(out, run);
+        inside = !inside;
+        run = 0;
+      }
+      run++;
+      k++;
+    }
+    if (num_z > 0) {
+      put_varint(out, run);
+    }
+  }
+}
+
+// Sets the bits of the inside points of the run lengths [in, end) in layer,
+// which starts out all outside
+inline void decode_layer(const Header &header, const uint8_t *in,
+                         const uint8_t *end, uint8_t *layer) {
+  for (int i = 0; i < header.num_x; i++) {
+    uint8_t *column = layer + i * column_bytes(header);
+    bool inside = false;
+    int k = 0;
+    while (k < header.num_z) {
+      const uint32_t run = get_varint(in, end);
+      if (run > uint32_t(header.num_z - k)) {
+        throw "Corrupt run length";
+      }
+      if (inside) {
+        for (uint32_t r = 0; r < run; r++, k++) {
+          column[k >> 3] |= uint8_t(1) << (k & 7);
+        }
+      } else {
+        k += run;
+      }
+      inside = !inside;
+    }
+  }
+  if (in != end) {
+    throw "Corrupt run length";
+  }
+}
+
+/* Writes an occupancy grid y layer by y layer, in order, so a grid classified
+ * in slabs of layers never has to be held whole. Raw bits are appended as
+ * they come, run length encoded layers too, their offset table is filled in
+ * by close. */
+class OccupancyGridWriter {
+private:
+  Header header_;
+  std::ofstream file_;
+  int num_layers_written_ = 0;
+  // Offsets of the encoded layers written so far, run length encoding only
+  std::vector<uint64_t> table_;
+  std::vector<uint8_t> encoded_;
+
+public:
+  // header.encoding selects the encoding
+  OccupancyGridWriter(const char *filepath, const Header &header)
+      : header_(header), file_(filepath, std::ios::binary) {
+    if (!file_) {
+      throw "Could not open file";
+    }
+    file_.write(reinterpret_cast<const char *>(&header_), sizeof(Header));
+    if (header_.encoding == Encoding::RunLength) {
+      // Placeholder for the offset table
+      table_.assign(1, 0);
+      const std::vector<uint64_t> zeros(header_.num_y + 1, 0);
+      file_.write(reinterpret_cast<const char *>(zeros.data()),
+                  zeros.size() * sizeof(uint64_t));
+    }
+  }
+
+  const Header &header() const { return header_; }
+
+  /* Writes the next num_layers y layers from their raw bits, laid out as in
+   * the file: num_layers * layer_bytes(header) bytes, column i of the l-th
+   * layer at (l * num_x + i) * column_bytes(header) */
+  void write_layers(int num_layers, const uint8_t *bits) {
+    if (num_layers_written_ + num_layers > header_.num_y) {
+      throw "Too many occupancy grid layers";
+    }
+    if (header_.encoding == Encoding::Bits) {
+      file_.write(reinterpret_cast<const char *>(bits),
+                  num_layers * layer_bytes(header_));
+    } else {
+      for (int l = 0; l < num_layers; l++) {
+        encoded_.clear();
+        encode_layer(header_, bits + l * layer_bytes(header_), encoded_);
+        file_.write(reinterpret_cast<const char *>(encoded_.data()),
+                    encoded_.size());
+        table_.push_back(table_.back() + encoded_.size());
+      }
+    }
+    num_layers_written_ += num_layers;
+    if (!file_) {
+      throw "Could not write file";
+    }
+  }
+
+  // Once every layer is written, returns the size of the file
+  uint64_t close() {
+    if (num_layers_written_ != header_.num_y) {
+      throw "Missing occupancy grid layers";
+    }
+    const uint64_t file_size = file_.tellp();
+    if (header_.encoding == Encoding::RunLength) {
+      file_.seekp(sizeof(Header));
+      file_.write(reinterpret_cast<const char *>(table_.data()),
+                  table_.size() * sizeof(uint64_t));
+    }
+    file_.close();
+    if (!file_) {
+      throw "Could not write file";
+    }
+    return file_size;
+  }
+};
+
+class OccupancyGrid {
+private:
+  Header header_;
+  std::vector<uint8_t> bits_;
+
+  size_t column_offset(int i, int j) const {
+    return (size_t(j) * header_.num_x + i) * column_bytes(header_);
+  }
+
+public:
+  OccupancyGrid() = default;
+
+  // All points outside
+  OccupancyGrid(const float origin[3], float step, int num_x, int num_y,
+                int num_z) {
+    std::copy(origin, origin + 3, header_.origin);
+    header_.step = step;
+    header_.num_x = num_x;
+    header_.num_y = num_y;
+    header_.num_z = num_z;
+    bits_.assign(size_t(num_y) * layer_bytes(header_), 0);
+  }
+
+  const Header &header() const { return header_; }
+
+  // Size of the grid in memory, the size of the raw bits file minus header
+  size_t memory_bytes() const { return bits_.size(); }
+
+  // Safe to call concurrently, also for points sharing a byte
+  void set(int i, int j, int k) {
+    uint8_t &byte = bits_[column_offset(i, j) + (k >> 3)];
+    const uint8_t mask = uint8_t(1) << (k & 7);
+#pragma omp atomic
+    byte |= mask;
+  }
+
+  bool get(int i, int j, int k) const {
+    return (bits_[column_offset(i, j) + (k >> 3)] >> (k & 7)) & 1;
+  }
+
+  int64_t count() const {
+    int64_t n = 0;
+#pragma omp parallel for reduction(+ : n)
+    for (int64_t b = 0; b < int64_t(bits_.size()); b++) {
+      n += __builtin_popcount(bits_[b]);
+    }
+    return n;
+  }
+
+  // Returns the size of the file
+  uint64_t write(const char *filepath, Encoding encoding) const {
+    Header header = header_;
+    header.encoding = encoding;
+    OccupancyGridWriter writer(filepath, header);
+    writer.write_layers(header_.num_y, bits_.data());
+    return writer.close();
+  }
+
+  static OccupancyGrid read(const char *filepath) {
+    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+    if (!file) {
+      throw "Could not open file";
+    }
+    std::vector<uint8_t> data(size_t(file.tellg()));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(data.data()), data.size()) ||
+        data.size() < sizeof(Header)) {
+      throw "Could not read file";
+    }
+    Header header;
+    std::memcpy(&header, data.data(), sizeof(Header));
+    if (std::memcmp(header.magic, "OCCG", 4) != 0) {
+      throw "Not an occupancy grid file";
+    }
+    if (header.version != Header().version) {
+      throw "Unsupported occupancy grid version";
+    }
+    if (header.num_x < 0 || header.num_y < 0 || header.num_z < 0) {
+      throw "Invalid occupancy grid dimensions";
+    }
+
+    OccupancyGrid grid(header.origin, header.step, header.num_x, header.num_y,
+                       header.num_z);
+    grid.header_.encoding = header.encoding;
+    const uint8_t *payload = data.data() + sizeof(Header);
+    const size_t payload_size = data.size() - sizeof(Header);
+    if (header.encoding == Encoding::Bits) {
+      if (payload_size != grid.bits_.size()) {
+        throw "Truncated occupancy grid";
+      }
+      std::memcpy(grid.bits_.data(), payload, payload_size);
+      return grid;
+    }
+    if (header.encoding != Encoding::RunLength) {
+      throw "Unknown occupancy grid encoding";
+    }
+
+    const int num_y = header.num_y;
+    const size_t table_bytes = (num_y + 1) * sizeof(uint64_t);
+    if (payload_size < table_bytes) {
+      throw "Truncated occupancy grid";
+    }
+    std::vector<uint64_t> table(num_y + 1);
+    std::memcpy(table.data(), payload, table_bytes);
+    const uint8_t *layers = payload + table_bytes;
+    for (int j = 0; j < num_y; j++) {
+      if (table[j] > table[j + 1]) {
+        throw "Corrupt occupancy grid";
+      }
+    }
+    if (table[num_y] != payload_size - table_bytes) {
+      throw "Truncated occupancy grid";
+    }
+    // Exceptions cannot leave an OpenMP region
+    bool ok = true;
+#pragma omp parallel for schedule(dynamic, 1) reduction(&& : ok)
+    for (int j = 0; j < num_y; j++) {
+      try {
+        decode_layer(header, layers + table[j], layers + table[j + 1],
+                     grid.bits_.data() + grid.column_offset(0, j));
+      } catch (const char *) {
+        ok = false;
+      }
+    }
+    if (!ok) {
+      throw "Corrupt run length";
+    }
+    return grid;
+  }
+
+  /* Writes the inside points as N * 3 floats, the .pts format of the apps,
+   * y layer by y layer. Returns the number of points written. */
+  int64_t write_points(const char *filepath) const {
+    std::ofstream file(filepath, std::ios::binary);
+    if (!file) {
+      throw "Could not open file";
+    }
+    const float *origin = header_.origin;
+    const float step = header_.step;
+    int64_t num_points = 0;
+    std::vector<float> points;
+    for (int j = 0; j < header_.num_y; j++) {
+      points.clear();
+      for (int i = 0; i < header_.num_x; i++) {
+        for (int k = 0; k < header_.num_z; k++) {
+          if (get(i, j, k)) {
+            points.insert(points.end(), {i * step + origin[0],
+                                         j * step + origin[1],
+                                         k * step + origin[2]});
+          }
+        }
+      }
+      file.write(reinterpret_cast<const char *>(points.data()),
+                 points.size() * sizeof(float));
+      num_points += points.size() / 3;
+    }
+    if (!file) {
+      throw "Could not write file";
+    }
+    return num_points;
+  }
+};
+
+} // namespace mp::io::occupancy
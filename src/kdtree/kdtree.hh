@@ -0,0 +1,287 @@
+/* Balanced kd-tree over points, for nearest neighbour and radius queries on
+ * the point clouds written by the classification apps (N * 3 floats).
+ * The tree is implicit: points are permuted so that every subtree covers a
+ * contiguous range with its median in the middle, only the split axis of each
+ * median is stored. Small ranges are leaves scanned linearly. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <omp.h>
+#include <utility>
+#include <vector>
+
+#include "vec3.hh"
+
+class KDTree {
+private:
+  // Ranges at most this big are not split
+  static constexpr int LEAF_SIZE = 8;
+  // Ranges smaller than this are built serially
+  static constexpr int MIN_TASK_POINTS = 16384;
+
+  struct Entry {
+    Vec3 point;
+    int index;
+  };
+
+  // Permuted points and their indices in the input
+  std::vector<Vec3> points_;
+  std::vector<int> indices_;
+  // Split axis of the subtree whose median is at each position, unused for
+  // leaf positions
+  std::vector<uint8_t> split_axes_;
+
+  void build(std::vector<Entry> &entries, int lo, int hi) {
+    if (hi - lo <= LEAF_SIZE) {
+      return;
+    }
+    Vec3 min = entries[lo].point, max = entries[lo].point;
+    for (int i = lo + 1; i < hi; i++) {
+      min.min(entries[i].point);
+      max.max(entries[i].point);
+    }
+    Vec3 extent = max - min;
+    int axis = 0;
+    if (extent.y > extent.x) {
+      axis = 1;
+    }
+    if (extent.z > extent[axis]) {
+      axis = 2;
+    }
+
+    const int mid = lo + (hi - lo) / 2;
+    std::nth_element(entries.begin() + lo, entries.begin() + mid,
+                     entries.begin() + hi,
+                     [axis](const Entry &a, const Entry &b) {
+                       return a.point[axis] < b.point[axis];
+                     });
+    split_axes_[mid] = axis;
+
+    if (hi - lo >= MIN_TASK_POINTS) {
+#pragma omp task shared(entries)
+      build(entries, lo, mid);
+      build(entries, mid + 1, hi);
+#pragma omp taskwait
+    } else {
+      build(entries, lo, mid);
+      build(entries, mid + 1, hi);
+    }
+  }
+
+  /* The k nearest found so far, sorted by squared distance. k is small in
+   * practice, insertion into a sorted array beats a heap. */
+  struct Neighbours {
+    std::vector<std::pair<float, int>> items;
+    int k;
+    float worst() const {
+      return int(items.size()) < k ? INFINITY : items.back().first;
+    }
+    void insert(float squared_distance, int position) {
+      if (int(items.size()) == k) {
+        items.pop_back();
+      }
+      auto it = std::upper_bound(
+          items.begin(), items.end(), squared_distance,
+          [](float d, const std::pair<float, int> &item) {
+            return d < item.first;
+          });
+      items.insert(it, {squared_distance, position});
+    }
+  };
+
+  /* box_distance is the squared distance from the query to the cell of the
+   * range, offsets its per axis components, updated incrementally when
+   * crossing a splitting plane as in "An Optimal Algorithm for Approximate
+   * Nearest Neighbor Searching" (Arya et al. 1998) */
+  void knn_search(const Vec3 &query, int lo, int hi, float box_distance,
+                  Vec3 &offsets, Neighbours &neighbours) const {
+    if (hi - lo <= LEAF_SIZE) {
+      for (int i = lo; i < hi; i++) {
+        float d = (points_[i] - query).length_squared();
+        if (d < neighbours.worst()) {
+          neighbours.insert(d, i);
+        }
+      }
+      return;
+    }
+    const int mid = lo + (hi - lo) / 2;
+    const int axis = split_axes_[mid];
+    const float offset = query[axis] - points_[mid][axis];
+    float d = (points_[mid] - query).length_squared();
+    if (d < neighbours.worst()) {
+      neighbours.insert(d, mid);
+    }
+    const int near_lo = offset < 0 ? lo : mid + 1;
+    const int near_hi = offset < 0 ? mid : hi;
+    const int far_lo = offset < 0 ? mid + 1 : lo;
+    const int far_hi = offset < 0 ? hi : mid;
+    knn_search(query, near_lo, near_hi, box_distance, offsets, neighbours);
+
+    // The far cell is as far as the near one, except along the split axis
+    const float old_offset = offsets[axis];
+    const float far_distance =
+        box_distance - old_offset * old_offset + offset * offset;
+    if (far_distance < neighbours.worst()) {
+      offsets[axis] = offset;
+      knn_search(query, far_lo, far_hi, far_distance, offsets, neighbours);
+      offsets[axis] = old_offset;
+    }
+  }
+
+  void radius_search(const Vec3 &query, float squared_radius, int lo, int hi,
+                     std::vector<int> &out) const {
+    if (hi - lo <= LEAF_SIZE) {
+      for (int i = lo; i < hi; i++) {
+        if ((points_[i] - query).length_squared() <= squared_radius) {
+          out.push_back(indices_[i]);
+        }
+      }
+      return;
+    }
+    const int mid = lo + (hi - lo) / 2;
+    const int axis = split_axes_[mid];
+    const float offset = query[axis] - points_[mid][axis];
+    if ((points_[mid] - query).length_squared() <= squared_radius) {
+      out.push_back(indices_[mid]);
+    }
+    if (offset < 0 || offset * offset <= squared_radius) {
+      radius_search(query, squared_radius, lo, mid, out);
+    }
+    if (offset >= 0 || offset * offset <= squared_radius) {
+      radius_search(query, squared_radius, mid + 1, hi, out);
+    }
+  }
+
+  void knn(const Vec3 &query, int k, Neighbours &neighbours, int *indices,
+           float *squared_distances) const {
+    neighbours.items.clear();
+    neighbours.k = k;
+    Vec3 offsets(0.0f);
+    knn_search(query, 0, points_.size(), 0.0f, offsets, neighbours);
+    for (int i = 0; i < k; i++) {
+      if (i < int(neighbours.items.size())) {
+        indices[i] = indices_[neighbours.items[i].second];
+        squared_distances[i] = neighbours.items[i].first;
+      } else {
+        indices[i] = -1;
+        squared_distances[i] = INFINITY;
+      }
+    }
+  }
+
+public:
+  // Copies the points, the tree does not refer to them afterwards
+  explicit KDTree(const std::vector<Vec3> &points) {
+    const int n = points.size();
+    std::vector<Entry> entries(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      entries[i] = {points[i], i};
+    }
+    split_axes_.resize(n);
+
+#pragma omp parallel
+#pragma omp single
+    build(entries, 0, n);
+
+    points_.resize(n);
+    indices_.resize(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++) {
+      points_[i] = entries[i].point;
+      indices_[i] = entries[i].index;
+    }
+  }
+
+  int size() const { return points_.size(); }
+
+  /* The k points nearest to query, closest first, as indices into the input
+   * points. Missing neighbours (fewer than k points) are -1 at INFINITY,
+   * k <= 0 finds none. */
+  void knn(const Vec3 &query, int k, std::vector<int> &indices,
+           std::vector<float> &squared_distances) const {
+    if (k <= 0) {
+      indices.clear();
+      squared_distances.clear();
+      return;
+    }
+    Neighbours neighbours;
+    indices.resize(k);
+    squared_distances.resize(k);
+    knn(query, k, neighbours, indices.data(), squared_distances.data());
+  }
+
+  // Appends the indices of the points within radius of query, in no
+  // particular order
+  void radius(const Vec3 &query, float radius, std::vector<int> &out) const {
+    radius_search(query, radius * radius, 0, points_.size(), out);
+  }
+
+  /* kNN of many queries in parallel, the neighbours of queries[i] are
+   * indices[k * i, k * i + k), see knn. Neighbouring queries should be close
+   * to each other so threads keep revisiting the same part of the tree. */
+  void knn_batch(const std::vector<Vec3> &queries, int k,
+                 std::vector<int> &indices,
+                 std::vector<float> &squared_distances) const {
+    if (k <= 0) {
+      indices.clear();
+      squared_distances.clear();
+      return;
+    }
+    const int num_queries = queries.size();
+    indices.resize(size_t(num_queries) * k);
+    squared_distances.resize(size_t(num_queries) * k);
+#pragma omp parallel
+    {
+      Neighbours neighbours;
+      neighbours.items.reserve(k);
+#pragma omp for schedule(dynamic, 256)
+      for (int i = 0; i < num_queries; i++) {
+        knn(queries[i], k, neighbours, &indices[size_t(i) * k],
+            &squared_distances[size_t(i) * k]);
+      }
+    }
+  }
+
+  /* Radius search for many queries in parallel, the points within radius of
+   * queries[i] are indices[offsets[i], offsets[i + 1]). Each thread answers a
+   * contiguous block of queries into its own buffer, the buffers are then
+   * concatenated in order. */
+  void radius_batch(const std::vector<Vec3> &queries, float radius,
+                    std::vector<int> &offsets,
+                    std::vector<int> &indices) const {
+    const int num_queries = queries.size();
+    const float squared_radius = radius * radius;
+    offsets.assign(num_queries + 1, 0);
+    std::vector<std::vector<int>> thread_indices(omp_get_max_threads());
+    std::vector<size_t> thread_starts(thread_indices.size() + 1, 0);
+#pragma omp parallel
+    {
+      std::vector<int> &local = thread_indices[omp_get_thread_num()];
+      // Static without a chunk size hands out contiguous blocks in thread
+      // order
+#pragma omp for schedule(static)
+      for (int i = 0; i < num_queries; i++) {
+        size_t before = local.size();
+        radius_search(queries[i], squared_radius, 0, points_.size(), local);
+        offsets[i + 1] = local.size() - before;
+      }
+#pragma omp single
+      {
+        for (size_t t = 0; t < thread_indices.size(); t++) {
+          thread_starts[t + 1] = thread_starts[t] + thread_indices[t].size();
+        }
+        indices.resize(thread_starts.back());
+        for (int i = 0; i < num_queries; i++) {
+          offsets[i + 1] += offsets[i];
+        }
+      }
+      const int t = omp_get_thread_num();
+      std::copy(thread_indices[t].begin(), thread_indices[t].end(),
+                indices.begin() + thread_starts[t]);
+    }
+  }
+};
@@ -0,0 +1,269 @@
+/* Sparse narrow band signed distance volume.
+ * Voxels live on an infinite lattice with spacing voxel_size anchored at the
+ * world origin, grouped into 8^3 bricks that are only allocated within
+ * band_width of the surface, so memory grows with surface area rather than
+ * with the volume of the bounding box (the layout of OpenVDB leaf nodes).
+ * Distances are negative inside, magnitudes come from BVH closest point
+ * queries and are clamped to band_width. */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <omp.h>
+#include <unordered_map>
+#include <vector>
+
+#include "bvh.hh"
+#include "fast_winding_number.hh"
+#include "solid_angle.hh"
+#include "vec3.hh"
+
+enum class SDFSignMethod {
+  // Majority vote of the parity of up to 3 rays, needs a closed mesh
+  RayParity,
+  // Generalized winding number, robust to holes and self intersections.
+  // Evaluated with FastWindingNumber, or summed over every triangle of the
+  // mesh with SolidAngleTriangles when the BVH has spatial splits
+  WindingNumber,
+};
+
+struct SDFBrick {
+  static constexpr int SIZE = 8;
+  static constexpr int NUM_VOXELS = SIZE * SIZE * SIZE;
+  // Brick coordinates, the brick covers voxels [SIZE * x, SIZE * x + SIZE)
+  int x, y, z;
+  // x fastest
+  float values[NUM_VOXELS];
+};
+
+class SDFVolume {
+private:
+  float voxel_size_;
+  float band_width_;
+  std::vector<SDFBrick> bricks_;
+  std::unordered_map<uint64_t, int> brick_lookup_;
+
+  // 21 bits per brick coordinate, enough for 2^24 voxels per axis
+  static uint64_t brick_key(int x, int y, int z) {
+    const int offset = 1 << 20;
+    return (uint64_t(x + offset) << 42) | (uint64_t(y + offset) << 21) |
+           uint64_t(z + offset);
+  }
+
+  static int floor_div(int a, int b) {
+    return a >= 0 ? a / b : -((-a - 1) / b) - 1;
+  }
+
+  Vec3 voxel_position(int i, int j, int k) const {
+    return {i * voxel_size_, j * voxel_size_, k * voxel_size_};
+  }
+
+  // Keys of every brick whose voxels may lie within the band of a triangle
+  std::vector<uint64_t> find_band_bricks(const std::vector<BVHTriangle> &tris) {
+    const float brick_size = voxel_size_ * SDFBrick::SIZE;
+    // From the brick center to its farthest voxel center
+    const float brick_radius =
+        0.5f * (SDFBrick::SIZE - 1) * voxel_size_ * std::sqrt(3.0f);
+    const float reach = band_width_ + brick_radius;
+
+    std::vector<std::vector<uint64_t>> thread_keys(omp_get_max_threads());
+    const int num_tris = tris.size();
+#pragma omp parallel
+    {
+      std::vector<uint64_t> &keys = thread_keys[omp_get_thread_num()];
+#pragma omp for schedule(dynamic, 1024)
+      for (int t = 0; t < num_tris; t++) {
+        const BVHTriangle &tri = tris[t];
+        BBox bbox = tri.calc_bounding_box();
+        int lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis++) {
+          lo[axis] = int(std::floor((bbox.min[axis] - band_width_) /
+                                    brick_size));
+          hi[axis] = int(std::floor((bbox.max[axis] + band_width_) /
+                                    brick_size));
+        }
+        for (int x = lo[0]; x <= hi[0]; x++) {
+          for (int y = lo[1]; y <= hi[1]; y++) {
+            for (int z = lo[2]; z <= hi[2]; z++) {
+              Vec3 center = voxel_position(SDFBrick::SIZE * x,
+                                           SDFBrick::SIZE * y,
+                                           SDFBrick::SIZE * z) +
+                            Vec3(0.5f * (SDFBrick::SIZE - 1) * voxel_size_);
+              Vec3 closest =
+                  closest_point_on_triangle(center, tri.a, tri.b, tri.c);
+              if ((closest - center).length_squared() <= reach * reach) {
+                keys.push_back(brick_key(x, y, z));
+              }
+            }
+          }
+        }
+      }
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    }
+
+    std::vector<uint64_t> keys;
+    for (const auto &k : thread_keys) {
+      keys.insert(keys.end(), k.begin(), k.end());
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+  }
+
+  // Winding numbers come from fwn when set, otherwise from exact
+  bool is_inside(const BVH &bvh, const FastWindingNumber *fwn,
+                 const SolidAngleTriangles *exact, const Vec3 &p,
+                 SDFSignMethod sign_method) const {
+    if (sign_method == SDFSignMethod::WindingNumber) {
+      return fwn ? fwn->winding_number(p) >= 0.5f
+                 : exact->winding_number(p) >= 0.5;
+    }
+    // Skewed directions, axis aligned rays would graze the edges of meshes
+    // aligned with the voxel lattice
+    static const Vec3 directions[3] = {Vec3(1.0f, 0.37f, 0.21f).normalized(),
+                                       Vec3(-0.29f, 1.0f, 0.43f).normalized(),
+                                       Vec3(0.31f, -0.47f, 1.0f).normalized()};
+    // Parity is exact on closed meshes, the other rays only guard against
+    // holes, so the third ray is cast only when the first two disagree
+    int votes = 0;
+    for (int i = 0; i < 3; i++) {
+      BVHRay ray;
+      ray.O = p;
+      ray.D = directions[i];
+      votes += bvh.count_ray_hits(ray) % 2;
+      if (i == 1 && votes != 1) {
+        break;
+      }
+    }
+    return votes >= 2;
+  }
+
+  /* The sign is only evaluated near the surface: a voxel is on the same side
+   * as the previous voxel of the brick whenever the previous voxel is farther
+   * than one voxel from the surface, since the segment between them cannot
+   * cross it. */
+  void fill_brick(SDFBrick &brick, const BVH &bvh,
+                  const FastWindingNumber *fwn,
+                  const SolidAngleTriangles *exact,
+                  SDFSignMethod sign_method) const {
+    const int n = SDFBrick::SIZE;
+    const float max_squared_distance = band_width_ * band_width_;
+    for (int k = 0; k < n; k++) {
+      for (int j = 0; j < n; j++) {
+        for (int i = 0; i < n; i++) {
+          const int v = i + n * (j + n * k);
+          const Vec3 p = voxel_position(n * brick.x + i, n * brick.y + j,
+                                        n * brick.z + k);
+          BVHClosestPoint closest = bvh.closest_point(p, max_squared_distance);
+          float distance = closest.tri_index < 0
+                               ? band_width_
+                               : std::sqrt(closest.squared_distance);
+
+          // Previous voxel along x, then y, then z
+          int previous = i > 0   ? v - 1
+                         : j > 0 ? v - n
+                         : k > 0 ? v - n * n
+                                 : -1;
+          bool inside;
+          if (previous >= 0 &&
+              std::abs(brick.values[previous]) > voxel_size_) {
+            inside = brick.values[previous] < 0;
+          } else {
+            inside = is_inside(bvh, fwn, exact, p, sign_method);
+          }
+          brick.values[v] = inside ? -distance : distance;
+        }
+      }
+    }
+  }
+
+public:
+  /* Fills every brick within band_width of the surface of tris, bvh must be
+   * built from tris */
+  SDFVolume(const std::vector<BVHTriangle> &tris, const BVH &bvh,
+            float voxel_size, float band_width,
+            SDFSignMethod sign_method = SDFSignMethod::RayParity)
+      : voxel_size_(voxel_size), band_width_(band_width) {
+    if (voxel_size <= 0.0f || band_width <= 0.0f) {
+      throw "Voxel size and band width must be positive";
+    }
+
+    std::vector<uint64_t> keys = find_band_bricks(tris);
+    const int num_bricks = keys.size();
+    bricks_.resize(num_bricks);
+    brick_lookup_.reserve(num_bricks);
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+    const int offset = 1 << 20;
+    for (int b = 0; b < num_bricks; b++) {
+      bricks_[b].x = int((keys[b] >> 42) & mask) - offset;
+      bricks_[b].y = int((keys[b] >> 21) & mask) - offset;
+      bricks_[b].z = int(keys[b] & mask) - offset;
+      brick_lookup_[keys[b]] = b;
+    }
+
+    // FastWindingNumber needs each triangle in a single leaf
+    std::unique_ptr<FastWindingNumber> fwn;
+    std::unique_ptr<SolidAngleTriangles> exact;
+    if (sign_method == SDFSignMethod::WindingNumber) {
+      if (bvh.tri_indices().size() == tris.size()) {
+        fwn = std::make_unique<FastWindingNumber>(tris, bvh);
+      } else {
+        exact = std::make_unique<SolidAngleTriangles>(tris);
+      }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < num_bricks; b++) {
+      fill_brick(bricks_[b], bvh, fwn.get(), exact.get(), sign_method);
+    }
+  }
+
+  float voxel_size() const { return voxel_size_; }
+  float band_width() const { return band_width_; }
+  const std::vector<SDFBrick> &bricks() const { return bricks_; }
+
+  // Brick memory plus the lookup table
+  size_t memory_bytes() const {
+    return bricks_.size() * sizeof(SDFBrick) +
+           brick_lookup_.bucket_count() * sizeof(void *) +
+           brick_lookup_.size() *
+               (sizeof(uint64_t) + sizeof(int) + 2 * sizeof(void *));
+  }
+
+  /* Value at voxel (i, j, k), located at voxel_size * (i, j, k). Voxels
+   * outside the band return +band_width, their sign is not known. */
+  float voxel(int i, int j, int k) const {
+    const int n = SDFBrick::SIZE;
+    int x = floor_div(i, n), y = floor_div(j, n), z = floor_div(k, n);
+    auto it = brick_lookup_.find(brick_key(x, y, z));
+    if (it == brick_lookup_.end()) {
+      return band_width_;
+    }
+    const SDFBrick &brick = bricks_[it->second];
+    return brick.values[(i - n * x) + n * ((j - n * y) + n * (k - n * z))];
+  }
+
+  // Trilinear interpolation of the voxel values around p
+  float sample(const Vec3 &p) const {
+    float g[3] = {p.x / voxel_size_, p.y / voxel_size_, p.z / voxel_size_};
+    int base[3];
+    float f[3];
+    for (int axis = 0; axis < 3; axis++) {
+      float fl = std::floor(g[axis]);
+      base[axis] = int(fl);
+      f[axis] = g[axis] - fl;
+    }
+    float value = 0.0f;
+    for (int corner = 0; corner < 8; corner++) {
+      int di = corner & 1, dj = (corner >> 1) & 1, dk = (corner >> 2) & 1;
+      float weight = (di ? f[0] : 1.0f - f[0]) * (dj ? f[1] : 1.0f - f[1]) *
+                     (dk ? f[2] : 1.0f - f[2]);
+      value += weight * voxel(base[0] + di, base[1] + dj, base[2] + dk);
+    }
+    return value;
+  }
+};
@@ -58,6 +58,7 @@ private:
 public:
   Timer() { tick(); }
   void tick() { start_ = Clock::now(); }
+  Nanoseconds elapsed() const { return Clock::now() - start_; }
   void tock(std::string message = "Timer") {
     Timepoint end = Clock::now();
     Nanoseconds duration = end - start_;